@@ -0,0 +1,192 @@
+/*
+ * Copyright 2009, R. Tyler Ballance <tyler@monkeypox.org>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */ 
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/*
+ * Every allocation is preceded by a header recording its size, so realloc
+ * knows how much to copy.  Blocks start with a header linking them into the
+ * retired list.
+ */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~((size_t)(ARENA_ALIGN - 1)))
+#define ARENA_HEADER ARENA_ROUND(sizeof(size_t))
+
+#define ALLOCATION_SIZE(ptr) (*(size_t *)((char *)(ptr) - ARENA_HEADER))
+
+static int IsInline(py_yajl_arena *arena, char *block)
+{
+    return block == arena->inline_block.bytes;
+}
+
+static int Grow(py_yajl_arena *arena, size_t need)
+{
+    size_t size = arena->size * 2;
+    char *block;
+
+    while (size < need + ARENA_HEADER)
+        size *= 2;
+    block = (char *)(malloc(size));
+    if (!block)
+        return 0;
+
+    *(void **)(arena->block) = arena->retired;
+    arena->retired = arena->block;
+    arena->block = block;
+    arena->size = size;
+    arena->used = ARENA_HEADER;
+    return 1;
+}
+
+static void *ArenaMalloc(void *ctx, size_t sz)
+{
+    py_yajl_arena *arena = (py_yajl_arena *)(ctx);
+    size_t need = ARENA_HEADER + ARENA_ROUND(sz);
+    char *ptr;
+
+    if ((arena->used + need > arena->size) && (!Grow(arena, need)))
+        return NULL;
+
+    ptr = arena->block + arena->used + ARENA_HEADER;
+    ALLOCATION_SIZE(ptr) = sz;
+    arena->used += need;
+    arena->footprint += need;
+    return ptr;
+}
+
+static int IsLast(py_yajl_arena *arena, char *ptr)
+{
+    return ptr + ARENA_ROUND(ALLOCATION_SIZE(ptr)) == arena->block + arena->used;
+}
+
+/*
+ * yajl's buffers double as they fill, so the buffer being grown is usually
+ * the most recent allocation and can be extended where it is
+ */
+static void *ArenaRealloc(void *ctx, void *ptr, size_t sz)
+{
+    py_yajl_arena *arena = (py_yajl_arena *)(ctx);
+    size_t old;
+    char *fresh;
+
+    if (!ptr)
+        return ArenaMalloc(ctx, sz);
+
+    old = ALLOCATION_SIZE(ptr);
+    if (IsLast(arena, (char *)(ptr))) {
+        size_t start = (char *)(ptr) - arena->block;
+
+        if (start + ARENA_ROUND(sz) <= arena->size) {
+            arena->used = start + ARENA_ROUND(sz);
+            arena->footprint += ARENA_ROUND(sz) - ARENA_ROUND(old);
+            ALLOCATION_SIZE(ptr) = sz;
+            return ptr;
+        }
+    } else if (sz <= old) {
+        return ptr;
+    }
+
+    fresh = (char *)(ArenaMalloc(ctx, sz));
+    if (fresh)
+        memcpy(fresh, ptr, (old < sz) ? old : sz);
+    return fresh;
+}
+
+/* Only the most recent allocation is actually given back */
+static void ArenaFree(void *ctx, void *ptr)
+{
+    py_yajl_arena *arena = (py_yajl_arena *)(ctx);
+
+    if ((ptr) && (IsLast(arena, (char *)(ptr)))) {
+        size_t need = ARENA_HEADER + ARENA_ROUND(ALLOCATION_SIZE(ptr));
+
+        arena->used -= need;
+        arena->footprint -= need;
+    }
+}
+
+void py_yajl_arena_init(py_yajl_arena *arena)
+{
+    arena->block = arena->inline_block.bytes;
+    arena->size = PY_YAJL_ARENA_INLINE;
+    arena->used = ARENA_HEADER;
+    arena->retired = NULL;
+    arena->footprint = 0;
+    arena->funcs.malloc = ArenaMalloc;
+    arena->funcs.realloc = ArenaRealloc;
+    arena->funcs.free = ArenaFree;
+    arena->funcs.ctx = (void *)(arena);
+}
+
+/*
+ * With nothing outgrown this is just rewinding the current block.  Otherwise
+ * the chain is replaced by one block big enough for what was in use, so the
+ * next document of the same size fits without growing.
+ */
+void py_yajl_arena_reset(py_yajl_arena *arena)
+{
+    if (arena->retired) {
+        size_t size = arena->size;
+        char *block;
+
+        while (size < arena->footprint + ARENA_HEADER)
+            size *= 2;
+        py_yajl_arena_free(arena);
+        block = (char *)(malloc(size));
+        if (block) {
+            arena->block = block;
+            arena->size = size;
+        }
+    }
+    arena->used = ARENA_HEADER;
+    arena->footprint = 0;
+}
+
+void py_yajl_arena_free(py_yajl_arena *arena)
+{
+    while (arena->retired) {
+        char *block = (char *)(arena->retired);
+
+        arena->retired = *(void **)(block);
+        if (!IsInline(arena, block))
+            free(block);
+    }
+    if (!IsInline(arena, arena->block))
+        free(arena->block);
+    arena->block = arena->inline_block.bytes;
+    arena->size = PY_YAJL_ARENA_INLINE;
+    arena->used = ARENA_HEADER;
+    arena->footprint = 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2009, R. Tyler Ballance <tyler@monkeypox.org>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */ 
+
+/*
+ * A bump-pointer arena handed to yajl as its yajl_alloc_funcs, so that the
+ * parser's and generator's internal buffers come out of memory the decoder
+ * or encoder already owns.  The first block is part of the arena itself;
+ * larger documents chain further blocks, which a reset folds into a single
+ * block the size of everything that was in use, ready for the next one.
+ */
+
+#ifndef __PY_YAJL_ARENA_H__
+#define __PY_YAJL_ARENA_H__
+
+#include <stddef.h>
+#include <yajl/yajl_common.h>
+
+#define PY_YAJL_ARENA_INLINE 8192
+
+typedef struct py_yajl_arena_t
+{
+    char *block;                /* current block */
+    size_t size;
+    size_t used;
+    void *retired;              /* blocks outgrown since the last reset */
+    size_t footprint;           /* bytes handed out across all blocks */
+    yajl_alloc_funcs funcs;
+    union {
+        char bytes[PY_YAJL_ARENA_INLINE];
+        long double align;
+    } inline_block;
+} py_yajl_arena;
+
+/* initialize an arena, pointing its funcs at it */
+void py_yajl_arena_init(py_yajl_arena *arena);
+
+/* forget every allocation; only valid once yajl has freed its handle */
+void py_yajl_arena_reset(py_yajl_arena *arena);
+
+/* release any heap blocks */
+void py_yajl_arena_free(py_yajl_arena *arena);
+
+#endif
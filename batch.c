@@ -0,0 +1,610 @@
+/*
+ * Copyright 2009, R. Tyler Ballance <tyler@monkeypox.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "py_yajl.h"
+
+/*
+ * yajl.loads_many() and yajl.load_ndjson_parallel(): independent documents
+ * are parsed into tapes by a pool of native threads with the GIL released,
+ * then decoded in order on the calling thread.  Inputs are handed out
+ * largest first from a shared counter, so whichever thread is free takes
+ * the next one and a few big documents don't end up queued behind each
+ * other.
+ */
+typedef struct {
+    const char *text;
+    size_t length;
+    PyObject *tape;
+} BatchInput;
+
+typedef struct {
+    size_t length;
+    size_t index;
+} BatchOrder;
+
+typedef struct {
+    BatchInput *inputs;
+    BatchOrder *order;      /* largest first */
+    size_t count;
+    size_t size;
+    size_t next;            /* next entry of `order` to hand out */
+    pthread_mutex_t lock;
+} Batch;
+
+static void InitBatch(Batch *batch)
+{
+    batch->inputs = NULL;
+    batch->order = NULL;
+    batch->count = batch->size = 0;
+}
+
+/* Drops the inputs' tapes, keeping the arrays for the next batch */
+static void ClearBatch(Batch *batch)
+{
+    size_t i;
+
+    for (i = 0; i < batch->count; i++) {
+        Py_XDECREF(batch->inputs[i].tape);
+    }
+    batch->count = 0;
+}
+
+static void FreeBatch(Batch *batch)
+{
+    ClearBatch(batch);
+    free(batch->inputs);
+    free(batch->order);
+    InitBatch(batch);
+}
+
+static int AddInput(Batch *batch, const char *text, size_t length, int multiple)
+{
+    BatchInput *input;
+
+    if (batch->count == batch->size) {
+        size_t size = batch->size ? batch->size * 2 : 64;
+        BatchInput *inputs = (BatchInput *)(realloc(batch->inputs, size * sizeof(BatchInput)));
+        BatchOrder *order;
+
+        if (!inputs) {
+            PyErr_NoMemory();
+            return failure;
+        }
+        batch->inputs = inputs;
+        order = (BatchOrder *)(realloc(batch->order, size * sizeof(BatchOrder)));
+        if (!order) {
+            PyErr_NoMemory();
+            return failure;
+        }
+        batch->order = order;
+        batch->size = size;
+    }
+
+    input = &batch->inputs[batch->count];
+    input->tape = _internal_tape_new(text, multiple);
+    if (!input->tape)
+        return failure;
+    input->text = text;
+    input->length = length;
+    batch->order[batch->count].length = length;
+    batch->order[batch->count].index = batch->count;
+    batch->count++;
+    return success;
+}
+
+static int CompareLength(const void *a, const void *b)
+{
+    size_t x = ((const BatchOrder *)(a))->length;
+    size_t y = ((const BatchOrder *)(b))->length;
+
+    return (x < y) - (x > y);
+}
+
+static void *BatchWorker(void *arg)
+{
+    Batch *batch = (Batch *)(arg);
+    BatchInput *input;
+    size_t i;
+
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->count)
+            break;
+
+        input = &batch->inputs[batch->order[i].index];
+        _internal_tape_parse(input->tape, input->length);
+    }
+    return NULL;
+}
+
+/*
+ * Parses every tape, with at most `threads` threads (one per CPU if 0); the
+ * calling thread works alongside the pool
+ */
+static void RunBatch(Batch *batch, int threads)
+{
+    pthread_t *workers = NULL;
+    int started = 0, i;
+
+    if (threads <= 0)
+        threads = (int)(sysconf(_SC_NPROCESSORS_ONLN));
+    if ((threads <= 0) || ((size_t)(threads) > batch->count))
+        threads = (batch->count > 0) ? (int)(batch->count) : 1;
+
+    qsort(batch->order, batch->count, sizeof(BatchOrder), CompareLength);
+    batch->next = 0;
+    pthread_mutex_init(&batch->lock, NULL);
+
+    if (threads > 1)
+        workers = (pthread_t *)(malloc((threads - 1) * sizeof(pthread_t)));
+
+    Py_BEGIN_ALLOW_THREADS
+    /* if threads can't be had, the ones running do all the work */
+    if (workers) {
+        for (started = 0; started < threads - 1; started++) {
+            if (pthread_create(&workers[started], NULL, BatchWorker, (void *)(batch)) != 0)
+                break;
+        }
+    }
+    BatchWorker((void *)(batch));
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    Py_END_ALLOW_THREADS
+
+    free(workers);
+    pthread_mutex_destroy(&batch->lock);
+}
+
+/*
+ * Decodes the parsed tapes in input order.  A document that isn't valid JSON
+ * gets its ValueError in its place in the list; anything else, running out
+ * of memory say, fails the whole batch.
+ */
+static PyObject *CollectBatch(Batch *batch, _YajlDecoder *decoder)
+{
+    PyObject *results, *result;
+    PyObject *type, *value, *traceback;
+    size_t i;
+
+    results = PyList_New(batch->count);
+    if (!results)
+        return NULL;
+
+    for (i = 0; i < batch->count; i++) {
+        result = _internal_tape_decode(decoder, batch->inputs[i].tape);
+        Py_CLEAR(batch->inputs[i].tape);
+
+        if ((!result) && PyErr_ExceptionMatches(PyExc_ValueError)) {
+            PyErr_Fetch(&type, &value, &traceback);
+            PyErr_NormalizeException(&type, &value, &traceback);
+            Py_XDECREF(type);
+            Py_XDECREF(traceback);
+            result = value;
+        }
+        if (!result) {
+            Py_CLEAR(results);
+            break;
+        }
+        PyList_SET_ITEM(results, i, result);
+    }
+    return results;
+}
+
+PyObject *_internal_loads_many(PyObject *sequence, int threads)
+{
+    PyObject *fast;
+    PyObject *results = NULL;
+    Py_buffer *views;
+    Py_ssize_t count, ready = 0, i;
+    Batch batch;
+    _YajlDecoder decoder;
+
+    fast = PySequence_Fast(sequence, "loads_many() expects a sequence of strings");
+    if (!fast)
+        return NULL;
+
+    InitBatch(&batch);
+    count = PySequence_Fast_GET_SIZE(fast);
+    views = (Py_buffer *)(malloc((count + 1) * sizeof(Py_buffer)));
+    if (!views) {
+        PyErr_NoMemory();
+        goto exit;
+    }
+
+    for (ready = 0; ready < count; ready++) {
+        if (_internal_get_stable_input(PySequence_Fast_GET_ITEM(fast, ready),
+                                       &views[ready]) != success)
+            goto exit;
+        if (AddInput(&batch, (const char *)(views[ready].buf), views[ready].len, 0) != success) {
+            PyBuffer_Release(&views[ready]);
+            goto exit;
+        }
+    }
+
+    RunBatch(&batch, threads);
+
+    _internal_decode_init(&decoder);
+    results = CollectBatch(&batch, &decoder);
+    _internal_decode_free(&decoder);
+
+exit:
+    FreeBatch(&batch);
+    for (i = 0; i < ready; i++) {
+        PyBuffer_Release(&views[i]);
+    }
+    free(views);
+    Py_DECREF(fast);
+    return results;
+}
+
+/*
+ * yajl.load_ndjson_parallel(): the file is taken a window at a time, cut
+ * back to the last newline in it, and the window is split at newlines into
+ * a few shards per thread.  Each shard is parsed as one tape of multiple
+ * values.  Regular files are mapped, and each window's pages are given back
+ * once it's decoded, so memory stays bounded by the window rather than the
+ * file; anything else is read() into a buffer that carries the partial last
+ * record over to the next window.
+ */
+#define PY_YAJL_NDJSON_WINDOW (1 << 20)
+#define PY_YAJL_NDJSON_SHARDS 4     /* per thread */
+
+typedef struct {
+    PyObject_HEAD
+    int fd;
+    char *mapping;
+    size_t size;            /* mapped: size of the file */
+    size_t offset;          /* mapped: start of the next window */
+    char *buffer;           /* read: text of the next window so far */
+    size_t used;
+    size_t buffer_size;
+    size_t consumed;        /* read: leading bytes already handed out */
+    size_t window;
+    int threads;
+    int finished;
+    Batch batch;
+    _YajlDecoder decoder;   /* decoder.values holds the window's records */
+    Py_ssize_t index;
+    PyObject *error_type;   /* raised once the records before it are out */
+    PyObject *error_value;
+    PyObject *error_traceback;
+} NDJSONIteratorObject;
+
+static void NDJSONIterator_dealloc(NDJSONIteratorObject *self)
+{
+    if (self->fd >= 0)
+        close(self->fd);
+    if (self->mapping)
+        munmap(self->mapping, self->size);
+    free(self->buffer);
+    FreeBatch(&self->batch);
+    _internal_decode_free(&self->decoder);
+    Py_XDECREF(self->error_type);
+    Py_XDECREF(self->error_value);
+    Py_XDECREF(self->error_traceback);
+    PyObject_Del(self);
+}
+
+/* Length of the text up to and including the last newline, or 0 */
+static size_t WholeRecords(const char *text, size_t length)
+{
+    while (length > 0) {
+        if (text[length - 1] == '\n')
+            return length;
+        length--;
+    }
+    return 0;
+}
+
+/* The next window of the mapping, ending after a newline unless at EOF */
+static size_t NextMappedWindow(NDJSONIteratorObject *self, const char **text)
+{
+    const char *start = self->mapping + self->offset;
+    size_t left = self->size - self->offset;
+    size_t length = (left > self->window) ? self->window : left;
+    const char *newline;
+
+    if (length < left) {
+        size_t whole = WholeRecords(start, length);
+
+        if (whole > 0) {
+            length = whole;
+        } else {
+            /* a record longer than the window */
+            newline = (const char *)(memchr(start + length, '\n', left - length));
+            length = newline ? (size_t)(newline - start + 1) : left;
+        }
+    }
+    *text = start;
+    self->offset += length;
+    return length;
+}
+
+/* The next window read from the file; -1 with an exception set on errors */
+static Py_ssize_t NextReadWindow(NDJSONIteratorObject *self, const char **text)
+{
+    size_t whole = 0;
+    ssize_t rc = 1;
+
+    memmove(self->buffer, self->buffer + self->consumed,
+            self->used - self->consumed);
+    self->used -= self->consumed;
+    self->consumed = 0;
+
+    for (;;) {
+        if (self->used == self->buffer_size) {
+            size_t size = self->buffer_size * 2;
+            char *buffer = (char *)(realloc(self->buffer, size));
+
+            if (!buffer) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            self->buffer = buffer;
+            self->buffer_size = size;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        rc = read(self->fd, self->buffer + self->used, self->buffer_size - self->used);
+        Py_END_ALLOW_THREADS
+        if (rc < 0) {
+            PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
+        self->used += rc;
+
+        if (rc == 0) {
+            whole = self->used;
+            break;
+        }
+        if (self->used >= self->window) {
+            whole = WholeRecords(self->buffer, self->used);
+            if (whole > 0)
+                break;
+        }
+    }
+    *text = self->buffer;
+    self->consumed = whole;
+    return whole;
+}
+
+/*
+ * Parses the next window onto decoder.values; sets `finished` at the end.  A
+ * parse error is kept back until the records before it have been handed
+ * out.
+ */
+static int NDJSONIterator_fill(NDJSONIteratorObject *self)
+{
+    PyObject *values = self->decoder.values;
+    const char *text, *end, *cut, *newline;
+    Py_ssize_t length;
+    size_t shard;
+    PyObject *rc;
+    size_t i;
+
+    if (PyList_SetSlice(values, 0, PyList_GET_SIZE(values), NULL) < 0)
+        return failure;
+    self->index = 0;
+
+    if (self->mapping) {
+        /* the last window's pages aren't needed again */
+        size_t done = self->offset & ~((size_t)(sysconf(_SC_PAGESIZE)) - 1);
+
+#ifdef MADV_DONTNEED
+        madvise(self->mapping, done, MADV_DONTNEED);
+#endif
+        length = (self->offset < self->size) ? NextMappedWindow(self, &text) : 0;
+    } else if (self->fd >= 0) {
+        length = NextReadWindow(self, &text);
+        if (length < 0)
+            return failure;
+    } else {
+        length = 0;
+    }
+    if (length == 0) {
+        self->finished = 1;
+        return success;
+    }
+
+    end = text + length;
+    shard = length / (self->threads * PY_YAJL_NDJSON_SHARDS) + 1;
+    while (text < end) {
+        cut = ((size_t)(end - text) > shard) ? text + shard : end;
+        if (cut < end) {
+            newline = (const char *)(memchr(cut, '\n', end - cut));
+            cut = newline ? newline + 1 : end;
+        }
+        /* yajl wants at least one value even from a multiple values parse */
+        if ((!_internal_is_blank(text, (unsigned int)(cut - text))) &&
+                (AddInput(&self->batch, text, cut - text, 1) != success)) {
+            ClearBatch(&self->batch);
+            return failure;
+        }
+        text = cut;
+    }
+
+    RunBatch(&self->batch, self->threads);
+
+    for (i = 0; i < self->batch.count; i++) {
+        rc = _internal_tape_decode(&self->decoder, self->batch.inputs[i].tape);
+        if (!rc) {
+            PyErr_Fetch(&self->error_type, &self->error_value, &self->error_traceback);
+            break;
+        }
+        Py_DECREF(rc);
+    }
+    ClearBatch(&self->batch);
+    return success;
+}
+
+static PyObject *NDJSONIterator_next(NDJSONIteratorObject *self)
+{
+    PyObject *values = self->decoder.values;
+    PyObject *value;
+
+    while (self->index >= PyList_GET_SIZE(values)) {
+        if (self->error_type) {
+            PyErr_Restore(self->error_type, self->error_value, self->error_traceback);
+            self->error_type = self->error_value = self->error_traceback = NULL;
+            self->finished = 1;
+        }
+        if (self->finished)
+            return NULL;
+        if (NDJSONIterator_fill(self) != success) {
+            self->finished = 1;
+            return NULL;
+        }
+    }
+
+    value = PyList_GET_ITEM(values, self->index);
+    self->index++;
+    Py_INCREF(value);
+    return value;
+}
+
+static PyTypeObject NDJSONIteratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "yajl.NDJSONIterator",                      /* tp_name */
+    sizeof(NDJSONIteratorObject),               /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)(NDJSONIterator_dealloc),       /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    0,                                          /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc)(NDJSONIterator_next),        /* tp_iternext */
+};
+
+/*
+ * Returns an iterator over the records of the newline-delimited JSON file at
+ * `path`, parsed `window` bytes at a time by up to `threads` threads
+ */
+PyObject *_internal_load_ndjson(const char *path, int threads, Py_ssize_t window)
+{
+    NDJSONIteratorObject *iter;
+    struct stat st;
+
+    iter = PyObject_New(NDJSONIteratorObject, &NDJSONIteratorType);
+    if (!iter)
+        return NULL;
+
+    iter->mapping = NULL;
+    iter->size = iter->offset = 0;
+    iter->buffer = NULL;
+    iter->used = iter->buffer_size = iter->consumed = 0;
+    iter->window = (window > 0) ? (size_t)(window) : PY_YAJL_NDJSON_WINDOW;
+    iter->threads = (threads > 0) ? threads : (int)(sysconf(_SC_NPROCESSORS_ONLN));
+    if (iter->threads <= 0)
+        iter->threads = 1;
+    iter->finished = 0;
+    InitBatch(&iter->batch);
+    _internal_decode_init(&iter->decoder);
+    iter->index = 0;
+    iter->error_type = iter->error_value = iter->error_traceback = NULL;
+    iter->fd = -1;
+
+    iter->decoder.values = PyList_New(0);
+    if (!iter->decoder.values) {
+        Py_DECREF(iter);
+        return NULL;
+    }
+
+    /* opening a FIFO waits for its writer, which may need the GIL */
+    Py_BEGIN_ALLOW_THREADS
+    iter->fd = open(path, O_RDONLY);
+    Py_END_ALLOW_THREADS
+    if ((iter->fd < 0) || (fstat(iter->fd, &st) < 0)) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)(path));
+        Py_DECREF(iter);
+        return NULL;
+    }
+
+    if (S_ISREG(st.st_mode) && (st.st_size > 0)) {
+        iter->mapping = mmap(NULL, (size_t)(st.st_size), PROT_READ, MAP_PRIVATE, iter->fd, 0);
+        if (iter->mapping == MAP_FAILED) {
+            iter->mapping = NULL;
+        } else {
+            iter->size = (size_t)(st.st_size);
+#ifdef MADV_SEQUENTIAL
+            madvise(iter->mapping, iter->size, MADV_SEQUENTIAL);
+#endif
+            close(iter->fd);
+            iter->fd = -1;
+            return (PyObject *)(iter);
+        }
+    }
+
+    iter->buffer_size = iter->window;
+    iter->buffer = (char *)(malloc(iter->buffer_size));
+    if (!iter->buffer) {
+        Py_DECREF(iter);
+        return PyErr_NoMemory();
+    }
+    return (PyObject *)(iter);
+}
+
+int _internal_batch_init(PyObject *module)
+{
+    if (PyType_Ready(&NDJSONIteratorType) < 0)
+        return failure;
+    return success;
+}
@@ -0,0 +1,434 @@
+#!/usr/bin/env python2
+"""
+Benchmarks for py-yajl.
+
+Runs loads, dumps and the stream paths over a generated corpus shaped like
+the usual JSON benchmark documents (twitter.json, citm_catalog.json,
+canada.json), plus string-heavy, number-heavy, deeply nested and NDJSON
+inputs.  Every (corpus, operation) pair runs in its own forked process, so
+its peak RSS is its own.
+
+    PYTHONPATH=. python bench.py                      # everything
+    PYTHONPATH=. python bench.py --cases twitter,ndjson --ops loads,dumps
+    PYTHONPATH=. python bench.py --json after.json --compare before.json
+
+Reported per pair:
+    MB/s       JSON bytes per second (input for decoding, output for encoding)
+    ns/value   time per JSON value (scalars, arrays and objects)
+    peak RSS   the process' high-water mark, and its growth during the run
+    retained   bytes malloc() still has out while one result is alive
+    objects    distinct Python objects in one result, which is what decoding
+               allocates (shared keys and small ints count once)
+
+The --json output holds the same numbers along with the commit and the
+machine, and --compare prints the change against such a file.
+"""
+from __future__ import print_function
+
+import collections
+import ctypes
+import ctypes.util
+import gc
+import json
+import optparse
+import os
+import platform
+import random
+import resource
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import yajl
+
+
+#
+# Corpus
+#
+
+WORDS = ('lorem ipsum dolor sit amet consectetur adipiscing elit sed do '
+         'eiusmod tempor incididunt ut labore et dolore magna aliqua '
+         'caf\xc3\xa9 \xe2\x9c\x93 "quoted" back\\slash tab\tnew\nline').split(' ')
+
+def sentence(r, words):
+    return ' '.join(r.choice(WORDS) for i in range(words))
+
+def twitter(r, scale):
+    """Statuses with nested users and entities; mostly strings"""
+    def user(i):
+        return {
+            'id' : r.randint(1, 2 ** 40), 'id_str' : str(i),
+            'name' : sentence(r, 2), 'screen_name' : 'user%d' % i,
+            'location' : sentence(r, 2), 'description' : sentence(r, 15),
+            'url' : None, 'protected' : False, 'followers_count' : r.randint(0, 10 ** 6),
+            'friends_count' : r.randint(0, 5000), 'created_at' : 'Sun Aug 31 00:29:15 +0000 2014',
+            'favourites_count' : r.randint(0, 10 ** 4), 'utc_offset' : None,
+            'verified' : r.random() < 0.1, 'lang' : 'en',
+            'profile_background_color' : 'C0DEED', 'default_profile' : True,
+        }
+    def status(i):
+        return {
+            'created_at' : 'Sun Aug 31 00:29:15 +0000 2014',
+            'id' : 505874924095815681 + i, 'id_str' : str(505874924095815681 + i),
+            'text' : sentence(r, 20), 'source' : '<a href="http://x.example/">web</a>',
+            'truncated' : False, 'in_reply_to_status_id' : None,
+            'user' : user(i), 'geo' : None, 'coordinates' : None,
+            'retweet_count' : r.randint(0, 1000), 'favorite_count' : r.randint(0, 1000),
+            'entities' : {
+                'hashtags' : [{'text' : r.choice(WORDS), 'indices' : [r.randint(0, 70), r.randint(70, 140)]}
+                              for j in range(r.randint(0, 3))],
+                'urls' : [], 'user_mentions' : [
+                    {'screen_name' : 'user%d' % j, 'id' : j, 'indices' : [0, 10]}
+                    for j in range(r.randint(0, 2))],
+            },
+            'favorited' : False, 'retweeted' : False, 'lang' : 'ja',
+        }
+    return {'statuses' : [status(i) for i in range(int(1000 * scale))],
+            'search_metadata' : {'completed_in' : 0.087, 'count' : 100, 'query' : 'x'}}
+
+def citm(r, scale):
+    """Event catalog: many repeated keys, int arrays and nulls"""
+    count = int(2000 * scale)
+    return {
+        'areaNames' : dict((str(205705993 + i), sentence(r, 3)) for i in range(count // 10)),
+        'events' : dict((str(138586341 + i), {
+            'description' : None, 'id' : 138586341 + i, 'logo' : None,
+            'name' : sentence(r, 4), 'subTopicIds' : [337184269, 337184283],
+            'subjectCode' : None, 'subtitle' : None,
+            'topicIds' : [324846099, 107888604]}) for i in range(count // 2)),
+        'performances' : [{
+            'eventId' : 138586341 + i, 'id' : 339887544 + i, 'logo' : None, 'name' : None,
+            'prices' : [{'amount' : r.randint(1, 500) * 100, 'audienceSubCategoryId' : 337100890,
+                         'seatCategoryId' : 338937295} for j in range(3)],
+            'seatCategories' : [{'areas' : [{'areaId' : 205705999 + k, 'blockIds' : []}
+                                            for k in range(4)],
+                                 'seatCategoryId' : 338937295}],
+            'seatMapImage' : None, 'start' : 1372701600000, 'venueCode' : 'PLEYEL_PLEYEL'}
+            for i in range(count)],
+    }
+
+def canada(r, scale):
+    """Polygons as nested arrays of float pairs; almost all numbers"""
+    def ring(points):
+        lon, lat = -65.6, 43.4
+        coords = []
+        for i in range(points):
+            lon += (r.random() - 0.5) * 0.01
+            lat += (r.random() - 0.5) * 0.01
+            coords.append([lon, lat])
+        return coords
+    return {'type' : 'FeatureCollection', 'features' : [{
+        'type' : 'Feature', 'properties' : {'name' : 'Canada'},
+        'geometry' : {'type' : 'Polygon',
+                      'coordinates' : [ring(r.randint(20, 2000)) for i in range(int(480 * scale))]}}]}
+
+def strings(r, scale):
+    """Long strings, some with escapes and UTF-8"""
+    return [sentence(r, r.randint(1, 400)) for i in range(int(5000 * scale))]
+
+def numbers(r, scale):
+    """Flat array of ints, big ints and doubles"""
+    return [r.choice((r.randint(-1000, 1000), r.randint(-2 ** 62, 2 ** 62), r.random() * 1e6))
+            for i in range(int(200000 * scale))]
+
+def deep(r, scale):
+    """Small containers nested 100 deep, many times over"""
+    def nest(depth):
+        value = {'leaf' : [1, 'two', None]}
+        for i in range(depth):
+            value = [value, i] if i % 2 else {'k' : value, 'n' : i}
+        return value
+    return [nest(100) for i in range(int(500 * scale))]
+
+def records(r, scale):
+    """NDJSON: one flat record per line"""
+    return [{'id' : i, 'name' : 'user%d' % i, 'email' : 'user%d@example.com' % i,
+             'score' : r.random() * 100, 'active' : r.random() < 0.5,
+             'country' : r.choice(('US', 'CA', 'DE', 'JP')), 'plan' : None,
+             'visits' : r.randint(0, 10000)} for i in range(int(50000 * scale))]
+
+CORPUS = collections.OrderedDict([
+    ('twitter', twitter),
+    ('citm', citm),
+    ('canada', canada),
+    ('strings', strings),
+    ('numbers', numbers),
+    ('deep', deep),
+    ('ndjson', records),
+])
+
+def write_corpus(directory, scale, cases):
+    for name in cases:
+        value = CORPUS[name](random.Random(name), scale)
+        with open(os.path.join(directory, name + '.json'), 'w') as fp:
+            if name == 'ndjson':
+                fp.write('\n'.join(yajl.dumps(v) for v in value) + '\n')
+            else:
+                fp.write(yajl.dumps(value))
+
+def count_values(value):
+    """The number of JSON values in value, itself included"""
+    count, stack = 0, [value]
+    while stack:
+        value = stack.pop()
+        count += 1
+        if isinstance(value, dict):
+            stack.extend(value.itervalues())
+        elif isinstance(value, list):
+            stack.extend(value)
+    return count
+
+
+#
+# Operations
+#
+
+def drain(iterator):
+    collections.deque(iterator, maxlen=0)
+
+# name -> (applies to ndjson, is an encoder, setup(path, text, value) -> callable)
+OPERATIONS = collections.OrderedDict([
+    ('loads', (False, False, lambda path, text, value: lambda: yajl.loads(text))),
+    ('dumps', (False, True, lambda path, text, value: lambda: yajl.dumps(value))),
+    ('load', (False, False, lambda path, text, value: lambda: yajl.load(open(path)))),
+    ('load_file', (False, False, lambda path, text, value: lambda: yajl.load_file(path))),
+    ('dump', (False, True, lambda path, text, value:
+        lambda: yajl.dump(value, open(os.devnull, 'w')))),
+    ('iterparse', (False, False, lambda path, text, value:
+        lambda: drain(yajl.iterparse(open(path))))),
+    ('json.loads', (False, False, lambda path, text, value: lambda: json.loads(text))),
+    ('json.dumps', (False, True, lambda path, text, value: lambda: json.dumps(value))),
+    ('load_lines', (True, False, lambda path, text, value:
+        lambda: list(yajl.load_lines(open(path))))),
+    ('load_ndjson_parallel', (True, False, lambda path, text, value:
+        lambda: list(yajl.load_ndjson_parallel(path)))),
+    ('loads_many', (True, False, lambda path, text, value:
+        (lambda lines: lambda: yajl.loads_many(lines))(text.splitlines()))),
+    ('dumps_lines', (True, True, lambda path, text, value:
+        lambda: '\n'.join([yajl.dumps(v) for v in value]))),
+])
+
+DEFAULT_OPS = [name for name in OPERATIONS if not name.startswith('json.')]
+
+
+#
+# Measurement
+#
+
+class MallInfo(ctypes.Structure):
+    _fields_ = [(name, ctypes.c_size_t) for name in (
+        'arena', 'ordblks', 'smblks', 'hblks', 'hblkhd', 'usmblks',
+        'fsmblks', 'uordblks', 'fordblks', 'keepcost')]
+
+def malloc_in_use():
+    """Bytes handed out by malloc(), if glibc will say; None otherwise"""
+    try:
+        libc = ctypes.CDLL(ctypes.util.find_library('c'))
+        libc.mallinfo2.restype = MallInfo
+    except (OSError, AttributeError):
+        return None
+    info = libc.mallinfo2()
+    return info.uordblks + info.hblkhd
+
+def current_rss_kb():
+    try:
+        with open('/proc/self/statm') as fp:
+            return int(fp.read().split()[1]) * resource.getpagesize() // 1024
+    except IOError:
+        return None
+
+def count_objects(value):
+    """The number of distinct objects reachable from value"""
+    seen, stack = set(), [value]
+    while stack:
+        value = stack.pop()
+        if id(value) in seen:
+            continue
+        seen.add(id(value))
+        if isinstance(value, dict):
+            stack.extend(value.iterkeys())
+            stack.extend(value.itervalues())
+        elif isinstance(value, (list, tuple)):
+            stack.extend(value)
+    return len(seen)
+
+def measure(path, case, op, options):
+    with open(path) as fp:
+        text = fp.read()
+    if case == 'ndjson':
+        value = [yajl.loads(line) for line in text.splitlines()]
+    else:
+        value = yajl.loads(text)
+    run = OPERATIONS[op][2](path, text, value)
+    encoding = OPERATIONS[op][1]
+
+    values = count_values(value) - (1 if case == 'ndjson' else 0)
+    nbytes = len(text)
+    if encoding:
+        output = run()
+        if isinstance(output, str):
+            nbytes = len(output)
+    del text
+    gc.collect()
+    start_rss = current_rss_kb()
+
+    # Memory held by one result, before anything is timed
+    before = malloc_in_use()
+    result = run()
+    retained = malloc_in_use()
+    if before is not None:
+        retained -= before
+    objects = count_objects(result) if result is not None else 0
+    del result
+
+    times = []
+    for i in range(options.repeat):
+        loops, elapsed = 0, 0.0
+        start = time.time()
+        while (elapsed < options.min_time) or (loops == 0):
+            run()
+            loops += 1
+            elapsed = time.time() - start
+        times.append(elapsed / loops)
+
+    best = min(times)
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    return {
+        'case' : case, 'op' : op, 'bytes' : nbytes, 'values' : values,
+        'seconds' : best, 'seconds_median' : sorted(times)[len(times) // 2],
+        'mb_per_s' : nbytes / best / 1e6, 'ns_per_value' : best / values * 1e9,
+        'peak_rss_kb' : peak,
+        'rss_growth_kb' : (peak - start_rss) if start_rss is not None else None,
+        'retained_bytes' : retained if before is not None else None,
+        'objects' : objects,
+    }
+
+def measure_forked(path, case, op, options):
+    """measure() in a child process, so the peak RSS is the op's alone"""
+    rfd, wfd = os.pipe()
+    pid = os.fork()
+    if pid == 0:
+        os.close(rfd)
+        try:
+            out = json.dumps(measure(path, case, op, options))
+        except Exception as e:
+            out = json.dumps({'case' : case, 'op' : op, 'error' : '%s: %s' % (type(e).__name__, e)})
+        os.write(wfd, out)
+        os._exit(0)
+    os.close(wfd)
+    chunks = []
+    while True:
+        chunk = os.read(rfd, 65536)
+        if not chunk:
+            break
+        chunks.append(chunk)
+    os.close(rfd)
+    os.waitpid(pid, 0)
+    if not chunks:
+        return {'case' : case, 'op' : op, 'error' : 'benchmark process died'}
+    return json.loads(''.join(chunks))
+
+
+#
+# Reporting
+#
+
+def git_commit():
+    try:
+        return subprocess.Popen(['git', 'rev-parse', '--short', 'HEAD'],
+                                stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                                cwd=os.path.dirname(os.path.abspath(__file__))).communicate()[0].strip()
+    except OSError:
+        return None
+
+def format_bytes(n):
+    if n is None:
+        return '-'
+    for unit in ('B', 'KB', 'MB', 'GB'):
+        if abs(n) < 1024 or unit == 'GB':
+            return '%.0f%s' % (n, unit) if unit == 'B' else '%.1f%s' % (n, unit)
+        n /= 1024.0
+
+HEADER = '%-8s %-21s %9s %9s %10s %10s %9s %9s' % (
+    'case', 'op', 'MB/s', 'ns/value', 'peak RSS', 'RSS +', 'retained', 'objects')
+
+def format_result(r):
+    if 'error' in r:
+        return '%-8s %-21s %s' % (r['case'], r['op'], r['error'])
+    growth = r['rss_growth_kb']
+    return '%-8s %-21s %9.1f %9.1f %10s %10s %9s %9d' % (
+        r['case'], r['op'], r['mb_per_s'], r['ns_per_value'],
+        format_bytes(r['peak_rss_kb'] * 1024),
+        format_bytes(growth * 1024 if growth is not None else None),
+        format_bytes(r['retained_bytes']), r['objects'])
+
+def compare(results, path):
+    with open(path) as fp:
+        base = json.load(fp)
+    old = dict(((r['case'], r['op']), r) for r in base['results'] if 'error' not in r)
+    print()
+    print('Against %s (commit %s): time and peak RSS, negative is better' % (
+        path, base.get('commit')))
+    for r in results:
+        o = old.get((r['case'], r['op']))
+        if (o is None) or ('error' in r):
+            continue
+        print('%-8s %-21s time %+6.1f%%   rss %+6.1f%%' % (
+            r['case'], r['op'],
+            (r['seconds'] / o['seconds'] - 1) * 100,
+            (float(r['peak_rss_kb']) / o['peak_rss_kb'] - 1) * 100))
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options]')
+    parser.add_option('--cases', default=','.join(CORPUS),
+                      help='comma-separated corpus names [%default]')
+    parser.add_option('--ops', default=','.join(DEFAULT_OPS),
+                      help='comma-separated operations [%default]; json.loads and '
+                           'json.dumps time the stdlib for reference')
+    parser.add_option('--scale', type='float', default=1.0,
+                      help='corpus size multiplier [%default]')
+    parser.add_option('--repeat', type='int', default=5,
+                      help='timing samples per benchmark, the best is reported [%default]')
+    parser.add_option('--min-time', type='float', default=0.2,
+                      help='seconds per timing sample [%default]')
+    parser.add_option('--json', metavar='FILE', help='write the results to FILE')
+    parser.add_option('--compare', metavar='FILE', help='compare with the results in FILE')
+    options, args = parser.parse_args()
+
+    cases = [c for c in options.cases.split(',') if c]
+    ops = [o for o in options.ops.split(',') if o]
+    for name in cases:
+        if name not in CORPUS:
+            parser.error('unknown case %r' % name)
+    for name in ops:
+        if name not in OPERATIONS:
+            parser.error('unknown operation %r' % name)
+
+    directory = tempfile.mkdtemp(prefix='yajl-bench-')
+    try:
+        write_corpus(directory, options.scale, cases)
+        print(HEADER)
+        results = []
+        for case in cases:
+            for op in ops:
+                if OPERATIONS[op][0] != (case == 'ndjson'):
+                    continue
+                r = measure_forked(os.path.join(directory, case + '.json'), case, op, options)
+                print(format_result(r))
+                sys.stdout.flush()
+                results.append(r)
+    finally:
+        shutil.rmtree(directory)
+
+    if options.json:
+        with open(options.json, 'w') as fp:
+            json.dump({'commit' : git_commit(), 'python' : platform.python_version(),
+                       'machine' : platform.platform(), 'scale' : options.scale,
+                       'results' : results}, fp, indent=1, sort_keys=True)
+    if options.compare:
+        compare(results, options.compare)
+
+if __name__ == '__main__':
+    main()
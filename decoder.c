@@ -33,6 +33,7 @@
 
 #include <Python.h>
 
+#include <float.h>
 #include <string.h>
 
 #include <yajl/yajl_parse.h>
@@ -40,183 +41,687 @@
 
 #include "py_yajl.h"
 
-int _PlaceObject(_YajlDecoder *self, PyObject *parent, PyObject *child)
+/*
+ * Stores a completed top-level value.  In multiple values mode the value is
+ * queued on self->values for the caller to pick up between chunks.
+ */
+static int PlaceRoot(_YajlDecoder *self, PyObject *object)
 {
-    if ( (!self) || (!child) || (!parent) )
-        return failure;
+    int rc;
 
-    if (PyList_Check(parent)) {
-        PyList_Append(parent, child);
-        // child is now owned by parent!
-        if ((child) && (child != Py_None)) {
-            Py_XDECREF(child);
-        }
-        return success;
-    } else if (PyDict_Check(parent)) {
-        PyObject* key = py_yajl_ps_current(self->keys);
-        PyDict_SetItem(parent, key, child);
-        py_yajl_ps_pop(self->keys);
-        // child is now owned by parent!
-        Py_XDECREF(key);
-        if ((child) && (child != Py_None)) {
-            Py_XDECREF(child);
+    if (!self->values) {
+        if (self->root) {
+            /* a second value fed to a parser kept warm by _internal_decode */
+            Py_DECREF(object);
+            PyErr_SetString(PyExc_ValueError, "trailing garbage");
+            return failure;
         }
+        if (_internal_stats_enabled)
+            _internal_stats.documents++;
+        self->root = object;
+        /* no parser when the events are replayed from a tape */
+        self->root_end = self->_parser ? yajl_get_bytes_consumed((yajl_handle)(self->_parser)) : 0;
         return success;
     }
-    return failure;
+
+    if (_internal_stats_enabled)
+        _internal_stats.documents++;
+    rc = PyList_Append(self->values, object);
+    Py_DECREF(object);
+    return (rc == 0) ? success : failure;
+}
+
+/*
+ * Takes the value the callbacks just finished for a caller that only
+ * builds parts of a document (paths, items(), schemas).  PlaceRoot counted
+ * the value as a document; the caller counts its whole document instead.
+ */
+PyObject *_internal_take_root(_YajlDecoder *self)
+{
+    PyObject *value = self->root;
+
+    self->root = NULL;
+    if ((value) && (_internal_stats_enabled))
+        _internal_stats.documents--;
+    return value;
 }
 
+/*
+ * Containers aren't created until they're complete.  Until then their
+ * children wait on the elements stack (and, for dicts, their keys on the
+ * keys stack), and self->frames records where each open container's
+ * children start.  The end callbacks then build each list or dict at its
+ * final size in one go.
+ */
+static int FlushNumbers(_YajlDecoder *self);
+
 int PlaceObject(_YajlDecoder *self, PyObject *object)
 {
-    unsigned int length = py_yajl_ps_length(self->elements);
+    if (!object)
+        return failure;
+    if (self->depth == 0)
+        return PlaceRoot(self, object);
+    if ((self->numbers_depth == self->depth) && (FlushNumbers(self) != success)) {
+        Py_DECREF(object);
+        return failure;
+    }
 
-    if (length == 0) {
-        /*
-         * When the length is zero, and we're entering this code path
-         * we should only be handling "primitive types" i.e. strings and
-         * numbers, not dict/list.
-         */
-        self->root = object;
-        return success;
+    py_yajl_ps_push(self->elements, object);
+    return success;
+}
+
+static int OpenContainer(_YajlDecoder *self)
+{
+    if ((self->numbers_depth) && (self->numbers_depth == self->depth) &&
+            (FlushNumbers(self) != success))
+        return failure;
+    if (self->depth == self->frames_size) {
+        unsigned int size = self->frames_size ? self->frames_size * 2 : PY_YAJL_PS_INC;
+        unsigned int *frames = (unsigned int *)(realloc(self->frames, size * sizeof(unsigned int)));
+
+        if (!frames) {
+            PyErr_NoMemory();
+            return failure;
+        }
+        self->frames = frames;
+        self->frames_size = size;
+    }
+    self->frames[self->depth++] = py_yajl_ps_length(self->elements);
+    return success;
+}
+
+/*
+ * Returns the number of children of the innermost open container and closes
+ * it; they're the top entries of the elements stack
+ */
+static unsigned int CloseContainer(_YajlDecoder *self)
+{
+    assert(self->depth > 0);
+    self->depth--;
+    return py_yajl_ps_length(self->elements) - self->frames[self->depth];
+}
+
+/*
+ * Returns a new reference to a string object for the given bytes, reusing
+ * the object from the decoder's key cache when the same bytes were seen
+ * before.  Newly created strings are hashed up front so that PyDict_SetItem
+ * doesn't have to.
+ */
+static PyObject *CachedString(_YajlDecoder *self, const char *value, unsigned int length)
+{
+    PyObject *object;
+    PyObject **slot;
+    unsigned long hash = 2166136261UL;
+    unsigned int i;
+
+    if (!self->keycache) {
+        self->keycache = (PyObject **)(calloc(PY_YAJL_KEYCACHE_SIZE, sizeof(PyObject *)));
+        if (!self->keycache)
+            return PyString_FromStringAndSize(value, length);
     }
-    return _PlaceObject(self, py_yajl_ps_current(self->elements), object);
+
+    /* FNV-1a over the raw bytes */
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)(value[i])) * 16777619UL;
+    }
+    slot = &self->keycache[hash & (PY_YAJL_KEYCACHE_SIZE - 1)];
+
+    object = *slot;
+    if ((object) && (PyString_GET_SIZE(object) == length) &&
+            (memcmp(PyString_AS_STRING(object), value, length) == 0)) {
+        Py_INCREF(object);
+        return object;
+    }
+
+    object = PyString_FromStringAndSize(value, length);
+    if (object == NULL)
+        return NULL;
+    if (PyObject_Hash(object) == -1) {
+        Py_DECREF(object);
+        return NULL;
+    }
+
+    Py_XDECREF(*slot);
+    Py_INCREF(object);
+    *slot = object;
+    return object;
 }
 
+void _internal_clear_cache(_YajlDecoder *self)
+{
+    unsigned int i;
+
+    if (!self->keycache)
+        return;
+    for (i = 0; i < PY_YAJL_KEYCACHE_SIZE; i++) {
+        Py_XDECREF(self->keycache[i]);
+    }
+    free(self->keycache);
+    self->keycache = NULL;
+}
+
+/*
+ * yajl.stats() bookkeeping around the handlers below.  StatsStart() reads
+ * the clock if stats are on and returns 0 otherwise; StatsEnd() then counts
+ * the value (unless `counter` is NULL), charges the handler's time to
+ * building and updates the high-water marks.  Returns rc.
+ */
+static unsigned PY_LONG_LONG StatsStart(void)
+{
+    return _internal_stats_enabled ? _internal_stats_clock() : 0;
+}
+
+static int StatsEnd(_YajlDecoder *self, unsigned PY_LONG_LONG start,
+                    unsigned PY_LONG_LONG *counter, int rc)
+{
+    py_yajl_stats *st = &_internal_stats;
+
+    if (!start)
+        return rc;
+    if (counter)
+        (*counter)++;
+    st->build_ns += _internal_stats_clock() - start;
+    if (self->depth > st->max_depth)
+        st->max_depth = self->depth;
+    if (py_yajl_ps_length(self->elements) > st->elements_high_water)
+        st->elements_high_water = py_yajl_ps_length(self->elements);
+    if (py_yajl_ps_length(self->keys) > st->keys_high_water)
+        st->keys_high_water = py_yajl_ps_length(self->keys);
+    return rc;
+}
 
 static int handle_null(void *ctx)
 {
+    unsigned PY_LONG_LONG start = StatsStart();
+
     Py_INCREF(Py_None);
-    return PlaceObject(ctx, Py_None);
+    return StatsEnd(ctx, start, &_internal_stats.nulls, PlaceObject(ctx, Py_None));
 }
 
 static int handle_bool(void *ctx, int value)
 {
-    return PlaceObject(ctx, PyBool_FromLong((long)(value)));
+    unsigned PY_LONG_LONG start = StatsStart();
+
+    return StatsEnd(ctx, start, &_internal_stats.booleans,
+                    PlaceObject(ctx, PyBool_FromLong((long)(value))));
 }
 
-static int handle_number(void *ctx, const char *value, unsigned int length)
+/*
+ * Powers of ten that are exactly representable as doubles, used by the
+ * Clinger fast path in ScannedDouble()
+ */
+static const double exact_powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define PY_YAJL_MAX_EXACT_POW10 22
+#define PY_YAJL_MAX_EXACT_MANTISSA (1ULL << 53)
+#define PY_YAJL_MAX_MANTISSA_DIGITS 19
+
+/*
+ * Slow paths for numbers that don't fit the fast paths below: copy the
+ * digits into a NUL-terminated buffer and let CPython do a correctly
+ * rounded conversion, without building a temporary string object.
+ */
+static char *CopyDigits(const char *value, unsigned int length, char *stackbuf, size_t size)
 {
-    //fprintf(stderr, "handle_number: ");
-    //fwrite(value, length, 1, stderr);
-    //fprintf(stderr, "\n");
+    char *buffer = stackbuf;
 
-    _YajlDecoder *self = (_YajlDecoder *)(ctx);
+    if (length >= size) {
+        buffer = (char *)(PyMem_Malloc(length + 1));
+        if (!buffer) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+    }
+    memcpy(buffer, value, length);
+    buffer[length] = '\0';
+    return buffer;
+}
+
+static int DoubleFromDigits(const char *value, unsigned int length, double *number)
+{
+    char stackbuf[64];
+    char *buffer = CopyDigits(value, length, stackbuf, sizeof(stackbuf));
+
+    if (!buffer)
+        return failure;
+    *number = PyOS_string_to_double(buffer, NULL, NULL);
+    if (buffer != stackbuf)
+        PyMem_Free(buffer);
+    return ((*number == -1.0) && (PyErr_Occurred())) ? failure : success;
+}
+
+static PyObject *LongFromDigits(const char *value, unsigned int length)
+{
+    char stackbuf[64];
+    char *buffer = CopyDigits(value, length, stackbuf, sizeof(stackbuf));
     PyObject *object;
-    PyObject *string;
 
-    int floaty_char;
+    if (!buffer)
+        return NULL;
+    object = PyLong_FromString(buffer, NULL, 10);
+    if (buffer != stackbuf)
+        PyMem_Free(buffer);
+    return object;
+}
+
+typedef struct {
+    unsigned long long mantissa;    /* the first significant digits */
+    int exponent;                   /* of ten, applied to the mantissa */
+    int negative;
+    int floaty;
+    int truncated;                  /* digits beyond the mantissa were dropped */
+} ScannedNumber;
 
-    // take a moment here to scan the input string to see if there's
-    // any chars which suggest this is a floating point number
-    for (floaty_char = 0; floaty_char < length; floaty_char++) {
-        switch (value[floaty_char]) {
-            case '.': case 'e': case 'E': goto floatin;
+/*
+ * yajl has already validated the number's syntax, so a single pass
+ * collects the significant digits and the decimal exponent
+ */
+static void ScanNumber(const char *value, unsigned int length, ScannedNumber *number)
+{
+    const char *p = value;
+    const char *end = value + length;
+    unsigned long long mantissa = 0;
+    int negative = 0, floaty = 0, fraction = 0, truncated = 0;
+    int digits = 0, exponent = 0;
+
+    if ((p < end) && (*p == '-')) {
+        negative = 1;
+        p++;
+    }
+    for (; p < end; p++) {
+        char c = *p;
+        if ((c >= '0') && (c <= '9')) {
+            if ((mantissa == 0) && (c == '0')) {
+                if (fraction)
+                    exponent--;
+            } else if (digits < PY_YAJL_MAX_MANTISSA_DIGITS) {
+                mantissa = mantissa * 10 + (c - '0');
+                digits++;
+                if (fraction)
+                    exponent--;
+            } else {
+                truncated = 1;
+                if (!fraction)
+                    exponent++;
+            }
+        } else if (c == '.') {
+            floaty = fraction = 1;
+        } else {
+            /* 'e' or 'E' */
+            int exp_negative = 0, exp_value = 0;
+
+            floaty = 1;
+            p++;
+            if ((p < end) && ((*p == '-') || (*p == '+'))) {
+                exp_negative = (*p == '-');
+                p++;
+            }
+            for (; p < end; p++) {
+                if (exp_value < 100000)
+                    exp_value = exp_value * 10 + (*p - '0');
+            }
+            exponent += exp_negative ? -exp_value : exp_value;
+            break;
         }
     }
 
-  floatin:
-    string = PyString_FromStringAndSize(value, length);
-    if (floaty_char >= length) {
-        object = PyInt_FromString(PyString_AS_STRING(string), NULL, 10);
+    number->mantissa = mantissa;
+    number->exponent = exponent;
+    number->negative = negative;
+    number->floaty = floaty;
+    number->truncated = truncated;
+}
+
+/* Returns 1 and sets *integer if the scanned integer fits in a long */
+static int ScannedLong(const ScannedNumber *number, long *integer)
+{
+    unsigned long long mantissa = number->mantissa;
+
+    if (number->truncated)
+        return 0;
+    if (mantissa == 0) {
+        *integer = 0;
+    } else if (!number->negative) {
+        if (mantissa > (unsigned long long)(LONG_MAX))
+            return 0;
+        *integer = (long)(mantissa);
     } else {
-        object = PyFloat_FromString(string, NULL);
+        if (mantissa > (unsigned long long)(LONG_MAX) + 1)
+            return 0;
+        *integer = -(long)(mantissa - 1) - 1;
+    }
+    return 1;
+}
+
+/* Converts a scanned float (or any number) to the nearest double */
+static int ScannedDouble(const ScannedNumber *number, const char *value, unsigned int length,
+                         double *result)
+{
+    unsigned long long mantissa = number->mantissa;
+    int exponent = number->exponent;
+
+#if !defined(FLT_EVAL_METHOD) || FLT_EVAL_METHOD == 0
+    /*
+     * Clinger's fast path: when both the mantissa and the power of ten
+     * are exact doubles, a single multiply or divide is correctly rounded
+     */
+    if ((!number->truncated) && (mantissa <= PY_YAJL_MAX_EXACT_MANTISSA) &&
+            (exponent >= -PY_YAJL_MAX_EXACT_POW10) &&
+            (exponent <= PY_YAJL_MAX_EXACT_POW10)) {
+        double d = (double)(mantissa);
+        if (exponent < 0)
+            d /= exact_powers_of_ten[-exponent];
+        else
+            d *= exact_powers_of_ten[exponent];
+        *result = number->negative ? -d : d;
+        return success;
+    }
+#endif
+    if ((mantissa == 0) && (!number->truncated)) {
+        *result = number->negative ? -0.0 : 0.0;
+        return success;
+    }
+    return DoubleFromDigits(value, length, result);
+}
+
+/*
+ * Converts the text of a number yajl has already validated into an int,
+ * long or float
+ */
+PyObject *_internal_number(const char *value, unsigned int length)
+{
+    ScannedNumber number;
+    long integer;
+    double d;
+
+    ScanNumber(value, length, &number);
+
+    if (!number.floaty) {
+        if (ScannedLong(&number, &integer))
+            return PyInt_FromLong(integer);
+        if (number.truncated)
+            return LongFromDigits(value, length);
+        if (!number.negative)
+            return PyLong_FromUnsignedLongLong(number.mantissa);
+        if (number.mantissa <= (unsigned long long)(PY_LLONG_MAX) + 1)
+            return PyLong_FromLongLong(-(PY_LONG_LONG)(number.mantissa - 1) - 1);
+        return LongFromDigits(value, length);
+    }
+
+    if (ScannedDouble(&number, value, length, &d) != success)
+        return NULL;
+    return PyFloat_FromDouble(d);
+}
+
+/*
+ * With numeric_arrays set, the items of the innermost open list are kept
+ * as C longs or doubles for as long as they're all ints or all floats, and
+ * the list becomes an array.array when it closes.  Anything else ends the
+ * run: the numbers are turned into objects on the elements stack, and the
+ * list is built as usual.
+ */
+enum { NUMBERS_NONE, NUMBERS_INT, NUMBERS_FLOAT };
+
+typedef union _py_yajl_number {
+    long integer;
+    double number;
+} NumberItem;
+
+/*
+ * One-item arrays of each type, imported on first use; repeating one is
+ * the cheapest way to get an array of a given size from C
+ */
+static PyObject *array_prototypes[2];
+
+static int FlushNumbers(_YajlDecoder *self)
+{
+    unsigned int i, count = self->numbers_used;
+
+    self->numbers_depth = 0;
+    self->numbers_used = 0;
+    for (i = 0; i < count; i++) {
+        PyObject *object;
+
+        if (self->numbers_kind == NUMBERS_INT) {
+            object = PyInt_FromLong(self->numbers[i].integer);
+        } else {
+            object = PyFloat_FromDouble(self->numbers[i].number);
+        }
+        if (!object)
+            return failure;
+        py_yajl_ps_push(self->elements, object);
+    }
+    return success;
+}
+
+/* Returns 1 if the number joined the run, 0 if it can't, or -1 on error */
+static int KeepNumber(_YajlDecoder *self, const char *value, unsigned int length)
+{
+    ScannedNumber number;
+    NumberItem item;
+    int kind = NUMBERS_INT;
+
+    ScanNumber(value, length, &number);
+    if (number.floaty) {
+        if (ScannedDouble(&number, value, length, &item.number) != success)
+            return -1;
+        kind = NUMBERS_FLOAT;
+    } else if (!ScannedLong(&number, &item.integer)) {
+        return 0;
+    }
+
+    if (self->numbers_kind != kind) {
+        if (self->numbers_kind != NUMBERS_NONE)
+            return 0;
+        self->numbers_kind = kind;
+    }
+    if (self->numbers_used == self->numbers_size) {
+        unsigned int size = self->numbers_size ? self->numbers_size * 2 : PY_YAJL_PS_INC;
+        NumberItem *numbers = (NumberItem *)(realloc(self->numbers, size * sizeof(NumberItem)));
+
+        if (!numbers) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->numbers = numbers;
+        self->numbers_size = size;
+    }
+    self->numbers[self->numbers_used++] = item;
+    return 1;
+}
+
+static int ImportArrays(void)
+{
+    PyObject *module = PyImport_ImportModule("array");
+
+    if (!module)
+        return failure;
+    array_prototypes[0] = PyObject_CallMethod(module, "array", "c[i]", 'l', 0);
+    array_prototypes[1] = PyObject_CallMethod(module, "array", "c[d]", 'd', 0.0);
+    Py_DECREF(module);
+    if (!array_prototypes[0] || !array_prototypes[1]) {
+        Py_CLEAR(array_prototypes[0]);
+        Py_CLEAR(array_prototypes[1]);
+        return failure;
+    }
+    return success;
+}
+
+/* Returns the run as a new array.array and ends it */
+static PyObject *NumbersToArray(_YajlDecoder *self)
+{
+    unsigned int i, count = self->numbers_used;
+    int integers = (self->numbers_kind == NUMBERS_INT);
+    size_t size = count * (integers ? sizeof(long) : sizeof(double));
+    PyObject *array;
+    void *data;
+    Py_ssize_t length;
+
+    self->numbers_depth = 0;
+    self->numbers_used = 0;
+
+    if (!array_prototypes[0] && (ImportArrays() != success))
+        return NULL;
+
+    /* where a long is narrower than the union, pack the longs in place */
+    if ((integers) && (sizeof(long) != sizeof(NumberItem))) {
+        long *packed = (long *)(self->numbers);
+
+        for (i = 0; i < count; i++) {
+            packed[i] = self->numbers[i].integer;
+        }
+    }
+
+    array = PySequence_Repeat(array_prototypes[integers ? 0 : 1], count);
+    if (!array)
+        return NULL;
+    if (PyObject_AsWriteBuffer(array, &data, &length) < 0) {
+        Py_DECREF(array);
+        return NULL;
+    }
+    assert((size_t)(length) == size);
+    memcpy(data, self->numbers, size);
+    return array;
+}
+
+static int handle_number(void *ctx, const char *value, unsigned int length)
+{
+    _YajlDecoder *self = (_YajlDecoder *)(ctx);
+    unsigned PY_LONG_LONG start = StatsStart();
+    unsigned PY_LONG_LONG *counter = &_internal_stats.integers;
+    PyObject *object;
+
+    if ((self->numbers_depth) && (self->numbers_depth == self->depth)) {
+        switch (KeepNumber(self, value, length)) {
+            case 1:
+                if (self->numbers_kind == NUMBERS_FLOAT)
+                    counter = &_internal_stats.floats;
+                return StatsEnd(self, start, counter, success);
+            case -1:
+                return failure;
+        }
     }
-    Py_XDECREF(string);
-    yajl_status status = PlaceObject(self, object);
-    //fprintf(stderr, "handle_number status: %d\n", status);
-    return status;
+
+    object = _internal_number(value, length);
+    if ((start) && (object) && (PyFloat_CheckExact(object)))
+        counter = &_internal_stats.floats;
+    return StatsEnd(self, start, counter, PlaceObject(self, object));
 }
 
 static int handle_string(void *ctx, const unsigned char *value, unsigned int length)
 {
-    return PlaceObject(ctx, PyString_FromStringAndSize((char *)value, length));
+    _YajlDecoder *self = (_YajlDecoder *)(ctx);
+    unsigned PY_LONG_LONG start = StatsStart();
+    PyObject *object;
+
+    if (length <= PY_YAJL_KEYCACHE_MAXVALUE) {
+        object = CachedString(self, (const char *) value, length);
+    } else {
+        object = PyString_FromStringAndSize((const char *) value, length);
+    }
+    return StatsEnd(self, start, &_internal_stats.strings, PlaceObject(self, object));
 }
 
 static int handle_start_dict(void *ctx)
 {
-    PyObject *object = PyDict_New();
-    if (!object)
-        return failure;
+    unsigned PY_LONG_LONG start = StatsStart();
 
-    py_yajl_ps_push(((_YajlDecoder *)(ctx))->elements, object);
-    return success;
+    return StatsEnd(ctx, start, NULL, OpenContainer((_YajlDecoder *)(ctx)));
 }
 
 static int handle_dict_key(void *ctx, const unsigned char *value, unsigned int length)
 {
-    PyObject *object = PyString_FromStringAndSize((const char *) value, length);
+    _YajlDecoder *self = (_YajlDecoder *)(ctx);
+    unsigned PY_LONG_LONG start = StatsStart();
+    PyObject *object;
+
+    if (length <= PY_YAJL_KEYCACHE_MAXKEY) {
+        object = CachedString(self, (const char *) value, length);
+    } else {
+        object = PyString_FromStringAndSize((const char *) value, length);
+    }
 
     if (object == NULL)
         return failure;
 
-    py_yajl_ps_push(((_YajlDecoder *)(ctx))->keys, object);
-    return success;
+    py_yajl_ps_push(self->keys, object);
+    return StatsEnd(self, start, &_internal_stats.keys, success);
 }
 
 static int handle_end_dict(void *ctx)
 {
     _YajlDecoder *self = (_YajlDecoder *)(ctx);
-    PyObject *last, *popped;
-    unsigned int length;
-
-    length = py_yajl_ps_length(self->elements);
-    if (length == 1) {
-        /*
-         * If this is the last element in the stack
-         * then it's "root" and we should finish up
-         */
-        self->root = py_yajl_ps_current(self->elements);
-        py_yajl_ps_pop(self->elements);
-        return success;
-    } else if (length < 2) {
-        return failure;
-    }
+    unsigned PY_LONG_LONG start = StatsStart();
+    unsigned int count = CloseContainer(self);
+    PyObject **values = self->elements.stack + py_yajl_ps_length(self->elements) - count;
+    PyObject **keys = self->keys.stack + py_yajl_ps_length(self->keys) - count;
+    PyObject *object = _PyDict_NewPresized(count);
+    unsigned int i;
 
-    /*
-     * If not, then we should properly add this dict
-     * to it's appropriate parent
-     */
-    popped = py_yajl_ps_current(self->elements);
-    py_yajl_ps_pop(self->elements);
-    last = py_yajl_ps_current(self->elements);
+    if (!object)
+        return failure;
 
-    return _PlaceObject(self, last, popped);
+    for (i = 0; i < count; i++) {
+        if (PyDict_SetItem(object, keys[i], values[i]) < 0) {
+            Py_DECREF(object);
+            return failure;
+        }
+        Py_CLEAR(keys[i]);
+        Py_CLEAR(values[i]);
+    }
+    self->elements.used -= count;
+    self->keys.used -= count;
+    return StatsEnd(self, start, &_internal_stats.dicts, PlaceObject(self, object));
 }
 
 static int handle_start_list(void *ctx)
 {
-    PyObject *object = PyList_New(0);
-
-    if (!object)
-        return failure;
+    _YajlDecoder *self = (_YajlDecoder *)(ctx);
+    unsigned PY_LONG_LONG start = StatsStart();
+    int rc = OpenContainer(self);
 
-    py_yajl_ps_push(((_YajlDecoder *)(ctx))->elements, object);
-    return success;
+    if ((rc == success) && (self->numeric_arrays)) {
+        self->numbers_depth = self->depth;
+        self->numbers_kind = NUMBERS_NONE;
+    }
+    return StatsEnd(self, start, NULL, rc);
 }
 
 static int handle_end_list(void *ctx)
 {
     _YajlDecoder *self = (_YajlDecoder *)(ctx);
-    PyObject *last, *popped;
-    unsigned int length;
+    unsigned PY_LONG_LONG start = StatsStart();
+    unsigned int count;
+    PyObject **items;
+    PyObject *object;
+    unsigned int i;
 
-    length = py_yajl_ps_length(self->elements);
-    if (length == 1) {
-        self->root = py_yajl_ps_current(self->elements);
-        py_yajl_ps_pop(self->elements);
-        return success;
-    } else if (length < 2) {
-        return failure;
+    /* an empty list stays a list */
+    if ((self->numbers_depth == self->depth) && (self->numbers_used)) {
+        object = NumbersToArray(self);
+        CloseContainer(self);
+        return StatsEnd(self, start, &_internal_stats.lists, PlaceObject(self, object));
     }
+    self->numbers_depth = 0;
 
-    popped = py_yajl_ps_current(self->elements);
-    py_yajl_ps_pop(self->elements);
-    last = py_yajl_ps_current(self->elements);
+    count = CloseContainer(self);
+    items = self->elements.stack + py_yajl_ps_length(self->elements) - count;
+    object = PyList_New(count);
+    if (!object)
+        return failure;
 
-    return _PlaceObject(self, last, popped);
+    /* the list takes over the stack's references */
+    for (i = 0; i < count; i++) {
+        PyList_SET_ITEM(object, i, items[i]);
+    }
+    self->elements.used -= count;
+    return StatsEnd(self, start, &_internal_stats.lists, PlaceObject(self, object));
 }
 
-static yajl_callbacks decode_callbacks = {
+yajl_callbacks _internal_decode_callbacks = {
     handle_null,
     handle_bool,
     NULL,
@@ -230,51 +735,747 @@ static yajl_callbacks decode_callbacks = {
     handle_end_list
 };
 
-PyObject *_internal_decode(_YajlDecoder *self, char *buffer, unsigned int buflen)
+/*
+ * The parser is the only thing allocated from the arena, so once it's gone
+ * the arena can be rewound for the next one
+ */
+static void FreeParser(_YajlDecoder *self)
+{
+    if (self->_parser) {
+        yajl_free((yajl_handle)(self->_parser));
+        self->_parser = NULL;
+        py_yajl_arena_reset(&self->arena);
+    }
+}
+
+/*
+ * Drops any partially built objects and the parser handle, leaving the
+ * decoder ready for a new document.  The key cache is kept.
+ */
+void _internal_decode_reset(_YajlDecoder *self)
+{
+    while (py_yajl_ps_length(self->elements) > 0) {
+        Py_XDECREF(py_yajl_ps_current(self->elements));
+        py_yajl_ps_pop(self->elements);
+    }
+    while (py_yajl_ps_length(self->keys) > 0) {
+        Py_XDECREF(py_yajl_ps_current(self->keys));
+        py_yajl_ps_pop(self->keys);
+    }
+    self->depth = 0;
+    self->numbers_depth = 0;
+    self->numbers_used = 0;
+    Py_XDECREF(self->root);
+    self->root = NULL;
+
+    FreeParser(self);
+}
+
+/*
+ * Sets up an empty decoder; the parser is allocated on first use
+ */
+void _internal_decode_init(_YajlDecoder *self)
+{
+    py_yajl_ps_init(self->elements);
+    py_yajl_ps_init(self->keys);
+    self->frames = NULL;
+    self->depth = 0;
+    self->frames_size = 0;
+    self->root = NULL;
+    self->root_end = 0;
+    self->keycache = NULL;
+    self->values = NULL;
+    self->_parser = NULL;
+    self->callback_state = NULL;
+    py_yajl_arena_init(&self->arena);
+    self->numeric_arrays = 0;
+    self->numbers = NULL;
+    self->numbers_used = 0;
+    self->numbers_size = 0;
+    self->numbers_depth = 0;
+    self->numbers_kind = 0;
+}
+
+/*
+ * Releases everything the decoder holds; it can be initialized again
+ */
+void _internal_decode_free(_YajlDecoder *self)
+{
+    _internal_decode_reset(self);
+    py_yajl_ps_free(self->elements);
+    py_yajl_ps_init(self->elements);
+    py_yajl_ps_free(self->keys);
+    py_yajl_ps_init(self->keys);
+    free(self->frames);
+    self->frames = NULL;
+    self->frames_size = 0;
+    _internal_clear_cache(self);
+    Py_CLEAR(self->values);
+    py_yajl_arena_free(&self->arena);
+    free(self->numbers);
+    self->numbers = NULL;
+    self->numbers_size = 0;
+}
+
+void _internal_decode_error(_YajlDecoder *self, yajl_status yrc, char *buffer, unsigned int buflen)
 {
-    if (self->elements.used > 0) {
-        py_yajl_ps_free(self->elements);
-        py_yajl_ps_init(self->elements);
+    yajl_handle parser = (yajl_handle)(self->_parser);
+    unsigned char* str;
+
+    // TODO: It would be nice to make these parse errors more consistent with
+    // Oil.  And maybe return them rather than printing on stderr.
+    /* a callback that gave up has already raised the real error */
+    if ((yrc != yajl_status_client_canceled) || (!PyErr_Occurred())) {
+        str = yajl_get_error(parser, buffer != NULL, (const unsigned char *)(buffer), buflen);
+        fprintf(stderr, "%s", (const char *) str);
+        yajl_free_error(parser, str);
     }
-    if (self->keys.used > 0) {
-        py_yajl_ps_free(self->keys);
-        py_yajl_ps_init(self->keys);
+
+    _internal_decode_reset(self);
+
+    if (!PyErr_Occurred())
+        PyErr_SetString(PyExc_ValueError, yajl_status_to_string(yrc));
+}
+
+int _internal_is_blank(const char *buffer, unsigned int buflen)
+{
+    unsigned int i;
+
+    for (i = 0; i < buflen; i++) {
+        switch (buffer[i]) {
+            case ' ': case '\t': case '\n': case '\r': case '\f': case '\v':
+                break;
+            default:
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * yajl_parse() on the chunk, or yajl_complete_parse() if `complete` is set,
+ * timed for yajl.stats() when it's on
+ */
+yajl_status _internal_parse(yajl_handle parser, const unsigned char *buffer, size_t buflen,
+                            int complete)
+{
+    unsigned PY_LONG_LONG start, built;
+    yajl_status yrc;
+
+    if (!_internal_stats_enabled) {
+        return complete ? yajl_complete_parse(parser) : yajl_parse(parser, buffer, buflen);
     }
 
-    /* callbacks, config, allocfuncs */
-    yajl_handle parser = yajl_alloc(&decode_callbacks, NULL, (void *)(self));
+    start = _internal_stats_clock();
+    built = _internal_stats.build_ns;
+    yrc = complete ? yajl_complete_parse(parser) : yajl_parse(parser, buffer, buflen);
+    _internal_stats.parse_ns += (_internal_stats_clock() - start) -
+                                (_internal_stats.build_ns - built);
+    _internal_stats.bytes += buflen;
+    return yrc;
+}
 
+static yajl_handle GetParser(_YajlDecoder *self, int multiple_values)
+{
+    if (!self->_parser) {
+        /* callbacks, config, allocfuncs */
+        self->_parser = yajl_alloc(&_internal_decode_callbacks, &self->arena.funcs, (void *)(self));
+        if (!self->_parser) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        if (multiple_values) {
+            yajl_config((yajl_handle)(self->_parser), yajl_allow_multiple_values, 1);
+        }
+    }
+    return (yajl_handle)(self->_parser);
+}
+
+/*
+ * Feeds the next chunk of a document to the decoder, allocating the parser
+ * on the first call.  Partial tokens at the end of the chunk are buffered
+ * by yajl, so the chunk doesn't need to outlive this call.
+ */
+int _internal_decode_feed(_YajlDecoder *self, char *buffer, unsigned int buflen)
+{
+    yajl_handle parser = GetParser(self, self->values != NULL);
     yajl_status yrc;
-    yrc = yajl_parse(parser, (const unsigned char *)(buffer), buflen);
+
+    if (!parser)
+        return failure;
+
+    yrc = _internal_parse(parser, (const unsigned char *)(buffer), buflen, 0);
     if (yrc != yajl_status_ok) {
-        goto error;
+        _internal_decode_error(self, yrc, buffer, buflen);
+        return failure;
     }
+    return success;
+}
 
-    yrc = yajl_complete_parse(parser);
+/*
+ * Completes the parse of everything fed so far and releases the parser
+ */
+int _internal_decode_complete(_YajlDecoder *self)
+{
+    yajl_status yrc;
+
+    if (!self->_parser) {
+        if (_internal_decode_feed(self, NULL, 0) != success)
+            return failure;
+    }
+
+    yrc = _internal_parse((yajl_handle)(self->_parser), NULL, 0, 1);
     if (yrc != yajl_status_ok) {
-        goto error;
+        _internal_decode_error(self, yrc, NULL, 0);
+        return failure;
     }
 
-    yajl_free(parser);
+    FreeParser(self);
+    return success;
+}
+
+/*
+ * Finishes the document fed so far and returns its root object
+ */
+PyObject *_internal_decode_close(_YajlDecoder *self)
+{
+    PyObject *root;
+
+    if (_internal_decode_complete(self) != success)
+        return NULL;
 
     assert(self->root != NULL);
 
     // Callee now owns memory, we'll leave refcnt at one and
     // null out our pointer.
-    PyObject *root = self->root;
+    root = self->root;
     self->root = NULL;
     return root;
+}
 
-    unsigned char* str;
-error:
-    // TODO: It would be nice to make these parse errors more consistent with
-    // Oil.  And maybe return them rather than printing on stderr.
-    str = yajl_get_error(parser, 1, buffer, buflen);
-    fprintf(stderr, "%s", (const char *) str); 
-    yajl_free_error(parser, str);  
-    yajl_free(parser);
+static PyObject *DocumentError(_YajlDecoder *self, const char *message)
+{
+    _internal_decode_reset(self);
+    PyErr_SetString(PyExc_ValueError, message);
+    return NULL;
+}
 
-    //fprintf(stderr, "YAJL ERROR %s\n", yajl_status_to_string(yrc));
-    PyErr_SetString(PyExc_ValueError, yajl_status_to_string(yrc));
+/*
+ * Decodes one complete document.  yajl 2 has no way to reset a parser, but
+ * in multiple values mode yajl_complete_parse() leaves it ready for the next
+ * value, so the parser is kept on the decoder between documents and only
+ * freed after an error.  That mode doesn't enforce document boundaries, so
+ * they are checked here instead.
+ */
+PyObject *_internal_decode(_YajlDecoder *self, char *buffer, unsigned int buflen)
+{
+    yajl_handle parser;
+    yajl_status yrc;
+    PyObject *root;
+
+    if ((self->depth > 0) || (py_yajl_ps_length(self->elements) > 0) ||
+            (py_yajl_ps_length(self->keys) > 0) || (self->root)) {
+        _internal_decode_reset(self);
+    }
+
+    parser = GetParser(self, 1);
+    if (!parser)
+        return NULL;
+
+    yrc = _internal_parse(parser, (const unsigned char *)(buffer), buflen, 0);
+    if (yrc != yajl_status_ok) {
+        _internal_decode_error(self, yrc, buffer, buflen);
+        return NULL;
+    }
+    if ((self->root) && (!_internal_is_blank(buffer + self->root_end,
+                                             buflen - self->root_end))) {
+        return DocumentError(self, "trailing garbage");
+    }
+
+    yrc = _internal_parse(parser, NULL, 0, 1);
+    if (yrc != yajl_status_ok) {
+        _internal_decode_error(self, yrc, NULL, 0);
+        return NULL;
+    }
+    if (!self->root) {
+        return DocumentError(self, "premature EOF");
+    }
+
+    // Callee now owns memory, we'll leave refcnt at one and
+    // null out our pointer.
+    root = self->root;
+    self->root = NULL;
+    return root;
+}
+
+/*
+ * Path projection: yajl.loads(string, paths=[...]).  The paths are compiled
+ * into a trie of key/index segments, and a separate set of callbacks walks
+ * it alongside the parse.  Subtrees no path leads into are skipped by
+ * counting their depth, without creating anything; a value that a path ends
+ * at is built by handing its events to the regular callbacks above.
+ */
+typedef struct PathNode {
+    PyObject *segment;          /* key, as a string */
+    long index;                 /* the segment as an array index, or -1 */
+    struct PathNode **children;
+    unsigned int nchildren;
+    PyObject *paths;            /* paths ending here, or NULL */
+} PathNode;
+
+typedef struct {
+    PathNode *node;
+    int list;
+    long index;                 /* lists: index of the next element */
+    PathNode *pending;          /* dicts: node for the value after the key */
+} PathFrame;
+
+typedef struct {
+    PathNode root;
+    PathNode *next_root;        /* the root node until the top value starts */
+    PathFrame *frames;
+    unsigned int depth;
+    unsigned int size;
+    unsigned int skip;          /* depth inside a skipped subtree */
+    PathNode *capturing;        /* node whose value is being built */
+    PyObject *results;
+} PathProjection;
+
+#define PROJECTION(self) ((PathProjection *)((self)->callback_state))
+
+static void FreePathNode(PathNode *node)
+{
+    unsigned int i;
+
+    for (i = 0; i < node->nchildren; i++) {
+        FreePathNode(node->children[i]);
+        free(node->children[i]);
+    }
+    free(node->children);
+    Py_XDECREF(node->segment);
+    Py_XDECREF(node->paths);
+}
+
+static PathNode *FindChild(PathNode *node, const char *key, size_t length)
+{
+    unsigned int i;
+
+    for (i = 0; i < node->nchildren; i++) {
+        PyObject *segment = node->children[i]->segment;
+
+        if (((size_t)(PyString_GET_SIZE(segment)) == length) &&
+                (memcmp(PyString_AS_STRING(segment), key, length) == 0)) {
+            return node->children[i];
+        }
+    }
     return NULL;
 }
+
+static PathNode *FindIndex(PathNode *node, long index)
+{
+    unsigned int i;
+
+    for (i = 0; i < node->nchildren; i++) {
+        if (node->children[i]->index == index)
+            return node->children[i];
+    }
+    return NULL;
+}
+
+static long SegmentIndex(const char *segment, Py_ssize_t length)
+{
+    long index = 0;
+    Py_ssize_t i;
+
+    if ((length == 0) || (length > 9) || ((length > 1) && (segment[0] == '0')))
+        return -1;
+    for (i = 0; i < length; i++) {
+        if ((segment[i] < '0') || (segment[i] > '9'))
+            return -1;
+        index = index * 10 + (segment[i] - '0');
+    }
+    return index;
+}
+
+static PathNode *AddChild(PathNode *node, const char *segment, Py_ssize_t length)
+{
+    PathNode *child = FindChild(node, segment, (unsigned int)(length));
+    PathNode **children;
+
+    if (child)
+        return child;
+
+    children = (PathNode **)(realloc(node->children, (node->nchildren + 1) * sizeof(PathNode *)));
+    if (!children)
+        return (PathNode *)(PyErr_NoMemory());
+    node->children = children;
+
+    child = (PathNode *)(calloc(1, sizeof(PathNode)));
+    if (!child)
+        return (PathNode *)(PyErr_NoMemory());
+    child->segment = PyString_FromStringAndSize(segment, length);
+    if (!child->segment) {
+        free(child);
+        return NULL;
+    }
+    child->index = SegmentIndex(segment, length);
+    node->children[node->nchildren++] = child;
+    return child;
+}
+
+/*
+ * A path is either a JSON Pointer ("/items/0/name", with ~1 for '/' and ~0
+ * for '~') or dotted ("items.0.name").  The empty path is the whole
+ * document.
+ */
+static int AddPath(PathNode *root, PyObject *path)
+{
+    const char *p, *end;
+    char separator = '.';
+    PathNode *node = root;
+
+    if (!PyString_Check(path)) {
+        PyErr_SetString(PyExc_TypeError, "paths must be strings");
+        return failure;
+    }
+    p = PyString_AS_STRING(path);
+    end = p + PyString_GET_SIZE(path);
+    if (p < end) {
+        if (*p == '/') {
+            separator = '/';
+            p++;
+        }
+        for (;;) {
+            const char *stop = memchr(p, separator, end - p);
+            char segment[256];
+            Py_ssize_t length = 0;
+
+            if (!stop)
+                stop = end;
+            if (stop - p > (Py_ssize_t)(sizeof(segment))) {
+                PyErr_SetString(PyExc_ValueError, "path segment too long");
+                return failure;
+            }
+            for (; p < stop; p++) {
+                if ((separator == '/') && (*p == '~') && (p + 1 < stop) &&
+                        ((p[1] == '0') || (p[1] == '1'))) {
+                    segment[length++] = (p[1] == '0') ? '~' : '/';
+                    p++;
+                } else {
+                    segment[length++] = *p;
+                }
+            }
+            node = AddChild(node, segment, length);
+            if (!node)
+                return failure;
+            if (p == end)
+                break;
+            p++;
+        }
+    }
+
+    if (!node->paths) {
+        node->paths = PyList_New(0);
+        if (!node->paths)
+            return failure;
+    }
+    return (PyList_Append(node->paths, path) == 0) ? success : failure;
+}
+
+static int StoreMatch(PathProjection *projection, PathNode *node, PyObject *value)
+{
+    Py_ssize_t i;
+
+    if (!node->paths)
+        return success;
+    for (i = 0; i < PyList_GET_SIZE(node->paths); i++) {
+        if (PyDict_SetItem(projection->results, PyList_GET_ITEM(node->paths, i), value) < 0)
+            return failure;
+    }
+    return success;
+}
+
+/* Paths that continue below a value that was built are looked up in it */
+static int ResolveBelow(PathProjection *projection, PathNode *node, PyObject *value)
+{
+    unsigned int i;
+
+    for (i = 0; i < node->nchildren; i++) {
+        PathNode *child = node->children[i];
+        PyObject *below = NULL;
+
+        if (PyDict_Check(value)) {
+            below = PyDict_GetItem(value, child->segment);
+        } else if ((PyList_Check(value)) && (child->index >= 0) &&
+                   (child->index < PyList_GET_SIZE(value))) {
+            below = PyList_GET_ITEM(value, child->index);
+        }
+        if (!below)
+            continue;
+        if ((StoreMatch(projection, child, below) != success) ||
+                (ResolveBelow(projection, child, below) != success))
+            return failure;
+    }
+    return success;
+}
+
+/* Called after each event handed to the regular callbacks */
+static int FinishCapture(_YajlDecoder *self, int rc)
+{
+    PathProjection *projection = PROJECTION(self);
+    PathNode *node = projection->capturing;
+    PyObject *value;
+
+    if ((rc != success) || (!self->root))
+        return rc;
+
+    value = _internal_take_root(self);
+    projection->capturing = NULL;
+    rc = StoreMatch(projection, node, value);
+    if (rc == success)
+        rc = ResolveBelow(projection, node, value);
+    Py_DECREF(value);
+    return rc;
+}
+
+/*
+ * Finds the node for the value about to start.  Returns NULL when no path
+ * leads into it.
+ */
+static PathNode *NextNode(PathProjection *projection)
+{
+    PathFrame *frame;
+    PathNode *node;
+
+    if (projection->depth == 0) {
+        node = projection->next_root;
+        projection->next_root = NULL;
+        return node;
+    }
+    frame = &projection->frames[projection->depth - 1];
+    if (frame->list)
+        return FindIndex(frame->node, frame->index++);
+    node = frame->pending;
+    frame->pending = NULL;
+    return node;
+}
+
+enum { skip_value, capture_value, descend_value };
+
+static int BeginValue(PathProjection *projection, PathNode **node)
+{
+    *node = NextNode(projection);
+    if (!*node)
+        return skip_value;
+    if ((*node)->paths) {
+        projection->capturing = *node;
+        return capture_value;
+    }
+    return descend_value;
+}
+
+static int BeginContainer(_YajlDecoder *self, int list, int (*handler)(void *))
+{
+    PathProjection *projection = PROJECTION(self);
+    PathFrame *frame;
+    PathNode *node;
+
+    if (projection->capturing)
+        return handler(self);
+    if (projection->skip) {
+        projection->skip++;
+        return success;
+    }
+
+    switch (BeginValue(projection, &node)) {
+        case skip_value:
+            projection->skip = 1;
+            return success;
+        case capture_value:
+            return handler(self);
+    }
+
+    if (projection->depth == projection->size) {
+        unsigned int size = projection->size ? projection->size * 2 : PY_YAJL_PS_INC;
+        PathFrame *frames = (PathFrame *)(realloc(projection->frames, size * sizeof(PathFrame)));
+
+        if (!frames) {
+            PyErr_NoMemory();
+            return failure;
+        }
+        projection->frames = frames;
+        projection->size = size;
+    }
+    frame = &projection->frames[projection->depth++];
+    frame->node = node;
+    frame->list = list;
+    frame->index = 0;
+    frame->pending = NULL;
+    return success;
+}
+
+static int EndContainer(_YajlDecoder *self, int (*handler)(void *))
+{
+    PathProjection *projection = PROJECTION(self);
+
+    if (projection->capturing)
+        return FinishCapture(self, handler(self));
+    if (projection->skip) {
+        projection->skip--;
+        return success;
+    }
+    projection->depth--;
+    return success;
+}
+
+/* Scalars are only ever built when a path ends at them */
+#define PROJECT_SCALAR(self, call)                                      \
+    PathProjection *projection = PROJECTION(self);                      \
+    PathNode *node;                                                     \
+                                                                        \
+    if ((!projection->capturing) && ((projection->skip) ||              \
+            (BeginValue(projection, &node) != capture_value)))          \
+        return success;                                                 \
+    return FinishCapture(self, (call));
+
+static int project_null(void *ctx)
+{
+    PROJECT_SCALAR((_YajlDecoder *)(ctx), handle_null(ctx))
+}
+
+static int project_bool(void *ctx, int value)
+{
+    PROJECT_SCALAR((_YajlDecoder *)(ctx), handle_bool(ctx, value))
+}
+
+static int project_number(void *ctx, const char *value, size_t length)
+{
+    PROJECT_SCALAR((_YajlDecoder *)(ctx), handle_number(ctx, value, length))
+}
+
+static int project_string(void *ctx, const unsigned char *value, size_t length)
+{
+    PROJECT_SCALAR((_YajlDecoder *)(ctx), handle_string(ctx, value, length))
+}
+
+static int project_dict_key(void *ctx, const unsigned char *value, size_t length)
+{
+    _YajlDecoder *self = (_YajlDecoder *)(ctx);
+    PathProjection *projection = PROJECTION(self);
+    PathFrame *frame;
+
+    if (projection->capturing)
+        return handle_dict_key(ctx, value, length);
+    if (projection->skip)
+        return success;
+
+    frame = &projection->frames[projection->depth - 1];
+    frame->pending = FindChild(frame->node, (const char *)(value), length);
+    return success;
+}
+
+static int project_start_dict(void *ctx)
+{
+    return BeginContainer((_YajlDecoder *)(ctx), 0, handle_start_dict);
+}
+
+static int project_end_dict(void *ctx)
+{
+    return EndContainer((_YajlDecoder *)(ctx), handle_end_dict);
+}
+
+static int project_start_list(void *ctx)
+{
+    return BeginContainer((_YajlDecoder *)(ctx), 1, handle_start_list);
+}
+
+static int project_end_list(void *ctx)
+{
+    return EndContainer((_YajlDecoder *)(ctx), handle_end_list);
+}
+
+static yajl_callbacks project_callbacks = {
+    project_null,
+    project_bool,
+    NULL,
+    NULL,
+    project_number,
+    project_string,
+    project_start_dict,
+    project_dict_key,
+    project_end_dict,
+    project_start_list,
+    project_end_list
+};
+
+/*
+ * Decodes one complete document, returning a dict that maps each of `paths`
+ * that matched something to the value found there
+ */
+PyObject *_internal_decode_paths(_YajlDecoder *self, char *buffer, unsigned int buflen,
+                                 PyObject *paths)
+{
+    PathProjection projection;
+    PyObject *iterator, *path, *result = NULL;
+    yajl_status yrc;
+
+    memset(&projection, 0, sizeof(projection));
+    projection.root.index = -1;
+    projection.next_root = &projection.root;
+
+    /* a single path would otherwise be taken as a path per character */
+    if (PyString_Check(paths) || PyUnicode_Check(paths)) {
+        PyErr_SetString(PyExc_TypeError, "paths must be a sequence of paths, not a string");
+        goto exit;
+    }
+    iterator = PyObject_GetIter(paths);
+    if (!iterator)
+        goto exit;
+    while ((path = PyIter_Next(iterator))) {
+        int rc = AddPath(&projection.root, path);
+
+        Py_DECREF(path);
+        if (rc != success)
+            break;
+    }
+    Py_DECREF(iterator);
+    if (PyErr_Occurred())
+        goto exit;
+
+    projection.results = PyDict_New();
+    if (!projection.results)
+        goto exit;
+
+    _internal_decode_reset(self);
+    self->_parser = yajl_alloc(&project_callbacks, &self->arena.funcs, (void *)(self));
+    if (!self->_parser) {
+        PyErr_NoMemory();
+        goto exit;
+    }
+    self->callback_state = &projection;
+
+    yrc = _internal_parse((yajl_handle)(self->_parser), (const unsigned char *)(buffer), buflen, 0);
+    if (yrc != yajl_status_ok) {
+        _internal_decode_error(self, yrc, buffer, buflen);
+        goto exit;
+    }
+    yrc = _internal_parse((yajl_handle)(self->_parser), NULL, 0, 1);
+    if (yrc != yajl_status_ok) {
+        _internal_decode_error(self, yrc, NULL, 0);
+        goto exit;
+    }
+
+    FreeParser(self);
+    if (_internal_stats_enabled)
+        _internal_stats.documents++;
+    result = projection.results;
+    projection.results = NULL;
+
+exit:
+    self->callback_state = NULL;
+    _internal_decode_reset(self);
+    Py_XDECREF(projection.results);
+    free(projection.frames);
+    FreePathNode(&projection.root);
+    return result;
+}
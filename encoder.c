@@ -31,16 +31,900 @@
  */
 #include <Python.h>
 
+#include <string.h>
+
 #include <yajl/yajl_parse.h>
 #include <yajl/yajl_gen.h>
 
 #include "py_yajl.h"
 
-static yajl_gen_status ProcessObject(_YajlEncoder *self, PyObject *object)
+/*
+ * Makes room for len more bytes at the end of the encoder's buffer, which is
+ * only ever reset, never shrunk, so a reused encoder stops allocating.
+ * Returns where they go, or NULL with the nomem flag set.
+ */
+static char *ReserveBuffer(_YajlEncoder *self, size_t len)
+{
+    if (self->used + len > self->size) {
+        size_t size = self->size ? self->size : 4096;
+        char *buffer;
+
+        while (size < self->used + len)
+            size *= 2;
+        buffer = (char *)(realloc(self->buffer, size));
+        if (!buffer) {
+            self->nomem = 1;
+            return NULL;
+        }
+        if (_internal_stats_enabled)
+            _internal_stats.encode_buffer_grows++;
+        self->buffer = buffer;
+        self->size = size;
+    }
+    return self->buffer + self->used;
+}
+
+/*
+ * yajl_gen print callback: appends to the encoder's buffer
+ */
+static void EncoderPrint(void *ctx, const char *str, size_t len)
+{
+    _YajlEncoder *self = (_YajlEncoder *)(ctx);
+    char *out = ReserveBuffer(self, len);
+
+    if (!out)
+        return;
+    memcpy(out, str, len);
+    self->used += len;
+}
+
+static int FlushEncoder(_YajlEncoder *self)
+{
+    PyObject *rc;
+
+    if (self->used == 0)
+        return success;
+
+    rc = PyObject_CallMethod(self->stream, "write", "s#", self->buffer, (int)(self->used));
+    if (!rc)
+        return failure;
+    Py_DECREF(rc);
+    if (_internal_stats_enabled)
+        _internal_stats.encode_bytes += self->used;
+    self->used = 0;
+    return success;
+}
+
+/*
+ * Called between values; passes the buffered output on to the stream once
+ * it has grown past the chunk size
+ */
+static int MaybeFlushEncoder(_YajlEncoder *self)
+{
+    if ((self->stream) && (self->used >= self->chunk_size))
+        return FlushEncoder(self);
+    return success;
+}
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+/*
+ * Writes the decimal digits of value backwards, ending just before end,
+ * two at a time out of digit_pairs.  Returns the first digit written.
+ */
+static char *FormatDigits(char *end, unsigned long long value)
+{
+    while (value >= 100) {
+        unsigned int pair = (unsigned int)(value % 100) * 2;
+        value /= 100;
+        *--end = digit_pairs[pair + 1];
+        *--end = digit_pairs[pair];
+    }
+    if (value >= 10) {
+        unsigned int pair = (unsigned int)(value) * 2;
+        *--end = digit_pairs[pair + 1];
+        *--end = digit_pairs[pair];
+    } else {
+        *--end = (char)('0' + value);
+    }
+    return end;
+}
+
+static char *FormatInteger(char *end, long long number)
+{
+    unsigned long long magnitude = (number < 0) ?
+        0ULL - (unsigned long long)(number) : (unsigned long long)(number);
+    char *start = FormatDigits(end, magnitude);
+
+    if (number < 0)
+        *--start = '-';
+    return start;
+}
+
+static yajl_gen_status GenerateInteger(yajl_gen handle, long long number)
+{
+    char buffer[24];
+    char *end = buffer + sizeof(buffer);
+    char *start = FormatInteger(end, number);
+
+    return yajl_gen_number(handle, start, (unsigned int)(end - start));
+}
+
+/*
+ * Longs that fit in a long long take the same path as ints, anything wider
+ * is written out in full from its decimal string
+ */
+static yajl_gen_status GenerateLong(yajl_gen handle, PyObject *object)
+{
+    yajl_gen_status status;
+    PyObject *digits;
+    int overflow = 0;
+    long long number = PyLong_AsLongLongAndOverflow(object, &overflow);
+
+    if ( (number == -1) && (PyErr_Occurred()) ) {
+        return yajl_gen_in_error_state;
+    }
+    if (!overflow) {
+        return GenerateInteger(handle, number);
+    }
+
+    digits = PyLong_Type.tp_str(object);
+    if (!digits)
+        return yajl_gen_in_error_state;
+    status = yajl_gen_number(handle, PyString_AS_STRING(digits),
+                             (unsigned int)(PyString_GET_SIZE(digits)));
+    Py_DECREF(digits);
+    return status;
+}
+
+/*
+ * Doubles are written as the shortest string that reads back as the same
+ * value, laid out like Python's repr(): 0.1, 1.0, 1e+16, 1e-05.  The digits
+ * come from the interpreter's own dtoa in its shortest mode; builds that
+ * lack it fall back to PyOS_double_to_string(), which gives the same text.
+ *
+ * Formats number into buffer, which must hold 32 bytes, and returns the
+ * length; -1 with an exception set if it can't be written.
+ */
+static int FormatDouble(double number, char *buffer)
+{
+    if (!Py_IS_FINITE(number)) {
+        PyErr_SetString(PyExc_ValueError,
+            "Out of range float values are not JSON compliant");
+        return -1;
+    }
+#ifndef PY_NO_SHORT_FLOAT_REPR
+    {
+        char *out = buffer;
+        char *digits, *end;
+        int decpt, sign, ndigits, exponent;
+
+        digits = _Py_dg_dtoa(number, 0, 0, &decpt, &sign, &end);
+        if (!digits) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        ndigits = (int)(end - digits);
+
+        if (sign)
+            *out++ = '-';
+        if ( (decpt <= -4) || (decpt > 16) ) {
+            *out++ = digits[0];
+            if (ndigits > 1) {
+                *out++ = '.';
+                memcpy(out, digits + 1, ndigits - 1);
+                out += ndigits - 1;
+            }
+            exponent = decpt - 1;
+            *out++ = 'e';
+            *out++ = (exponent < 0) ? '-' : '+';
+            if (exponent < 0)
+                exponent = -exponent;
+            if (exponent < 10)
+                *out++ = '0';
+            end = buffer + 32;
+            end = FormatDigits(end, (unsigned long long)(exponent));
+            memmove(out, end, buffer + 32 - end);
+            out += buffer + 32 - end;
+        } else if (decpt <= 0) {
+            *out++ = '0';
+            *out++ = '.';
+            memset(out, '0', -decpt);
+            out += -decpt;
+            memcpy(out, digits, ndigits);
+            out += ndigits;
+        } else if (decpt >= ndigits) {
+            memcpy(out, digits, ndigits);
+            out += ndigits;
+            memset(out, '0', decpt - ndigits);
+            out += decpt - ndigits;
+            *out++ = '.';
+            *out++ = '0';
+        } else {
+            memcpy(out, digits, decpt);
+            out += decpt;
+            *out++ = '.';
+            memcpy(out, digits + decpt, ndigits - decpt);
+            out += ndigits - decpt;
+        }
+        _Py_dg_freedtoa(digits);
+        return (int)(out - buffer);
+    }
+#else
+    {
+        char *repr = PyOS_double_to_string(number, 'r', 0, Py_DTSF_ADD_DOT_0, NULL);
+        size_t length;
+
+        if (!repr)
+            return -1;
+        length = strlen(repr);
+        if (length > 32) {
+            PyMem_Free(repr);
+            PyErr_SetString(PyExc_ValueError, "float repr too long");
+            return -1;
+        }
+        memcpy(buffer, repr, length);
+        PyMem_Free(repr);
+        return (int)(length);
+    }
+#endif
+}
+
+static yajl_gen_status GenerateDouble(yajl_gen handle, double number)
+{
+    char buffer[32];
+    int length = FormatDouble(number, buffer);
+
+    if (length < 0)
+        return yajl_gen_invalid_number;
+    return yajl_gen_number(handle, buffer, (unsigned int)(length));
+}
+
+/*
+ * String escaping.  Most strings have nothing in them that needs escaping,
+ * so the scanners below look for the next '"', '\\' or control character
+ * a block at a time and the clean run before it is copied in one go.  The
+ * widest scanner the CPU supports is picked the first time one is needed.
+ */
+#define NEEDS_ESCAPE(c) (((c) < 0x20) || ((c) == '"') || ((c) == '\\'))
+
+typedef size_t (*escape_scanner)(const unsigned char *str, size_t len);
+
+static size_t FindEscapeScalar(const unsigned char *str, size_t len)
+{
+    const unsigned long long ones = 0x0101010101010101ULL;
+    const unsigned long long highs = 0x8080808080808080ULL;
+    size_t i = 0;
+
+    /* Eight bytes at a time, testing for a zero byte after each XOR */
+    for (; i + 8 <= len; i += 8) {
+        unsigned long long word, quote, backslash;
+
+        memcpy(&word, str + i, 8);
+        quote = word ^ (ones * '"');
+        backslash = word ^ (ones * '\\');
+        if ( ((word - ones * 0x20) & ~word & highs) ||
+             ((quote - ones) & ~quote & highs) ||
+             ((backslash - ones) & ~backslash & highs) ) {
+            break;
+        }
+    }
+    for (; i < len; i++) {
+        if (NEEDS_ESCAPE(str[i]))
+            return i;
+    }
+    return len;
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static size_t FindEscapeSSE2(const unsigned char *str, size_t len)
+{
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                         _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+        int mask = _mm_movemask_epi8(hits);
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + FindEscapeScalar(str + i, len - i);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PY_YAJL_HAVE_AVX2
+#include <immintrin.h>
+
+/*
+ * Switching to 256-bit instructions has a cost of its own on some machines,
+ * more than SSE2 loses over a short string, so runs shorter than this are
+ * left to the SSE2 scanner
+ */
+#define PY_YAJL_AVX2_MIN 4096
+
+__attribute__((target("avx2")))
+static size_t FindEscapeAVX2(const unsigned char *str, size_t len)
+{
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1f);
+    size_t i = 0;
+
+    if (len < PY_YAJL_AVX2_MIN)
+        return FindEscapeSSE2(str, len);
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(str + i));
+        __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+                            _mm256_cmpeq_epi8(chunk, backslash)),
+            _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control), control));
+        unsigned int mask = (unsigned int)(_mm256_movemask_epi8(hits));
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + FindEscapeSSE2(str + i, len - i);
+}
+#endif
+#endif
+
+static escape_scanner FindEscape = NULL;
+
+static escape_scanner PickEscapeScanner(void)
+{
+#if defined(PY_YAJL_HAVE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return FindEscapeAVX2;
+#endif
+#if defined(__SSE2__)
+    return FindEscapeSSE2;
+#else
+    return FindEscapeScalar;
+#endif
+}
+
+static int AppendRaw(_YajlEncoder *self, const char *text, size_t len)
+{
+    char *out = ReserveBuffer(self, len);
+
+    if (!out)
+        return failure;
+    memcpy(out, text, len);
+    self->used += len;
+    return success;
+}
+
+/*
+ * Appends the escaped contents of str, without quotes, to the buffer.
+ * Escapes match yajl's own.
+ */
+static int EscapeString(_YajlEncoder *self, const unsigned char *str, size_t len)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    size_t pos = 0;
+    char *out;
+
+    while (pos < len) {
+        size_t run = FindEscape(str + pos, len - pos);
+        unsigned char c;
+
+        if (!(out = ReserveBuffer(self, run + 6)))
+            return failure;
+        memcpy(out, str + pos, run);
+        out += run;
+        pos += run;
+        if (pos == len) {
+            self->used = out - self->buffer;
+            break;
+        }
+
+        c = str[pos++];
+        *out++ = '\\';
+        switch (c) {
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '\b': *out++ = 'b'; break;
+            case '\f': *out++ = 'f'; break;
+            case '\n': *out++ = 'n'; break;
+            case '\r': *out++ = 'r'; break;
+            case '\t': *out++ = 't'; break;
+            default:
+                *out++ = 'u';
+                *out++ = '0';
+                *out++ = '0';
+                *out++ = hex[c >> 4];
+                *out++ = hex[c & 0x0f];
+                break;
+        }
+        self->used = out - self->buffer;
+    }
+    return success;
+}
+
+/*
+ * Writes str as a JSON string.  yajl_gen_string() is handed an empty string
+ * so it still takes care of separators, indentation and its own state; the
+ * closing quote it prints (and the newline that follows a top-level value
+ * when beautifying) is then taken back off the buffer, the escaped contents
+ * go in its place, and the tail is put back.
+ */
+static yajl_gen_status GenerateString(_YajlEncoder *self,
+                                      const unsigned char *str, size_t len)
+{
+    yajl_gen_status status;
+    size_t tail;
+
+    status = yajl_gen_string((yajl_gen)(self->_generator), (const unsigned char *)(""), 0);
+    if (status != yajl_gen_status_ok)
+        return status;
+    if (self->nomem)
+        return yajl_gen_in_error_state;
+
+    tail = (self->buffer[self->used - 1] == '\n') ? 2 : 1;
+    self->used -= tail;
+    if (EscapeString(self, str, len) != success)
+        return yajl_gen_in_error_state;
+    if (AppendRaw(self, (tail == 2) ? "\"\n" : "\"", tail) != success)
+        return yajl_gen_in_error_state;
+    return yajl_gen_status_ok;
+}
+
+/*
+ * Dict keys.  A cached key keeps the text it's written with after the first
+ * member of a compact dict, `,"key":`; the text yajl's own key state needs
+ * and the first member's prefix are slices of it.
+ */
+struct _py_yajl_encoded_key {
+    PyObject *key;
+    size_t length;
+    char *text;
+};
+
+typedef struct _py_yajl_encoded_key EncodedKey;
+
+/*
+ * Finds the cache entry for key, escaping it and taking the slot over if
+ * `insert` is set.  Returns NULL for keys that aren't cached: anything but
+ * a short exact str, a miss when not inserting, or any key before the
+ * encoder has written enough of them for the cache to be set up.  Sets
+ * nomem on failure.
+ */
+static EncodedKey *LookupKey(_YajlEncoder *self, PyObject *key, int insert)
+{
+    EncodedKey *entry;
+    size_t start, length;
+    long hash;
+    char *text;
+
+    if ( (Py_TYPE(key) != &PyString_Type) ||
+         (PyString_GET_SIZE(key) > PY_YAJL_KEYCACHE_MAXKEY) ) {
+        return NULL;
+    }
+    if (!self->keycache) {
+        if ((!insert) || (++self->uncached_keys < PY_YAJL_ENCODE_KEYCACHE_AFTER))
+            return NULL;
+        self->keycache = (EncodedKey *)(calloc(PY_YAJL_ENCODE_KEYCACHE_SIZE, sizeof(EncodedKey)));
+        if (!self->keycache) {
+            self->nomem = 1;
+            return NULL;
+        }
+    }
+
+    hash = ((PyStringObject *)(key))->ob_shash;
+    if (hash == -1)
+        hash = PyObject_Hash(key);
+    entry = &self->keycache[(size_t)(hash) & (PY_YAJL_ENCODE_KEYCACHE_SIZE - 1)];
+    if (entry->key == key)
+        return entry;
+    if (!insert)
+        return NULL;
+
+    /* Escape the key past the end of the output, then copy it out */
+    start = self->used;
+    if (EscapeString(self, (const unsigned char *)(PyString_AS_STRING(key)),
+                     (size_t)(PyString_GET_SIZE(key))) != success) {
+        self->used = start;
+        return NULL;
+    }
+    length = self->used - start + 4;
+    text = (char *)(malloc(length));
+    if (!text) {
+        self->used = start;
+        self->nomem = 1;
+        return NULL;
+    }
+    text[0] = ',';
+    text[1] = '"';
+    memcpy(text + 2, self->buffer + start, length - 4);
+    text[length - 2] = '"';
+    text[length - 1] = ':';
+    self->used = start;
+
+    Py_XDECREF(entry->key);
+    free(entry->text);
+    Py_INCREF(key);
+    entry->key = key;
+    entry->length = length;
+    entry->text = text;
+    return entry;
+}
+
+static yajl_gen_status GenerateKey(_YajlEncoder *self, PyObject *key)
+{
+    yajl_gen_status status;
+    EncodedKey *entry;
+
+    if (!PyString_Check(key)) {
+        PyErr_SetString(PyExc_TypeError, "JSON object keys must be strings");
+        return yajl_gen_keys_must_be_strings;
+    }
+    entry = LookupKey(self, key, 1);
+    if (!entry) {
+        if (self->nomem)
+            return yajl_gen_in_error_state;
+        return GenerateString(self, (const unsigned char *)(PyString_AS_STRING(key)),
+                              (size_t)(PyString_GET_SIZE(key)));
+    }
+
+    /* As in GenerateString(); a key is never followed by a newline */
+    status = yajl_gen_string((yajl_gen)(self->_generator), (const unsigned char *)(""), 0);
+    if (status != yajl_gen_status_ok)
+        return status;
+    if (self->nomem)
+        return yajl_gen_in_error_state;
+    self->used -= 1;
+    if (AppendRaw(self, entry->text + 2, entry->length - 3) != success)
+        return yajl_gen_in_error_state;
+    return yajl_gen_status_ok;
+}
+
+/*
+ * Dict shapes.  A shape holds the keys of a dict in the order PyDict_Next
+ * yields them, and the text that goes before each value: `{"a":`, `,"b":`
+ * and so on.  It's only built out of keys that are already in the key
+ * cache, so one-off dicts don't churn through shapes.
+ */
+struct _py_yajl_dict_shape {
+    Py_ssize_t count;
+    PyObject **keys;
+    size_t *ends;       /* where each key's prefix ends in text */
+    char *text;
+};
+
+typedef struct _py_yajl_dict_shape DictShape;
+
+static void FreeShape(DictShape *shape)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < shape->count; i++)
+        Py_DECREF(shape->keys[i]);
+    free(shape);
+}
+
+static DictShape *NewShape(_YajlEncoder *self, PyObject **keys, Py_ssize_t count)
+{
+    EncodedKey *entries[PY_YAJL_SHAPE_MAXKEYS];
+    size_t length = 0, end = 0;
+    DictShape *shape;
+    Py_ssize_t i;
+
+    for (i = 0; i < count; i++) {
+        entries[i] = LookupKey(self, keys[i], 0);
+        if (!entries[i])
+            return NULL;
+        length += entries[i]->length;
+    }
+
+    shape = (DictShape *)(malloc(sizeof(DictShape) + count * sizeof(PyObject *) +
+                                 count * sizeof(size_t) + length));
+    if (!shape) {
+        self->nomem = 1;
+        return NULL;
+    }
+    shape->count = count;
+    shape->keys = (PyObject **)(shape + 1);
+    shape->ends = (size_t *)(shape->keys + count);
+    shape->text = (char *)(shape->ends + count);
+    for (i = 0; i < count; i++) {
+        Py_INCREF(keys[i]);
+        shape->keys[i] = keys[i];
+        memcpy(shape->text + end, entries[i]->text, entries[i]->length);
+        end += entries[i]->length;
+        shape->ends[i] = end;
+    }
+    shape->text[0] = '{';
+    return shape;
+}
+
+/*
+ * Writes a scalar value of a flat dict straight into the buffer
+ */
+static int WriteScalar(_YajlEncoder *self, PyObject *object)
+{
+    PyTypeObject *type = Py_TYPE(object);
+    char buffer[32];
+    char *end, *start;
+    int length;
+
+    if (type == &PyString_Type) {
+        if ( (AppendRaw(self, "\"", 1) != success) ||
+             (EscapeString(self, (const unsigned char *)(PyString_AS_STRING(object)),
+                           (size_t)(PyString_GET_SIZE(object))) != success) ) {
+            return failure;
+        }
+        return AppendRaw(self, "\"", 1);
+    }
+    if (type == &PyInt_Type) {
+        end = buffer + sizeof(buffer);
+        start = FormatInteger(end, PyInt_AS_LONG(object));
+        return AppendRaw(self, start, end - start);
+    }
+    if (type == &PyFloat_Type) {
+        length = FormatDouble(PyFloat_AS_DOUBLE(object), buffer);
+        if (length < 0)
+            return failure;
+        return AppendRaw(self, buffer, length);
+    }
+    if (object == Py_None)
+        return AppendRaw(self, "null", 4);
+    if (object == Py_True)
+        return AppendRaw(self, "true", 4);
+    return AppendRaw(self, "false", 5);
+}
+
+/*
+ * Writes an exact dict of plain scalars (str, int, float, bool and None)
+ * without going through yajl, when the output is compact and the dict has
+ * a known shape.  yajl_gen_number() is handed an empty string first so it
+ * still prints the separator and counts the dict as a value.  Sets *done
+ * if the dict was written; otherwise it's left to the frame walk.
+ */
+static yajl_gen_status GenerateFlatDict(_YajlEncoder *self, PyObject *dict, int *done)
+{
+    PyObject *keys[PY_YAJL_SHAPE_MAXKEYS], *values[PY_YAJL_SHAPE_MAXKEYS];
+    Py_ssize_t count = PyDict_Size(dict), pos = 0, i = 0;
+    yajl_gen_status status;
+    DictShape **slot;
+    PyObject *key, *value;
+    size_t start;
+
+    *done = 0;
+    if ( (self->beautify) || (!self->keycache) ||
+         (count == 0) || (count > PY_YAJL_SHAPE_MAXKEYS) ||
+         (self->depth >= self->max_depth) ) {
+        return yajl_gen_status_ok;
+    }
+    while (PyDict_Next(dict, &pos, &key, &value)) {
+        PyTypeObject *type = Py_TYPE(value);
+
+        if ( (type != &PyString_Type) && (type != &PyInt_Type) &&
+             (type != &PyFloat_Type) && (type != &PyBool_Type) &&
+             (value != Py_None) ) {
+            return yajl_gen_status_ok;
+        }
+        keys[i] = key;
+        values[i++] = value;
+    }
+
+    if (!self->shapes) {
+        self->shapes = (DictShape **)(calloc(PY_YAJL_SHAPECACHE_SIZE, sizeof(DictShape *)));
+        if (!self->shapes) {
+            self->nomem = 1;
+            return yajl_gen_in_error_state;
+        }
+    }
+    slot = &self->shapes[(((size_t)(keys[0]) >> 4) ^ (size_t)(count)) &
+                         (PY_YAJL_SHAPECACHE_SIZE - 1)];
+    if ( (!*slot) || ((*slot)->count != count) ||
+         (memcmp((*slot)->keys, keys, count * sizeof(PyObject *)) != 0) ) {
+        DictShape *shape = NewShape(self, keys, count);
+
+        if (!shape)
+            return self->nomem ? yajl_gen_in_error_state : yajl_gen_status_ok;
+        if (*slot)
+            FreeShape(*slot);
+        *slot = shape;
+    }
+
+    status = yajl_gen_number((yajl_gen)(self->_generator), "", 0);
+    if (status != yajl_gen_status_ok)
+        return status;
+    if ((_internal_stats_enabled) && (self->depth + 1 > _internal_stats.encode_max_depth))
+        _internal_stats.encode_max_depth = self->depth + 1;
+    for (i = 0; i < count; i++) {
+        start = i ? (*slot)->ends[i - 1] : 0;
+        if ( (AppendRaw(self, (*slot)->text + start, (*slot)->ends[i] - start) != success) ||
+             (WriteScalar(self, values[i]) != success) ) {
+            return yajl_gen_in_error_state;
+        }
+    }
+    if (AppendRaw(self, "}", 1) != success)
+        return yajl_gen_in_error_state;
+    *done = 1;
+    return yajl_gen_status_ok;
+}
+
+/*
+ * Containers are walked with an explicit stack of frames instead of
+ * recursion, one frame per open list or dict.  Exact lists and tuples are
+ * walked by index and exact dicts with PyDict_Next, which yields each value
+ * along with its key instead of looking it up again; subclasses, generators
+ * and OrderedDict go through the iterator protocol so their __iter__ is
+ * respected.  A frame holds its container (and iterator), since encoding a
+ * generator inside it can run code that mutates it.
+ */
+enum {
+    FRAME_SEQUENCE,
+    FRAME_DICT,
+    FRAME_ITERATOR,
+    FRAME_ITERATOR_DICT
+};
+
+struct _py_yajl_encode_frame {
+    int kind;
+    PyObject *object;
+    PyObject *iterator;
+    Py_ssize_t pos;
+};
+
+typedef struct _py_yajl_encode_frame EncodeFrame;
+
+static yajl_gen_status OpenFrame(_YajlEncoder *self, int kind, PyObject *object,
+                                 PyObject *iterator)
+{
+    yajl_gen handle = (yajl_gen)(self->_generator);
+    yajl_gen_status status;
+    EncodeFrame *frame;
+
+    if (self->depth >= self->max_depth) {
+        PyErr_Format(PyExc_ValueError, "maximum nesting depth of %u exceeded",
+                     self->max_depth);
+        Py_XDECREF(iterator);
+        return yajl_max_depth_exceeded;
+    }
+    if (self->depth == self->frames_size) {
+        unsigned int size = self->frames_size ? self->frames_size * 2 : 16;
+        EncodeFrame *frames = (EncodeFrame *)(realloc(self->frames, size * sizeof(EncodeFrame)));
+
+        if (!frames) {
+            self->nomem = 1;
+            Py_XDECREF(iterator);
+            return yajl_gen_in_error_state;
+        }
+        self->frames = frames;
+        self->frames_size = size;
+    }
+
+    if ((kind == FRAME_DICT) || (kind == FRAME_ITERATOR_DICT))
+        status = yajl_gen_map_open(handle);
+    else
+        status = yajl_gen_array_open(handle);
+    if (status != yajl_gen_status_ok) {
+        Py_XDECREF(iterator);
+        return status;
+    }
+
+    frame = &self->frames[self->depth++];
+    if ((_internal_stats_enabled) && (self->depth > _internal_stats.encode_max_depth))
+        _internal_stats.encode_max_depth = self->depth;
+    frame->kind = kind;
+    Py_INCREF(object);
+    frame->object = object;
+    frame->iterator = iterator;
+    frame->pos = 0;
+    return yajl_gen_status_ok;
+}
+
+static void PopFrame(_YajlEncoder *self)
+{
+    EncodeFrame *frame = &self->frames[--self->depth];
+
+    Py_DECREF(frame->object);
+    Py_XDECREF(frame->iterator);
+}
+
+/*
+ * Emits the key of the frame's next member, if it's a dict, and sets *child
+ * to a new reference to the next value; NULL once the container is done.
+ */
+static yajl_gen_status NextChild(_YajlEncoder *self, EncodeFrame *frame, PyObject **child)
+{
+    yajl_gen_status status;
+    PyObject *key, *value;
+
+    *child = NULL;
+    switch (frame->kind) {
+        case FRAME_SEQUENCE:
+            if (frame->pos < PySequence_Fast_GET_SIZE(frame->object)) {
+                *child = PySequence_Fast_GET_ITEM(frame->object, frame->pos++);
+                Py_INCREF(*child);
+            }
+            return yajl_gen_status_ok;
+
+        case FRAME_DICT:
+            if (!PyDict_Next(frame->object, &frame->pos, &key, &value))
+                return yajl_gen_status_ok;
+            status = GenerateKey(self, key);
+            if (status == yajl_gen_status_ok) {
+                Py_INCREF(value);
+                *child = value;
+            }
+            return status;
+
+        case FRAME_ITERATOR:
+            *child = PyIter_Next(frame->iterator);
+            if ((!*child) && PyErr_Occurred())
+                return yajl_gen_in_error_state;
+            return yajl_gen_status_ok;
+
+        default:
+            key = PyIter_Next(frame->iterator);
+            if (!key)
+                return PyErr_Occurred() ? yajl_gen_in_error_state : yajl_gen_status_ok;
+            status = GenerateKey(self, key);
+            if (status == yajl_gen_status_ok) {
+                *child = PyDict_GetItem(frame->object, key);
+                if (*child) {
+                    Py_INCREF(*child);
+                } else {
+                    PyErr_SetObject(PyExc_KeyError, key);
+                    status = yajl_gen_in_error_state;
+                }
+            }
+            Py_DECREF(key);
+            return status;
+    }
+}
+
+/*
+ * Generates a scalar, or opens a frame for a container
+ */
+static yajl_gen_status ProcessValue(_YajlEncoder *self, PyObject *object)
 {
     yajl_gen handle = (yajl_gen)(self->_generator);
-    yajl_gen_status status = yajl_gen_in_error_state;
-    PyObject *iterator, *item;
+    PyTypeObject *type = Py_TYPE(object);
+    PyObject *iterator;
+
+    /*
+     * Dispatch on the exact type first; only subclasses and the rarer types
+     * fall through to the subclass-aware checks below
+     */
+    if (type == &PyString_Type) {
+        return GenerateString(self,
+                              (const unsigned char *)(PyString_AS_STRING(object)),
+                              (size_t)(PyString_GET_SIZE(object)));
+    }
+    if (type == &PyInt_Type) {
+        return GenerateInteger(handle, PyInt_AS_LONG(object));
+    }
+    if (type == &PyDict_Type) {
+        int done;
+        yajl_gen_status status = GenerateFlatDict(self, object, &done);
+
+        if ((done) || (status != yajl_gen_status_ok))
+            return status;
+        return OpenFrame(self, FRAME_DICT, object, NULL);
+    }
+    if ((type == &PyList_Type) || (type == &PyTuple_Type)) {
+        return OpenFrame(self, FRAME_SEQUENCE, object, NULL);
+    }
+    if (type == &PyFloat_Type) {
+        return GenerateDouble(handle, PyFloat_AS_DOUBLE(object));
+    }
 
     if (object == Py_None) {
         return yajl_gen_null(handle);
@@ -55,145 +939,193 @@ static yajl_gen_status ProcessObject(_YajlEncoder *self, PyObject *object)
     if (PyUnicode_Check(object)) {
         /* Oil doesn't have unicode objects, so this should never happen */
         PyErr_SetString(PyExc_TypeError, "Unexpected unicode object");
-        goto exit;
+        return yajl_gen_in_error_state;
     }
 #endif
     if (PyString_Check(object)) {
-        const unsigned char *buffer = NULL;
-        Py_ssize_t length;
-        PyString_AsStringAndSize(object, (char **)&buffer, &length);
-        return yajl_gen_string(handle, buffer, (unsigned int)(length));
+        return GenerateString(self,
+                              (const unsigned char *)(PyString_AS_STRING(object)),
+                              (size_t)(PyString_GET_SIZE(object)));
     }
     if (PyInt_Check(object)) {
         long number = PyInt_AsLong(object);
         if ( (number == -1) && (PyErr_Occurred()) ) {
             return yajl_gen_in_error_state;
         }
-        return yajl_gen_integer(handle, number);
+        return GenerateInteger(handle, number);
     }
     if (PyLong_Check(object)) {
-        long long number = PyLong_AsLongLong(object);
-        char *buffer = NULL;
-
-        if ( (number == -1) && (PyErr_Occurred()) ) {
-            return yajl_gen_in_error_state;;
-        }
-
-        /*
-         * Nifty trick for getting the buffer length of a long long, going
-         * to convert this long long into a buffer to be handled by
-         * yajl_gen_number()
-         */
-        unsigned int length = (unsigned int)(snprintf(NULL, 0, "%lld", number)) + 1;
-        buffer = (char *)(malloc(length));
-        snprintf(buffer, length, "%lld", number);
-        return yajl_gen_number(handle, buffer, length - 1);
+        return GenerateLong(handle, object);
     }
     if (PyFloat_Check(object)) {
-        return yajl_gen_double(handle, PyFloat_AsDouble(object));
+        return GenerateDouble(handle, PyFloat_AS_DOUBLE(object));
     }
     if (PyList_Check(object)||PyGen_Check(object)||PyTuple_Check(object)) {
-        /*
-         * Recurse and handle the list
-         */
         iterator = PyObject_GetIter(object);
         if (iterator == NULL)
-            goto exit;
-        status = yajl_gen_array_open(handle);
-        if (status == yajl_max_depth_exceeded) {
-            Py_XDECREF(iterator);
-            goto exit;
-        }
-        while ((item = PyIter_Next(iterator))) {
-            status = ProcessObject(self, item);
-            Py_XDECREF(item);
-        }
-        Py_XDECREF(iterator);
-        yajl_gen_status close_status = yajl_gen_array_close(handle);
-        if (status == yajl_gen_in_error_state)
-            return status;
-        return close_status;
+            return yajl_gen_in_error_state;
+        return OpenFrame(self, FRAME_ITERATOR, object, iterator);
     }
     if (PyDict_Check(object)) {
-        PyObject *key, *value;
-
-        status = yajl_gen_map_open(handle);
-        if (status == yajl_max_depth_exceeded) goto exit;
-
         /* Oil patch: use PyObject_GetIter instead of PyDict_Next to respect
          * __iter__ in OrderedDict.  This is also more consistent: the 'list'
          * case above already uses PyIter_Next!
          * */
         iterator = PyObject_GetIter(object);
         if (iterator == NULL)
-            goto exit;
-        while (key = PyIter_Next(iterator)) {
-            PyObject *newKey = key;
-
-            if (!PyString_Check(key)) {
-              PyErr_SetString(PyExc_TypeError,
-                  "JSON object keys must be strings");
-              goto exit;
-            }
+            return yajl_gen_in_error_state;
+        return OpenFrame(self, FRAME_ITERATOR_DICT, object, iterator);
+    }
 
-            status = ProcessObject(self, newKey);
-            /* Oil note: This seems like it's never executed? */
-            if (key != newKey) {
-                Py_XDECREF(newKey);
-            }
-            if (status == yajl_gen_in_error_state) return status;
-            if (status == yajl_max_depth_exceeded) goto exit;
+    PyErr_Format(PyExc_TypeError,
+        "Can't serialize type %.200s to JSON", object->ob_type->tp_name);
+    return yajl_gen_in_error_state;
+}
 
-            value = PyDict_GetItem(object, key);
-            status = ProcessObject(self, value);
-            /* Py_XDECREF(value); */
+/*
+ * Encodes `object` and everything under it, stopping at the first failure.
+ * The buffered output is passed on to the stream between values.
+ */
+static yajl_gen_status ProcessObject(_YajlEncoder *self, PyObject *object)
+{
+    yajl_gen handle = (yajl_gen)(self->_generator);
+    yajl_gen_status status;
+    EncodeFrame *frame;
+    PyObject *child;
+
+    status = ProcessValue(self, object);
+
+    while ((status == yajl_gen_status_ok) && (self->depth > 0)) {
+        frame = &self->frames[self->depth - 1];
+        status = NextChild(self, frame, &child);
+        if (status != yajl_gen_status_ok)
+            break;
 
-            if (status == yajl_gen_in_error_state) return status;
-            if (status == yajl_max_depth_exceeded) goto exit;
+        if (child) {
+            status = ProcessValue(self, child);
+            Py_DECREF(child);
+        } else {
+            if ((frame->kind == FRAME_DICT) || (frame->kind == FRAME_ITERATOR_DICT))
+                status = yajl_gen_map_close(handle);
+            else
+                status = yajl_gen_array_close(handle);
+            PopFrame(self);
         }
-        return yajl_gen_map_close(handle);
-    }
-    else {
-        PyErr_Format(PyExc_TypeError,
-            "Can't serialize type %.200s to JSON", object->ob_type->tp_name);
-        goto exit;
+        if ((status == yajl_gen_status_ok) && (MaybeFlushEncoder(self) != success))
+            status = yajl_gen_in_error_state;
     }
 
-    exit:
-        return yajl_gen_in_error_state;
+    while (self->depth > 0)
+        PopFrame(self);
+    return status;
 }
 
+/* Describes a failure reported by yajl rather than by one of our checks */
+static const char *GeneratorError(yajl_gen_status status)
+{
+    switch (status) {
+        case yajl_gen_keys_must_be_strings:
+            return "JSON object keys must be strings";
+        case yajl_max_depth_exceeded:
+            return "maximum nesting depth exceeded";
+        case yajl_gen_generation_complete:
+            return "generator already produced a complete value";
+        default:
+            return "JSON generation failed";
+    }
+}
+
+/*
+ * Encodes `obj` with the encoder's generator, allocating it on first use;
+ * `spaces` only takes effect then.  The generator and the output buffer are
+ * reset afterwards rather than freed, so a long-lived encoder reuses them.
+ *
+ * Returns the JSON string, or None once everything has been written when
+ * the encoder has a stream.
+ */
 PyObject *_internal_encode(_YajlEncoder *self, PyObject *obj, char* spaces)
 {
-    yajl_gen generator = NULL;
+    yajl_gen generator = (yajl_gen)(self->_generator);
     yajl_gen_status status;
+    PyObject *result = NULL;
+    unsigned PY_LONG_LONG start = _internal_stats_enabled ? _internal_stats_clock() : 0;
 
-    generator = yajl_gen_alloc(NULL);
-    if (spaces) {
-        yajl_gen_config(generator, yajl_gen_beautify, 1);
-        yajl_gen_config(generator, yajl_gen_indent_string, spaces);
+    if (!generator) {
+        generator = yajl_gen_alloc(&self->arena.funcs);
+        if (!generator)
+            return PyErr_NoMemory();
+        yajl_gen_config(generator, yajl_gen_print_callback, EncoderPrint, (void *)(self));
+        if (spaces) {
+            self->beautify = 1;
+            yajl_gen_config(generator, yajl_gen_beautify, 1);
+            yajl_gen_config(generator, yajl_gen_indent_string, spaces);
+        }
+        self->_generator = generator;
     }
 
-    self->_generator = generator;
+    if (!FindEscape)
+        FindEscape = PickEscapeScanner();
 
     status = ProcessObject(self, obj);
 
-    // Oil patch: usage copied from json_reformat.c
-    const unsigned char * buf;
-    size_t len;
-    yajl_gen_get_buf(generator, &buf, &len);
-    PyObject* result = PyString_FromStringAndSize(buf, len);
+    if (self->nomem) {
+        PyErr_NoMemory();
+    } else if (status != yajl_gen_status_ok) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, GeneratorError(status));
+    } else if (self->stream) {
+        if (FlushEncoder(self) == success) {
+            Py_INCREF(Py_None);
+            result = Py_None;
+        }
+    } else {
+        result = PyString_FromStringAndSize(self->buffer, self->used);
+        if ((result) && (_internal_stats_enabled))
+            _internal_stats.encode_bytes += self->used;
+    }
+    if ((start) && (result) && (_internal_stats_enabled)) {
+        _internal_stats.encode_documents++;
+        _internal_stats.encode_ns += _internal_stats_clock() - start;
+    }
 
-    //fwrite(buf, 1, len, stdout);
-    yajl_gen_clear(generator);
+    self->used = 0;
+    self->nomem = 0;
+    yajl_gen_reset(generator, NULL);
+    return result;
+}
 
-    yajl_gen_free(generator);
-    self->_generator = NULL;
+void _internal_encode_free(_YajlEncoder *self)
+{
+    unsigned int i;
 
-    if (status != yajl_gen_status_ok) {
-        assert(PyErr_Occurred());
-        return NULL;
+    if (self->keycache) {
+        for (i = 0; i < PY_YAJL_ENCODE_KEYCACHE_SIZE; i++) {
+            Py_XDECREF(self->keycache[i].key);
+            free(self->keycache[i].text);
+        }
+        free(self->keycache);
+        self->keycache = NULL;
     }
-
-    return result;
+    self->uncached_keys = 0;
+    if (self->shapes) {
+        for (i = 0; i < PY_YAJL_SHAPECACHE_SIZE; i++) {
+            if (self->shapes[i])
+                FreeShape(self->shapes[i]);
+        }
+        free(self->shapes);
+        self->shapes = NULL;
+    }
+    free(self->frames);
+    self->frames = NULL;
+    self->frames_size = 0;
+    if (self->_generator) {
+        yajl_gen_free((yajl_gen)(self->_generator));
+        self->_generator = NULL;
+        py_yajl_arena_reset(&self->arena);
+    }
+    if (self->buffer) {
+        free(self->buffer);
+        self->buffer = NULL;
+    }
+    self->used = self->size = 0;
 }
@@ -0,0 +1,555 @@
+/*
+ * Copyright 2009, R. Tyler Ballance <tyler@monkeypox.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <string.h>
+
+#include <yajl/yajl_parse.h>
+
+#include "py_yajl.h"
+
+/*
+ * yajl.iterparse() and yajl.items(): the stream is parsed a chunk at a time
+ * and the events (or, for items(), the finished values) produced by each
+ * chunk are queued in a list, which the iterator then hands out before
+ * reading the next chunk.  Memory use is bounded by the chunk size and the
+ * nesting depth, not the document size.
+ *
+ * Prefixes follow ijson: keys joined with '.', and "item" for the elements
+ * of an array, so the elements of a top-level array have the prefix "item".
+ */
+
+typedef struct {
+    PyObject *prefix;           /* prefix of the container itself */
+    PyObject *child;            /* prefix of its next value */
+    int list;
+} EventFrame;
+
+typedef struct {
+    PyObject_HEAD
+    _YajlDecoder decoder;       /* builds the values items() returns */
+    PyObject *stream;
+    PyObject *prefix;           /* items(): prefix of the values to build */
+    PyObject *batch;            /* queued events or values */
+    Py_ssize_t index;           /* next entry of batch to hand out */
+    EventFrame *frames;
+    unsigned int depth;
+    unsigned int size;
+    int capturing;
+    int finished;
+    PyObject *error_type;       /* raised once the batch before it is out */
+    PyObject *error_value;
+    PyObject *error_traceback;
+} EventIteratorObject;
+
+enum {
+    EVENT_NULL,
+    EVENT_BOOLEAN,
+    EVENT_NUMBER,
+    EVENT_STRING,
+    EVENT_MAP_KEY,
+    EVENT_START_MAP,
+    EVENT_END_MAP,
+    EVENT_START_ARRAY,
+    EVENT_END_ARRAY
+};
+
+static const char *event_strings[] = {
+    "null", "boolean", "number", "string", "map_key",
+    "start_map", "end_map", "start_array", "end_array", NULL
+};
+
+static PyObject *event_names[EVENT_END_ARRAY + 1];
+static PyObject *empty_prefix;
+
+#define ITERATOR(ctx) ((EventIteratorObject *)(((_YajlDecoder *)(ctx))->callback_state))
+
+/*
+ * The prefix of a container's children.  For items(), a prefix that can't
+ * lead to the one being looked for becomes None, and so do all the
+ * prefixes below it, so skipped parts of the document cost no strings.
+ */
+static PyObject *JoinPrefix(EventIteratorObject *self, PyObject *parent,
+                            const char *segment, size_t length)
+{
+    Py_ssize_t size;
+    PyObject *prefix;
+    char *p;
+
+    if (parent == Py_None) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    size = PyString_GET_SIZE(parent);
+    if (self->prefix) {
+        Py_ssize_t target = PyString_GET_SIZE(self->prefix);
+        const char *want = PyString_AS_STRING(self->prefix);
+
+        if ((size > 0) && ((size >= target) || (want[size] != '.') ||
+                           (memcmp(want, PyString_AS_STRING(parent), size) != 0))) {
+            Py_INCREF(Py_None);
+            return Py_None;
+        }
+    }
+
+    if (size == 0)
+        return PyString_FromStringAndSize(segment, length);
+
+    prefix = PyString_FromStringAndSize(NULL, size + 1 + length);
+    if (!prefix)
+        return NULL;
+    p = PyString_AS_STRING(prefix);
+    memcpy(p, PyString_AS_STRING(parent), size);
+    p[size] = '.';
+    memcpy(p + size + 1, segment, length);
+    return prefix;
+}
+
+/* Borrowed reference to the prefix of the value about to start */
+static PyObject *ValuePrefix(EventIteratorObject *self)
+{
+    if (self->depth == 0)
+        return empty_prefix;
+    return self->frames[self->depth - 1].child;
+}
+
+static int PrefixMatches(EventIteratorObject *self, PyObject *prefix)
+{
+    return (prefix != Py_None) &&
+        (PyString_GET_SIZE(prefix) == PyString_GET_SIZE(self->prefix)) &&
+        (memcmp(PyString_AS_STRING(prefix), PyString_AS_STRING(self->prefix),
+                PyString_GET_SIZE(prefix)) == 0);
+}
+
+/* Queues an event; steals the reference to value */
+static int QueueEvent(EventIteratorObject *self, PyObject *prefix, int event, PyObject *value)
+{
+    PyObject *tuple;
+    int rc;
+
+    if (!value)
+        return failure;
+    tuple = PyTuple_Pack(3, prefix, event_names[event], value);
+    Py_DECREF(value);
+    if (!tuple)
+        return failure;
+    rc = PyList_Append(self->batch, tuple);
+    Py_DECREF(tuple);
+    return (rc == 0) ? success : failure;
+}
+
+/* Queues the value items() finished building, if there is one */
+static int QueueCaptured(EventIteratorObject *self, int rc)
+{
+    PyObject *value;
+
+    if ((rc != success) || (!self->decoder.root))
+        return rc;
+
+    value = _internal_take_root(&self->decoder);
+    self->capturing = 0;
+    rc = PyList_Append(self->batch, value);
+    Py_DECREF(value);
+    return (rc == 0) ? success : failure;
+}
+
+/*
+ * Every scalar callback starts here.  Returns 1 if the value should be
+ * queued as an event, 0 if it's been handled, or -1 when items() should
+ * build it with the regular callbacks.
+ */
+static int BeginScalar(EventIteratorObject *self)
+{
+    if (self->capturing)
+        return -1;
+    if (!self->prefix)
+        return 1;
+    if (PrefixMatches(self, ValuePrefix(self))) {
+        self->capturing = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static int event_null(void *ctx)
+{
+    EventIteratorObject *self = ITERATOR(ctx);
+
+    switch (BeginScalar(self)) {
+        case -1:
+            return QueueCaptured(self, _internal_decode_callbacks.yajl_null(ctx));
+        case 0:
+            return success;
+    }
+    Py_INCREF(Py_None);
+    return QueueEvent(self, ValuePrefix(self), EVENT_NULL, Py_None);
+}
+
+static int event_bool(void *ctx, int value)
+{
+    EventIteratorObject *self = ITERATOR(ctx);
+
+    switch (BeginScalar(self)) {
+        case -1:
+            return QueueCaptured(self, _internal_decode_callbacks.yajl_boolean(ctx, value));
+        case 0:
+            return success;
+    }
+    return QueueEvent(self, ValuePrefix(self), EVENT_BOOLEAN, PyBool_FromLong((long)(value)));
+}
+
+static int event_number(void *ctx, const char *value, size_t length)
+{
+    EventIteratorObject *self = ITERATOR(ctx);
+
+    switch (BeginScalar(self)) {
+        case -1:
+            return QueueCaptured(self, _internal_decode_callbacks.yajl_number(ctx, value, length));
+        case 0:
+            return success;
+    }
+    return QueueEvent(self, ValuePrefix(self), EVENT_NUMBER, _internal_number(value, length));
+}
+
+static int event_string(void *ctx, const unsigned char *value, size_t length)
+{
+    EventIteratorObject *self = ITERATOR(ctx);
+
+    switch (BeginScalar(self)) {
+        case -1:
+            return QueueCaptured(self, _internal_decode_callbacks.yajl_string(ctx, value, length));
+        case 0:
+            return success;
+    }
+    return QueueEvent(self, ValuePrefix(self), EVENT_STRING,
+                      PyString_FromStringAndSize((const char *)(value), length));
+}
+
+static int event_map_key(void *ctx, const unsigned char *value, size_t length)
+{
+    EventIteratorObject *self = ITERATOR(ctx);
+    EventFrame *frame;
+
+    if (self->capturing)
+        return _internal_decode_callbacks.yajl_map_key(ctx, value, length);
+
+    frame = &self->frames[self->depth - 1];
+    Py_XDECREF(frame->child);
+    frame->child = JoinPrefix(self, frame->prefix, (const char *)(value), length);
+    if (!frame->child)
+        return failure;
+    if (self->prefix)
+        return success;
+    return QueueEvent(self, frame->prefix, EVENT_MAP_KEY,
+                      PyString_FromStringAndSize((const char *)(value), length));
+}
+
+static int StartContainer(void *ctx, int list)
+{
+    EventIteratorObject *self = ITERATOR(ctx);
+    PyObject *prefix;
+    EventFrame *frame;
+
+    if (self->capturing) {
+        return list ? _internal_decode_callbacks.yajl_start_array(ctx) :
+                      _internal_decode_callbacks.yajl_start_map(ctx);
+    }
+
+    prefix = ValuePrefix(self);
+    if ((self->prefix) && (PrefixMatches(self, prefix))) {
+        self->capturing = 1;
+        return list ? _internal_decode_callbacks.yajl_start_array(ctx) :
+                      _internal_decode_callbacks.yajl_start_map(ctx);
+    }
+
+    if (self->depth == self->size) {
+        unsigned int size = self->size ? self->size * 2 : PY_YAJL_PS_INC;
+        EventFrame *frames = (EventFrame *)(realloc(self->frames, size * sizeof(EventFrame)));
+
+        if (!frames) {
+            PyErr_NoMemory();
+            return failure;
+        }
+        self->frames = frames;
+        self->size = size;
+    }
+    frame = &self->frames[self->depth];
+    frame->list = list;
+    frame->prefix = prefix;
+    Py_INCREF(prefix);
+    frame->child = list ? JoinPrefix(self, prefix, "item", 4) : NULL;
+    if ((list) && (!frame->child)) {
+        Py_DECREF(prefix);
+        return failure;
+    }
+    self->depth++;
+
+    if (self->prefix)
+        return success;
+    Py_INCREF(Py_None);
+    return QueueEvent(self, prefix, list ? EVENT_START_ARRAY : EVENT_START_MAP, Py_None);
+}
+
+static int EndContainer(void *ctx, int list)
+{
+    EventIteratorObject *self = ITERATOR(ctx);
+    EventFrame *frame;
+    int rc = success;
+
+    if (self->capturing) {
+        return QueueCaptured(self, list ? _internal_decode_callbacks.yajl_end_array(ctx) :
+                                          _internal_decode_callbacks.yajl_end_map(ctx));
+    }
+
+    frame = &self->frames[--self->depth];
+    if (!self->prefix) {
+        Py_INCREF(Py_None);
+        rc = QueueEvent(self, frame->prefix, list ? EVENT_END_ARRAY : EVENT_END_MAP, Py_None);
+    }
+    Py_DECREF(frame->prefix);
+    Py_XDECREF(frame->child);
+    return rc;
+}
+
+static int event_start_map(void *ctx)
+{
+    return StartContainer(ctx, 0);
+}
+
+static int event_end_map(void *ctx)
+{
+    return EndContainer(ctx, 0);
+}
+
+static int event_start_array(void *ctx)
+{
+    return StartContainer(ctx, 1);
+}
+
+static int event_end_array(void *ctx)
+{
+    return EndContainer(ctx, 1);
+}
+
+static yajl_callbacks event_callbacks = {
+    event_null,
+    event_bool,
+    NULL,
+    NULL,
+    event_number,
+    event_string,
+    event_start_map,
+    event_map_key,
+    event_end_map,
+    event_start_array,
+    event_end_array
+};
+
+static void EventIterator_dealloc(EventIteratorObject *self)
+{
+    while (self->depth > 0) {
+        EventFrame *frame = &self->frames[--self->depth];
+
+        Py_DECREF(frame->prefix);
+        Py_XDECREF(frame->child);
+    }
+    free(self->frames);
+    _internal_decode_free(&self->decoder);
+    Py_XDECREF(self->stream);
+    Py_XDECREF(self->prefix);
+    Py_XDECREF(self->batch);
+    Py_XDECREF(self->error_type);
+    Py_XDECREF(self->error_value);
+    Py_XDECREF(self->error_traceback);
+    PyObject_Del(self);
+}
+
+/*
+ * Reads and parses the next chunk, queueing what it produces; finishes the
+ * parse at the end of the stream
+ */
+static int EventIterator_fill(EventIteratorObject *self)
+{
+    yajl_handle parser = (yajl_handle)(self->decoder._parser);
+    PyObject *chunk;
+    yajl_status yrc;
+
+    chunk = PyObject_CallMethod(self->stream, "read", "i", PY_YAJL_CHUNK_SIZE);
+    if (!chunk)
+        return failure;
+    if (!PyString_Check(chunk)) {
+        Py_DECREF(chunk);
+        PyErr_SetString(PyExc_TypeError, "read() did not return a string");
+        return failure;
+    }
+
+    if (PyString_GET_SIZE(chunk) == 0) {
+        Py_DECREF(chunk);
+        self->finished = 1;
+        yrc = _internal_parse(parser, NULL, 0, 1);
+        if (yrc != yajl_status_ok) {
+            _internal_decode_error(&self->decoder, yrc, NULL, 0);
+            return failure;
+        }
+        if (_internal_stats_enabled)
+            _internal_stats.documents++;
+        return success;
+    }
+
+    yrc = _internal_parse(parser, (const unsigned char *)(PyString_AS_STRING(chunk)),
+                          PyString_GET_SIZE(chunk), 0);
+    if (yrc != yajl_status_ok) {
+        _internal_decode_error(&self->decoder, yrc, PyString_AS_STRING(chunk),
+                               (unsigned int)(PyString_GET_SIZE(chunk)));
+        Py_DECREF(chunk);
+        return failure;
+    }
+    Py_DECREF(chunk);
+    return success;
+}
+
+static PyObject *EventIterator_next(EventIteratorObject *self)
+{
+    PyObject *item;
+
+    while (self->index >= PyList_GET_SIZE(self->batch)) {
+        if (self->error_type) {
+            PyErr_Restore(self->error_type, self->error_value, self->error_traceback);
+            self->error_type = self->error_value = self->error_traceback = NULL;
+        }
+        if (self->finished)
+            return NULL;
+
+        /* everything queued so far has been handed out */
+        if (PyList_SetSlice(self->batch, 0, PyList_GET_SIZE(self->batch), NULL) < 0)
+            return NULL;
+        self->index = 0;
+
+        /* what the chunk queued before the error still comes out */
+        if (EventIterator_fill(self) != success) {
+            PyErr_Fetch(&self->error_type, &self->error_value, &self->error_traceback);
+            self->finished = 1;
+        }
+    }
+
+    item = PyList_GET_ITEM(self->batch, self->index);
+    self->index++;
+    Py_INCREF(item);
+    return item;
+}
+
+static PyTypeObject EventIteratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "yajl.EventIterator",                       /* tp_name */
+    sizeof(EventIteratorObject),                /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)(EventIterator_dealloc),        /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    0,                                          /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc)(EventIterator_next),         /* tp_iternext */
+};
+
+/*
+ * Returns an iterator over the events of the JSON document read from
+ * `stream`, or with a `prefix`, over the values found at that prefix
+ */
+PyObject *_internal_iterparse(PyObject *stream, PyObject *prefix)
+{
+    EventIteratorObject *iter;
+
+    iter = PyObject_New(EventIteratorObject, &EventIteratorType);
+    if (!iter)
+        return NULL;
+
+    _internal_decode_init(&iter->decoder);
+    iter->decoder.callback_state = iter;
+    Py_INCREF(stream);
+    iter->stream = stream;
+    Py_XINCREF(prefix);
+    iter->prefix = prefix;
+    iter->index = 0;
+    iter->frames = NULL;
+    iter->depth = iter->size = 0;
+    iter->capturing = 0;
+    iter->finished = 0;
+    iter->error_type = iter->error_value = iter->error_traceback = NULL;
+
+    iter->batch = PyList_New(0);
+    if (!iter->batch) {
+        Py_DECREF(iter);
+        return NULL;
+    }
+    iter->decoder._parser = yajl_alloc(&event_callbacks, &iter->decoder.arena.funcs,
+                                       (void *)(&iter->decoder));
+    if (!iter->decoder._parser) {
+        Py_DECREF(iter);
+        return PyErr_NoMemory();
+    }
+    return (PyObject *)(iter);
+}
+
+int _internal_events_init(PyObject *module)
+{
+    int i;
+
+    for (i = 0; event_strings[i]; i++) {
+        event_names[i] = PyString_InternFromString(event_strings[i]);
+        if (!event_names[i])
+            return failure;
+    }
+    empty_prefix = PyString_FromString("");
+    if (!empty_prefix)
+        return failure;
+    if (PyType_Ready(&EventIteratorType) < 0)
+        return failure;
+    return success;
+}
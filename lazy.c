@@ -0,0 +1,1144 @@
+/*
+ * Copyright 2009, R. Tyler Ballance <tyler@monkeypox.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <string.h>
+
+#include <yajl/yajl_parse.h>
+
+#include "py_yajl.h"
+
+/*
+ * yajl.loads_lazy() parses into a flat tape instead of into objects.  Each
+ * value is one entry: strings and numbers point at their text, normally in
+ * the source string itself, and containers record how many children they
+ * have and the index just past their last descendant, so skipping over one
+ * is a single step.  The proxies handed out for containers only create the
+ * objects they're asked for.
+ *
+ * Filling in a tape touches no Python objects, so yajl.loads(...,
+ * release_gil=True) builds one with the GIL released and then replays it
+ * through the regular decoder callbacks to create the objects.
+ */
+
+enum {
+    TAPE_NULL,
+    TAPE_TRUE,
+    TAPE_FALSE,
+    TAPE_NUMBER,
+    TAPE_STRING,
+    TAPE_LIST,
+    TAPE_DICT
+};
+
+/* set on strings and numbers whose text was unescaped into the pool */
+#define TAPE_POOLED 0x80
+/* set on a dict while it's replayed, when its next entry is a key */
+#define TAPE_KEY_NEXT 0x40
+
+typedef struct {
+    unsigned int type;
+    unsigned int length;    /* bytes of text, or children of a container */
+    size_t offset;          /* start of the text, or index past a container */
+} TapeEntry;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *source;
+    const char *text;       /* the bytes that were parsed */
+    size_t length;
+    TapeEntry *entries;
+    size_t used;
+    size_t size;
+    char *pool;
+    size_t pool_used;
+    size_t pool_size;
+    int multiple;           /* whitespace-separated values, not one */
+    yajl_status status;     /* outcome of the parse */
+    int nomem;
+    char *message;          /* yajl's description of a parse error */
+    unsigned PY_LONG_LONG parse_ns;     /* for yajl.stats() */
+} TapeObject;
+
+static void Tape_dealloc(TapeObject *self)
+{
+    Py_XDECREF(self->source);
+    free(self->entries);
+    free(self->pool);
+    free(self->message);
+    PyObject_Del(self);
+}
+
+static PyTypeObject TapeType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "yajl.Tape",                                /* tp_name */
+    sizeof(TapeObject),                         /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)(Tape_dealloc),                 /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+};
+
+#define ENTRY_TYPE(entry) ((entry)->type & ~(TAPE_POOLED | TAPE_KEY_NEXT))
+
+static const char *EntryText(TapeObject *tape, TapeEntry *entry)
+{
+    if (entry->type & TAPE_POOLED)
+        return tape->pool + entry->offset;
+    return tape->text + entry->offset;
+}
+
+/* Index of the entry after `index` and all of its descendants */
+static size_t NextEntry(TapeObject *tape, size_t index)
+{
+    TapeEntry *entry = &tape->entries[index];
+
+    switch (ENTRY_TYPE(entry)) {
+        case TAPE_LIST:
+        case TAPE_DICT:
+            return entry->offset;
+        default:
+            return index + 1;
+    }
+}
+
+/*
+ * State kept while yajl fills in the tape: the containers still open, so
+ * their child counts and end indexes can be filled in.  This may run
+ * without the GIL, so running out of memory is only noted on the tape.
+ */
+typedef struct {
+    TapeObject *tape;
+    const char *buffer;
+    size_t buflen;
+    size_t *open;
+    unsigned int depth;
+    unsigned int open_size;
+} TapeBuilder;
+
+static int AppendEntry(TapeBuilder *builder, unsigned int type, unsigned int length, size_t offset)
+{
+    TapeObject *tape = builder->tape;
+    TapeEntry *entry;
+
+    if (tape->used == tape->size) {
+        /*
+         * The first block is sized for the text, at one entry per eight
+         * bytes, so the many small tapes of a batch stay small; so is the
+         * pool below
+         */
+        size_t size = tape->size ? tape->size * 2 : 1024;
+
+        if ((!tape->size) && (builder->buflen / 8 + 16 < size))
+            size = builder->buflen / 8 + 16;
+        TapeEntry *entries = (TapeEntry *)(realloc(tape->entries, size * sizeof(TapeEntry)));
+
+        if (!entries) {
+            tape->nomem = 1;
+            return failure;
+        }
+        tape->entries = entries;
+        tape->size = size;
+    }
+    entry = &tape->entries[tape->used++];
+    entry->type = type;
+    entry->length = length;
+    entry->offset = offset;
+    return success;
+}
+
+/* Appends a value, counting it as a child of the open container */
+static int AppendValue(TapeBuilder *builder, unsigned int type, unsigned int length, size_t offset)
+{
+    if (builder->depth > 0)
+        builder->tape->entries[builder->open[builder->depth - 1]].length++;
+    return AppendEntry(builder, type, length, offset);
+}
+
+/*
+ * Text yajl hands over is normally a span of the source string.  Strings
+ * with escapes are unescaped into yajl's own buffer first; those are copied
+ * into the tape's pool.
+ */
+static int AppendText(TapeBuilder *builder, unsigned int type, int value,
+                      const char *text, unsigned int length)
+{
+    TapeObject *tape = builder->tape;
+
+    if ((text >= builder->buffer) && (text + length <= builder->buffer + builder->buflen)) {
+        size_t offset = text - builder->buffer;
+
+        if (value)
+            return AppendValue(builder, type, length, offset);
+        return AppendEntry(builder, type, length, offset);
+    }
+
+    if (tape->pool_used + length > tape->pool_size) {
+        size_t size = tape->pool_size ? tape->pool_size : 4096;
+        char *pool;
+
+        /* Unescaped text is never longer than the source */
+        if ((!tape->pool_size) && (builder->buflen < size))
+            size = builder->buflen ? builder->buflen : 1;
+
+        while (size < tape->pool_used + length)
+            size *= 2;
+        pool = (char *)(realloc(tape->pool, size));
+        if (!pool) {
+            tape->nomem = 1;
+            return failure;
+        }
+        tape->pool = pool;
+        tape->pool_size = size;
+    }
+    memcpy(tape->pool + tape->pool_used, text, length);
+    tape->pool_used += length;
+
+    type |= TAPE_POOLED;
+    if (value)
+        return AppendValue(builder, type, length, tape->pool_used - length);
+    return AppendEntry(builder, type, length, tape->pool_used - length);
+}
+
+static int OpenEntry(TapeBuilder *builder, unsigned int type)
+{
+    if (builder->depth == builder->open_size) {
+        unsigned int size = builder->open_size ? builder->open_size * 2 : PY_YAJL_PS_INC;
+        size_t *open = (size_t *)(realloc(builder->open, size * sizeof(size_t)));
+
+        if (!open) {
+            builder->tape->nomem = 1;
+            return failure;
+        }
+        builder->open = open;
+        builder->open_size = size;
+    }
+    if (AppendValue(builder, type, 0, 0) != success)
+        return failure;
+    builder->open[builder->depth++] = builder->tape->used - 1;
+    return success;
+}
+
+static int CloseEntry(TapeBuilder *builder)
+{
+    TapeObject *tape = builder->tape;
+
+    tape->entries[builder->open[--builder->depth]].offset = tape->used;
+    return success;
+}
+
+static int tape_null(void *ctx)
+{
+    return AppendValue((TapeBuilder *)(ctx), TAPE_NULL, 0, 0);
+}
+
+static int tape_bool(void *ctx, int value)
+{
+    return AppendValue((TapeBuilder *)(ctx), value ? TAPE_TRUE : TAPE_FALSE, 0, 0);
+}
+
+static int tape_number(void *ctx, const char *value, size_t length)
+{
+    return AppendText((TapeBuilder *)(ctx), TAPE_NUMBER, 1, value, length);
+}
+
+static int tape_string(void *ctx, const unsigned char *value, size_t length)
+{
+    return AppendText((TapeBuilder *)(ctx), TAPE_STRING, 1, (const char *)(value), length);
+}
+
+static int tape_dict_key(void *ctx, const unsigned char *value, size_t length)
+{
+    return AppendText((TapeBuilder *)(ctx), TAPE_STRING, 0, (const char *)(value), length);
+}
+
+static int tape_start_dict(void *ctx)
+{
+    return OpenEntry((TapeBuilder *)(ctx), TAPE_DICT);
+}
+
+static int tape_start_list(void *ctx)
+{
+    return OpenEntry((TapeBuilder *)(ctx), TAPE_LIST);
+}
+
+static int tape_end_container(void *ctx)
+{
+    return CloseEntry((TapeBuilder *)(ctx));
+}
+
+static yajl_callbacks tape_callbacks = {
+    tape_null,
+    tape_bool,
+    NULL,
+    NULL,
+    tape_number,
+    tape_string,
+    tape_start_dict,
+    tape_dict_key,
+    tape_end_container,
+    tape_start_list,
+    tape_end_container
+};
+
+/*
+ * yajl.LazyList and yajl.LazyDict share one layout.  The tape indexes of the
+ * children (of the keys, for a dict) are found on first use, and whatever
+ * has been handed out is kept, so asking again returns the same object.
+ */
+typedef struct {
+    PyObject_HEAD
+    TapeObject *tape;
+    size_t index;
+    Py_ssize_t count;
+    size_t *positions;
+    PyObject **children;
+    PyObject *lookup;       /* dicts: key -> child number */
+} LazyObject;
+
+static PyTypeObject LazyListType;
+static PyTypeObject LazyDictType;
+
+static PyObject *NewLazy(TapeObject *tape, size_t index)
+{
+    TapeEntry *entry = &tape->entries[index];
+    LazyObject *lazy;
+
+    lazy = PyObject_New(LazyObject, (ENTRY_TYPE(entry) == TAPE_DICT) ? &LazyDictType : &LazyListType);
+    if (!lazy)
+        return NULL;
+
+    Py_INCREF(tape);
+    lazy->tape = tape;
+    lazy->index = index;
+    lazy->count = entry->length;
+    lazy->positions = NULL;
+    lazy->children = NULL;
+    lazy->lookup = NULL;
+    return (PyObject *)(lazy);
+}
+
+static void Lazy_dealloc(LazyObject *self)
+{
+    Py_ssize_t i;
+
+    if (self->children) {
+        for (i = 0; i < self->count; i++) {
+            Py_XDECREF(self->children[i]);
+        }
+        free(self->children);
+    }
+    free(self->positions);
+    Py_XDECREF(self->lookup);
+    Py_DECREF(self->tape);
+    PyObject_Del(self);
+}
+
+/* The object for a scalar entry, or a proxy for a container */
+static PyObject *EntryObject(TapeObject *tape, size_t index)
+{
+    TapeEntry *entry = &tape->entries[index];
+
+    switch (ENTRY_TYPE(entry)) {
+        case TAPE_NULL:
+            Py_RETURN_NONE;
+        case TAPE_TRUE:
+            Py_RETURN_TRUE;
+        case TAPE_FALSE:
+            Py_RETURN_FALSE;
+        case TAPE_NUMBER:
+            return _internal_number(EntryText(tape, entry), entry->length);
+        case TAPE_STRING:
+            return PyString_FromStringAndSize(EntryText(tape, entry), entry->length);
+        default:
+            return NewLazy(tape, index);
+    }
+}
+
+/* Builds the complete object graph under an entry, as yajl.loads() would */
+static PyObject *Materialize(TapeObject *tape, size_t index)
+{
+    TapeEntry *entry = &tape->entries[index];
+    PyObject *object, *key, *value;
+    size_t child = index + 1;
+    unsigned int i;
+
+    switch (ENTRY_TYPE(entry)) {
+        case TAPE_LIST:
+            object = PyList_New(entry->length);
+            break;
+        case TAPE_DICT:
+            object = _PyDict_NewPresized(entry->length);
+            break;
+        default:
+            return EntryObject(tape, index);
+    }
+    if (!object)
+        return NULL;
+    if (Py_EnterRecursiveCall(" while materializing a lazy JSON value")) {
+        Py_DECREF(object);
+        return NULL;
+    }
+
+    for (i = 0; i < entry->length; i++) {
+        if (ENTRY_TYPE(entry) == TAPE_LIST) {
+            value = Materialize(tape, child);
+            if (!value)
+                goto error;
+            PyList_SET_ITEM(object, i, value);
+        } else {
+            key = EntryObject(tape, child++);
+            if (!key)
+                goto error;
+            value = Materialize(tape, child);
+            if ((!value) || (PyDict_SetItem(object, key, value) < 0)) {
+                Py_DECREF(key);
+                Py_XDECREF(value);
+                goto error;
+            }
+            Py_DECREF(key);
+            Py_DECREF(value);
+        }
+        child = NextEntry(tape, child);
+    }
+    Py_LeaveRecursiveCall();
+    return object;
+
+error:
+    Py_LeaveRecursiveCall();
+    Py_DECREF(object);
+    return NULL;
+}
+
+static int FindChildren(LazyObject *self)
+{
+    int dict = (Py_TYPE(self) == &LazyDictType);
+    size_t child = self->index + 1;
+    Py_ssize_t i;
+
+    if (self->positions)
+        return success;
+
+    self->positions = (size_t *)(malloc((self->count + 1) * sizeof(size_t)));
+    self->children = (PyObject **)(calloc(self->count + 1, sizeof(PyObject *)));
+    if ((!self->positions) || (!self->children)) {
+        free(self->positions);
+        free(self->children);
+        self->positions = NULL;
+        self->children = NULL;
+        PyErr_NoMemory();
+        return failure;
+    }
+
+    for (i = 0; i < self->count; i++) {
+        self->positions[i] = child;
+        if (dict)
+            child++;
+        child = NextEntry(self->tape, child);
+    }
+    return success;
+}
+
+/* Returns a new reference to child number i, creating it on first use */
+static PyObject *LazyChild(LazyObject *self, Py_ssize_t i)
+{
+    size_t index;
+
+    if (FindChildren(self) != success)
+        return NULL;
+
+    if (!self->children[i]) {
+        index = self->positions[i];
+        if (Py_TYPE(self) == &LazyDictType)
+            index++;
+        self->children[i] = EntryObject(self->tape, index);
+        if (!self->children[i])
+            return NULL;
+    }
+    Py_INCREF(self->children[i]);
+    return self->children[i];
+}
+
+static PyObject *Lazy_materialize(LazyObject *self)
+{
+    return Materialize(self->tape, self->index);
+}
+
+static PyObject *Lazy_repr(LazyObject *self)
+{
+    return PyString_FromFormat("<%s of %zd items>", Py_TYPE(self)->tp_name, self->count);
+}
+
+static Py_ssize_t Lazy_length(LazyObject *self)
+{
+    return self->count;
+}
+
+static PyObject *LazyList_item(LazyObject *self, Py_ssize_t i)
+{
+    if ((i < 0) || (i >= self->count)) {
+        PyErr_SetString(PyExc_IndexError, "list index out of range");
+        return NULL;
+    }
+    return LazyChild(self, i);
+}
+
+static PyObject *LazyList_subscript(LazyObject *self, PyObject *item)
+{
+    Py_ssize_t i, start, stop, step, length;
+    PyObject *result;
+
+    if (PyIndex_Check(item)) {
+        i = PyNumber_AsSsize_t(item, PyExc_IndexError);
+        if ((i == -1) && (PyErr_Occurred()))
+            return NULL;
+        if (i < 0)
+            i += self->count;
+        return LazyList_item(self, i);
+    }
+    if (!PySlice_Check(item)) {
+        PyErr_Format(PyExc_TypeError, "list indices must be integers, not %.200s",
+                     Py_TYPE(item)->tp_name);
+        return NULL;
+    }
+
+    if (PySlice_GetIndicesEx((PySliceObject *)(item), self->count,
+                             &start, &stop, &step, &length) < 0)
+        return NULL;
+    result = PyList_New(length);
+    if (!result)
+        return NULL;
+    for (i = 0; i < length; i++, start += step) {
+        PyObject *child = LazyChild(self, start);
+
+        if (!child) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, i, child);
+    }
+    return result;
+}
+
+static PyObject *LazyList_slice(LazyObject *self, Py_ssize_t low, Py_ssize_t high)
+{
+    PyObject *slice, *result;
+
+    slice = _PySlice_FromIndices(low, high);
+    if (!slice)
+        return NULL;
+    result = LazyList_subscript(self, slice);
+    Py_DECREF(slice);
+    return result;
+}
+
+static PyObject *LazyList_iter(LazyObject *self)
+{
+    return PySeqIter_New((PyObject *)(self));
+}
+
+static PySequenceMethods lazy_list_as_sequence = {
+    (lenfunc)(Lazy_length),                     /* sq_length */
+    0,                                          /* sq_concat */
+    0,                                          /* sq_repeat */
+    (ssizeargfunc)(LazyList_item),              /* sq_item */
+    (ssizessizeargfunc)(LazyList_slice),        /* sq_slice */
+};
+
+static PyMappingMethods lazy_list_as_mapping = {
+    (lenfunc)(Lazy_length),                     /* mp_length */
+    (binaryfunc)(LazyList_subscript),           /* mp_subscript */
+    0,                                          /* mp_ass_subscript */
+};
+
+static struct PyMethodDef lazy_list_methods[] = {
+    {"materialize", (PyCFunction)(Lazy_materialize), METH_NOARGS,
+"materialize()\n\n\
+Returns the whole value as a list, as `yajl.loads()` would"},
+    {NULL}
+};
+
+static PyTypeObject LazyListType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "yajl.LazyList",                            /* tp_name */
+    sizeof(LazyObject),                         /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)(Lazy_dealloc),                 /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    (reprfunc)(Lazy_repr),                      /* tp_repr */
+    0,                                          /* tp_as_number */
+    &lazy_list_as_sequence,                     /* tp_as_sequence */
+    &lazy_list_as_mapping,                      /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+"A JSON array returned by `yajl.loads_lazy()`. Items are decoded when\n\
+they're indexed or iterated over.",              /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    (getiterfunc)(LazyList_iter),               /* tp_iter */
+    0,                                          /* tp_iternext */
+    lazy_list_methods,                          /* tp_methods */
+};
+
+/*
+ * The first lookup in a dict builds a map from each key to its child number;
+ * only the keys are created for it, not the values
+ */
+static int BuildLookup(LazyObject *self)
+{
+    Py_ssize_t i;
+
+    if (self->lookup)
+        return success;
+    if (FindChildren(self) != success)
+        return failure;
+
+    self->lookup = _PyDict_NewPresized(self->count);
+    if (!self->lookup)
+        return failure;
+
+    for (i = 0; i < self->count; i++) {
+        PyObject *key = EntryObject(self->tape, self->positions[i]);
+        PyObject *number = PyInt_FromSsize_t(i);
+        int rc = ((key) && (number)) ? PyDict_SetItem(self->lookup, key, number) : -1;
+
+        Py_XDECREF(key);
+        Py_XDECREF(number);
+        if (rc < 0) {
+            Py_CLEAR(self->lookup);
+            return failure;
+        }
+    }
+    return success;
+}
+
+/* repeated keys count once, as they would in the dict loads() builds */
+static Py_ssize_t LazyDict_length(LazyObject *self)
+{
+    if (BuildLookup(self) != success)
+        return -1;
+    return PyDict_Size(self->lookup);
+}
+
+static PyObject *LazyDict_get_child(LazyObject *self, PyObject *key)
+{
+    PyObject *number;
+
+    if (BuildLookup(self) != success)
+        return NULL;
+    number = PyDict_GetItem(self->lookup, key);
+    if (!number)
+        return NULL;
+    return LazyChild(self, PyInt_AS_LONG(number));
+}
+
+static PyObject *LazyDict_subscript(LazyObject *self, PyObject *key)
+{
+    PyObject *value = LazyDict_get_child(self, key);
+
+    if ((!value) && (!PyErr_Occurred()))
+        PyErr_SetObject(PyExc_KeyError, key);
+    return value;
+}
+
+static int LazyDict_contains(LazyObject *self, PyObject *key)
+{
+    if (BuildLookup(self) != success)
+        return -1;
+    return PyDict_Contains(self->lookup, key);
+}
+
+static PyObject *LazyDict_keys(LazyObject *self)
+{
+    if (BuildLookup(self) != success)
+        return NULL;
+    return PyDict_Keys(self->lookup);
+}
+
+static PyObject *LazyDict_iter(LazyObject *self)
+{
+    PyObject *keys = LazyDict_keys(self);
+    PyObject *iter;
+
+    if (!keys)
+        return NULL;
+    iter = PyObject_GetIter(keys);
+    Py_DECREF(keys);
+    return iter;
+}
+
+/* values() and items() */
+static PyObject *LazyDict_list(LazyObject *self, int items)
+{
+    PyObject *keys, *result;
+    Py_ssize_t i;
+
+    keys = LazyDict_keys(self);
+    if (!keys)
+        return NULL;
+    result = PyList_New(PyList_GET_SIZE(keys));
+    if (!result)
+        goto exit;
+
+    for (i = 0; i < PyList_GET_SIZE(keys); i++) {
+        PyObject *key = PyList_GET_ITEM(keys, i);
+        PyObject *value = LazyDict_subscript(self, key);
+
+        if ((value) && (items)) {
+            PyObject *pair = PyTuple_Pack(2, key, value);
+
+            Py_DECREF(value);
+            value = pair;
+        }
+        if (!value) {
+            Py_CLEAR(result);
+            goto exit;
+        }
+        PyList_SET_ITEM(result, i, value);
+    }
+
+exit:
+    Py_DECREF(keys);
+    return result;
+}
+
+static PyObject *LazyDict_values(LazyObject *self)
+{
+    return LazyDict_list(self, 0);
+}
+
+static PyObject *LazyDict_items(LazyObject *self)
+{
+    return LazyDict_list(self, 1);
+}
+
+static PyObject *LazyDict_get(LazyObject *self, PyObject *args)
+{
+    PyObject *key, *fallback = Py_None;
+    PyObject *value;
+
+    if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &fallback))
+        return NULL;
+
+    value = LazyDict_get_child(self, key);
+    if ((!value) && (!PyErr_Occurred())) {
+        Py_INCREF(fallback);
+        return fallback;
+    }
+    return value;
+}
+
+static PySequenceMethods lazy_dict_as_sequence = {
+    0,                                          /* sq_length */
+    0,                                          /* sq_concat */
+    0,                                          /* sq_repeat */
+    0,                                          /* sq_item */
+    0,                                          /* sq_slice */
+    0,                                          /* sq_ass_item */
+    0,                                          /* sq_ass_slice */
+    (objobjproc)(LazyDict_contains),            /* sq_contains */
+};
+
+static PyMappingMethods lazy_dict_as_mapping = {
+    (lenfunc)(LazyDict_length),                 /* mp_length */
+    (binaryfunc)(LazyDict_subscript),           /* mp_subscript */
+    0,                                          /* mp_ass_subscript */
+};
+
+static struct PyMethodDef lazy_dict_methods[] = {
+    {"get", (PyCFunction)(LazyDict_get), METH_VARARGS,
+"get(key[, default=None])\n\n\
+Returns the value for `key` if present, else `default`"},
+    {"keys", (PyCFunction)(LazyDict_keys), METH_NOARGS,
+"keys()\n\n\
+Returns a list of the keys"},
+    {"values", (PyCFunction)(LazyDict_values), METH_NOARGS,
+"values()\n\n\
+Returns a list of the values, decoding each one"},
+    {"items", (PyCFunction)(LazyDict_items), METH_NOARGS,
+"items()\n\n\
+Returns a list of (key, value) pairs, decoding each value"},
+    {"materialize", (PyCFunction)(Lazy_materialize), METH_NOARGS,
+"materialize()\n\n\
+Returns the whole value as a dict, as `yajl.loads()` would"},
+    {NULL}
+};
+
+static PyTypeObject LazyDictType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "yajl.LazyDict",                            /* tp_name */
+    sizeof(LazyObject),                         /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)(Lazy_dealloc),                 /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    (reprfunc)(Lazy_repr),                      /* tp_repr */
+    0,                                          /* tp_as_number */
+    &lazy_dict_as_sequence,                     /* tp_as_sequence */
+    &lazy_dict_as_mapping,                      /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+"A JSON object returned by `yajl.loads_lazy()`. Values are decoded when\n\
+they're looked up.",                            /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    (getiterfunc)(LazyDict_iter),               /* tp_iter */
+    0,                                          /* tp_iternext */
+    lazy_dict_methods,                          /* tp_methods */
+};
+
+static TapeObject *NewTape(PyObject *source, const char *text)
+{
+    TapeObject *tape = PyObject_New(TapeObject, &TapeType);
+
+    if (!tape)
+        return NULL;
+    Py_XINCREF(source);
+    tape->source = source;
+    tape->text = text;
+    tape->length = 0;
+    tape->entries = NULL;
+    tape->used = tape->size = 0;
+    tape->pool = NULL;
+    tape->pool_used = tape->pool_size = 0;
+    tape->multiple = 0;
+    tape->status = yajl_status_ok;
+    tape->nomem = 0;
+    tape->message = NULL;
+    tape->parse_ns = 0;
+    return tape;
+}
+
+/*
+ * Fills in the tape from its text.  No Python objects are touched, so the
+ * caller may release the GIL around this; the outcome is left on the tape
+ * for RaiseTapeError(), and the time it took for CountTape()
+ */
+static int ParseTape(TapeObject *tape, size_t buflen)
+{
+    TapeBuilder builder;
+    py_yajl_arena arena;
+    yajl_handle parser;
+    const unsigned char *buffer = (const unsigned char *)(tape->text);
+    unsigned PY_LONG_LONG start = _internal_stats_enabled ? _internal_stats_clock() : 0;
+
+    builder.tape = tape;
+    builder.buffer = tape->text;
+    builder.buflen = buflen;
+    builder.open = NULL;
+    builder.depth = builder.open_size = 0;
+
+    py_yajl_arena_init(&arena);
+    parser = yajl_alloc(&tape_callbacks, &arena.funcs, (void *)(&builder));
+    if (!parser) {
+        tape->nomem = 1;
+        goto exit;
+    }
+    if (tape->multiple)
+        yajl_config(parser, yajl_allow_multiple_values, 1);
+
+    tape->status = yajl_parse(parser, buffer, buflen);
+    if (tape->status == yajl_status_ok)
+        tape->status = yajl_complete_parse(parser);
+    if ((tape->status != yajl_status_ok) && (!tape->nomem)) {
+        unsigned char *str = yajl_get_error(parser, 1, buffer, buflen);
+
+        tape->message = str ? strdup((const char *)(str)) : NULL;
+        yajl_free_error(parser, str);
+    }
+    yajl_free(parser);
+
+exit:
+    py_yajl_arena_free(&arena);
+    free(builder.open);
+    tape->length = buflen;
+    if (start)
+        tape->parse_ns = _internal_stats_clock() - start;
+    if (tape->nomem)
+        return failure;
+    return (tape->status == yajl_status_ok) ? success : failure;
+}
+
+/* Adds a parsed tape to yajl.stats(), with the GIL held */
+static void CountTape(TapeObject *tape)
+{
+    if (_internal_stats_enabled) {
+        _internal_stats.bytes += tape->length;
+        _internal_stats.parse_ns += tape->parse_ns;
+    }
+}
+
+/* Sets the exception for a tape that failed to parse or came out empty */
+static void RaiseTapeError(TapeObject *tape)
+{
+    if (tape->nomem) {
+        PyErr_NoMemory();
+    } else if (tape->status != yajl_status_ok) {
+        if (tape->message)
+            fprintf(stderr, "%s", tape->message);
+        PyErr_SetString(PyExc_ValueError, yajl_status_to_string(tape->status));
+    } else {
+        PyErr_SetString(PyExc_ValueError, "premature EOF");
+    }
+}
+
+/*
+ * Hands the tape's values to `callbacks` in document order, as yajl would
+ * have.  The ends of containers aren't entries of their own; they're due
+ * when the walk reaches the index a container recorded as its end.
+ */
+static int ReplayTape(TapeObject *tape, yajl_callbacks *callbacks, void *ctx)
+{
+    size_t *open = NULL;
+    unsigned int depth = 0, open_size = 0;
+    TapeEntry *entry;
+    size_t i;
+    int rc = 1;
+
+    for (i = 0; rc; i++) {
+        while ((depth > 0) && (tape->entries[open[depth - 1]].offset == i) && rc) {
+            entry = &tape->entries[open[--depth]];
+            if (ENTRY_TYPE(entry) == TAPE_DICT)
+                rc = callbacks->yajl_end_map(ctx);
+            else
+                rc = callbacks->yajl_end_array(ctx);
+        }
+        if ((i == tape->used) || (!rc))
+            break;
+
+        entry = &tape->entries[i];
+        if ((depth > 0) && (ENTRY_TYPE(&tape->entries[open[depth - 1]]) == TAPE_DICT)) {
+            if (tape->entries[open[depth - 1]].type & TAPE_KEY_NEXT) {
+                tape->entries[open[depth - 1]].type &= ~TAPE_KEY_NEXT;
+                rc = callbacks->yajl_map_key(ctx, (const unsigned char *)(EntryText(tape, entry)),
+                                             entry->length);
+                continue;
+            }
+            tape->entries[open[depth - 1]].type |= TAPE_KEY_NEXT;
+        }
+
+        switch (ENTRY_TYPE(entry)) {
+            case TAPE_NULL:
+                rc = callbacks->yajl_null(ctx);
+                break;
+            case TAPE_TRUE:
+            case TAPE_FALSE:
+                rc = callbacks->yajl_boolean(ctx, ENTRY_TYPE(entry) == TAPE_TRUE);
+                break;
+            case TAPE_NUMBER:
+                rc = callbacks->yajl_number(ctx, EntryText(tape, entry), entry->length);
+                break;
+            case TAPE_STRING:
+                rc = callbacks->yajl_string(ctx, (const unsigned char *)(EntryText(tape, entry)),
+                                            entry->length);
+                break;
+            default:
+                if (depth == open_size) {
+                    unsigned int size = open_size ? open_size * 2 : PY_YAJL_PS_INC;
+                    size_t *grown = (size_t *)(realloc(open, size * sizeof(size_t)));
+
+                    if (!grown) {
+                        PyErr_NoMemory();
+                        rc = 0;
+                        break;
+                    }
+                    open = grown;
+                    open_size = size;
+                }
+                open[depth++] = i;
+                if (ENTRY_TYPE(entry) == TAPE_DICT) {
+                    entry->type |= TAPE_KEY_NEXT;
+                    rc = callbacks->yajl_start_map(ctx);
+                } else {
+                    rc = callbacks->yajl_start_array(ctx);
+                }
+                break;
+        }
+    }
+    free(open);
+    return rc ? success : failure;
+}
+
+/*
+ * Parses `source`, a string, into a tape and returns its top-level value:
+ * a LazyList or LazyDict for containers, otherwise the value itself
+ */
+PyObject *_internal_decode_lazy(PyObject *source)
+{
+    TapeObject *tape;
+    PyObject *result = NULL;
+    int rc;
+
+    tape = NewTape(source, PyString_AS_STRING(source));
+    if (!tape)
+        return NULL;
+
+    rc = ParseTape(tape, PyString_GET_SIZE(source));
+    CountTape(tape);
+    if ((rc != success) || (tape->used == 0))
+        RaiseTapeError(tape);
+    else
+        result = EntryObject(tape, 0);
+
+    Py_DECREF(tape);
+    return result;
+}
+
+/*
+ * Tapes for callers that parse many documents at once, each on whichever
+ * thread is free: _internal_tape_new() and _internal_tape_decode() need
+ * the GIL, _internal_tape_parse() doesn't.  `buffer` must stay untouched
+ * until the tape is decoded.  A `multiple` tape holds any number of
+ * whitespace-separated values.
+ */
+PyObject *_internal_tape_new(const char *buffer, int multiple)
+{
+    TapeObject *tape = NewTape(NULL, buffer);
+
+    if (tape)
+        tape->multiple = multiple;
+    return (PyObject *)(tape);
+}
+
+int _internal_tape_parse(PyObject *tape, size_t buflen)
+{
+    return ParseTape((TapeObject *)(tape), buflen);
+}
+
+/*
+ * Raises the tape's parse error, or replays it through the decoder's
+ * callbacks, so the result (key cache and all) is what _internal_decode
+ * would give.
+ *
+ * The values of a `multiple` tape go on self->values, which the caller sets
+ * up, and None is returned.  Those before a parse error are still added
+ * there before it's raised; the container the error was in never closes,
+ * since its end was never recorded.
+ */
+PyObject *_internal_tape_decode(_YajlDecoder *self, PyObject *object)
+{
+    TapeObject *tape = (TapeObject *)(object);
+    int failed = (tape->nomem) || (tape->status != yajl_status_ok);
+    PyObject *result;
+
+    CountTape(tape);
+    if ((!tape->multiple) && (failed || (tape->used == 0))) {
+        RaiseTapeError(tape);
+        return NULL;
+    }
+
+    _internal_decode_reset(self);
+    if (ReplayTape(tape, &_internal_decode_callbacks, (void *)(self)) != success) {
+        _internal_decode_reset(self);
+        return NULL;
+    }
+    if (failed) {
+        _internal_decode_reset(self);
+        RaiseTapeError(tape);
+        return NULL;
+    }
+    if (tape->multiple)
+        Py_RETURN_NONE;
+    result = self->root;
+    self->root = NULL;
+    return result;
+}
+
+/*
+ * yajl.loads(string, release_gil=True): the parse into a tape runs with the
+ * GIL released, and only the replay that creates the objects holds it
+ */
+PyObject *_internal_decode_tape(_YajlDecoder *self, const char *buffer, size_t buflen)
+{
+    TapeObject *tape;
+    PyObject *result;
+
+    tape = NewTape(NULL, buffer);
+    if (!tape)
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    ParseTape(tape, buflen);
+    Py_END_ALLOW_THREADS
+
+    result = _internal_tape_decode(self, (PyObject *)(tape));
+    Py_DECREF(tape);
+    return result;
+}
+
+int _internal_lazy_init(PyObject *module)
+{
+    if (PyType_Ready(&TapeType) < 0)
+        return failure;
+    if (PyType_Ready(&LazyListType) < 0)
+        return failure;
+    if (PyType_Ready(&LazyDictType) < 0)
+        return failure;
+    Py_INCREF(&LazyListType);
+    PyModule_AddObject(module, "LazyList", (PyObject *)(&LazyListType));
+    Py_INCREF(&LazyDictType);
+    PyModule_AddObject(module, "LazyDict", (PyObject *)(&LazyDictType));
+    return success;
+}
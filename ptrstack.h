@@ -67,9 +67,10 @@ typedef struct py_yajl_bytestack_t
 
 #define py_yajl_ps_length(ops) ((ops).used)
 
+/* grows geometrically, starting at PY_YAJL_PS_INC entries */
 #define py_yajl_ps_push(ops, pointer) {                       \
     if (((ops).size - (ops).used) == 0) {               \
-        (ops).size += PY_YAJL_PS_INC;                      \
+        (ops).size = (ops).size ? (ops).size * 2 : PY_YAJL_PS_INC; \
         (ops).stack = realloc((void *) (ops).stack, sizeof(PyObject *) * (ops).size); \
     }                                                   \
     (ops).stack[((ops).used)++] = (pointer);               \
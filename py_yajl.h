@@ -34,23 +34,190 @@
 #define _PY_YAJL_H_
 
 #include <Python.h>
+#include <yajl/yajl_parse.h>
 #include <yajl/yajl_gen.h>
 #include "ptrstack.h"
+#include "arena.h"
+
+/*
+ * Dict keys (and short string values) are looked up in a small direct-mapped
+ * cache keyed by their raw bytes, so repeated keys share one string object
+ * whose hash has already been computed.  The size must be a power of two.
+ */
+#define PY_YAJL_KEYCACHE_SIZE 512
+#define PY_YAJL_KEYCACHE_MAXKEY 64
+#define PY_YAJL_KEYCACHE_MAXVALUE 16
+
+/*
+ * Size of the chunks yajl.load() and yajl.iterparse() read from their
+ * stream, and the default size of the chunks yajl.dump() writes; only about
+ * one chunk (plus any token split across chunks) is held in memory at a time.
+ */
+#define PY_YAJL_CHUNK_SIZE 65536
+
+/*
+ * The deepest nesting the encoder accepts, and its default limit; yajl's
+ * generator can't keep track of any more open containers than this
+ */
+#define PY_YAJL_MAX_DEPTH (YAJL_MAX_DEPTH - 1)
+
+/*
+ * The encoder keeps the escaped, quoted text of recently written dict keys
+ * in a direct-mapped cache of the same kind, and the key prefixes of the
+ * last few dict shapes (the same keys in the same order) it has seen; a
+ * compact dict of up to PY_YAJL_SHAPE_MAXKEYS scalars with a known shape
+ * is written with one memcpy per key.  Both sizes must be powers of two.
+ * The cache is only set up once an encoder has written
+ * PY_YAJL_ENCODE_KEYCACHE_AFTER keys, so small one-off dumps skip it.
+ */
+#define PY_YAJL_ENCODE_KEYCACHE_SIZE 256
+#define PY_YAJL_ENCODE_KEYCACHE_AFTER 64
+#define PY_YAJL_SHAPECACHE_SIZE 16
+#define PY_YAJL_SHAPE_MAXKEYS 32
 
 typedef struct {
-    py_yajl_bytestack elements;
-    py_yajl_bytestack keys;
+    py_yajl_bytestack elements;     /* children of the open containers */
+    py_yajl_bytestack keys;         /* keys of the open dicts' children */
+    unsigned int *frames;   /* where each open container's children start */
+    unsigned int depth;
+    unsigned int frames_size;
     PyObject *root;
+    size_t root_end;        /* offset just past root in the current chunk */
+    PyObject **keycache;
+    PyObject *values;       /* completed values in multiple values mode */
+    void *_parser;
+    void *callback_state;   /* used by the path and event callbacks */
+    py_yajl_arena arena;    /* backs the parser's allocations */
+    int numeric_arrays;     /* lists of all ints or all floats become arrays */
+    union _py_yajl_number *numbers;     /* the innermost open list's items */
+    unsigned int numbers_used;
+    unsigned int numbers_size;
+    unsigned int numbers_depth;         /* that list's depth, 0 if none */
+    int numbers_kind;
 } _YajlDecoder;
 
+/*
+ * The generator prints into the encoder's own buffer.  When `stream` is set
+ * (yajl.dump()), the buffer is written out whenever it passes `chunk_size`.
+ */
 typedef struct {
     void *_generator;
+    char *buffer;
+    size_t used;
+    size_t size;
+    int nomem;
+    PyObject *stream;
+    size_t chunk_size;
+    struct _py_yajl_encode_frame *frames;   /* the open containers */
+    unsigned int depth;
+    unsigned int frames_size;
+    unsigned int max_depth;
+    int beautify;
+    struct _py_yajl_encoded_key *keycache;
+    unsigned int uncached_keys;
+    struct _py_yajl_dict_shape **shapes;
+    py_yajl_arena arena;    /* backs the generator's allocations */
 } _YajlEncoder;
 
 enum { failure, success };
 
+/*
+ * Counters behind yajl.stats().  They're only kept while
+ * yajl.enable_stats() is on, which costs a test of
+ * _internal_stats_enabled per value when it's off, and are only updated
+ * with the GIL held.  Times are in nanoseconds; parse time excludes the
+ * time spent in the callbacks, which counts as building.
+ */
+typedef struct {
+    unsigned PY_LONG_LONG documents;
+    unsigned PY_LONG_LONG bytes;
+    unsigned PY_LONG_LONG nulls;
+    unsigned PY_LONG_LONG booleans;
+    unsigned PY_LONG_LONG integers;
+    unsigned PY_LONG_LONG floats;
+    unsigned PY_LONG_LONG strings;
+    unsigned PY_LONG_LONG keys;
+    unsigned PY_LONG_LONG lists;
+    unsigned PY_LONG_LONG dicts;
+    unsigned int max_depth;
+    unsigned int elements_high_water;   /* of the decoder's bytestacks */
+    unsigned int keys_high_water;
+    unsigned PY_LONG_LONG parse_ns;
+    unsigned PY_LONG_LONG build_ns;
+
+    unsigned PY_LONG_LONG encode_documents;
+    unsigned PY_LONG_LONG encode_bytes;
+    unsigned PY_LONG_LONG encode_buffer_grows;
+    unsigned int encode_max_depth;
+    unsigned PY_LONG_LONG encode_ns;
+} py_yajl_stats;
+
+extern int _internal_stats_enabled;
+extern py_yajl_stats _internal_stats;
+
+unsigned PY_LONG_LONG _internal_stats_clock(void);
+
+/* the callbacks that build objects, for reuse by other callback sets */
+extern yajl_callbacks _internal_decode_callbacks;
+
+void _internal_clear_cache(_YajlDecoder *self);
+
+PyObject *_internal_take_root(_YajlDecoder *self);
+
+int _internal_is_blank(const char *buffer, unsigned int buflen);
+
+yajl_status _internal_parse(yajl_handle parser, const unsigned char *buffer, size_t buflen,
+                            int complete);
+
+void _internal_decode_init(_YajlDecoder *self);
+
+void _internal_decode_free(_YajlDecoder *self);
+
+void _internal_decode_reset(_YajlDecoder *self);
+
+void _internal_decode_error(_YajlDecoder *self, yajl_status yrc, char *buffer, unsigned int buflen);
+
+int _internal_decode_feed(_YajlDecoder *self, char *buffer, unsigned int buflen);
+
+int _internal_decode_complete(_YajlDecoder *self);
+
+PyObject *_internal_decode_close(_YajlDecoder *self);
+
 PyObject *_internal_decode(_YajlDecoder *self, char *buffer, unsigned int buflen);
 
+PyObject *_internal_decode_paths(_YajlDecoder *self, char *buffer, unsigned int buflen,
+                                 PyObject *paths);
+
+PyObject *_internal_number(const char *value, unsigned int length);
+
+PyObject *_internal_decode_lazy(PyObject *source);
+PyObject *_internal_decode_tape(_YajlDecoder *self, const char *buffer, size_t buflen);
+PyObject *_internal_tape_new(const char *buffer, int multiple);
+int _internal_tape_parse(PyObject *tape, size_t buflen);
+PyObject *_internal_tape_decode(_YajlDecoder *self, PyObject *tape);
+
+int _internal_lazy_init(PyObject *module);
+
+int _internal_get_input(PyObject *object, Py_buffer *view);
+
+int _internal_get_stable_input(PyObject *object, Py_buffer *view);
+
+PyObject *_internal_loads_many(PyObject *sequence, int threads);
+
+PyObject *_internal_load_ndjson(const char *path, int threads, Py_ssize_t window);
+
+int _internal_batch_init(PyObject *module);
+
+PyObject *_internal_compile_schema(PyObject *fields, PyObject *factory, PyObject *extra);
+
+int _internal_schema_init(PyObject *module);
+
+PyObject *_internal_iterparse(PyObject *stream, PyObject *prefix);
+
+int _internal_events_init(PyObject *module);
+
 PyObject *_internal_encode(_YajlEncoder *self, PyObject *obj, char * spaces);
 
+void _internal_encode_free(_YajlEncoder *self);
+
 #endif
@@ -0,0 +1,976 @@
+/*
+ * Copyright 2009, R. Tyler Ballance <tyler@monkeypox.org>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <Python.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "py_yajl.h"
+
+/*
+ * yajl.compile_schema() turns a list of fields into a Schema whose loads()
+ * decodes JSON objects straight into tuples, namedtuples or instances of a
+ * user class.  Keys are matched to their field's slot as they're parsed,
+ * so no dict is built for the record, and each value is checked against
+ * its field's type as soon as it's seen.
+ */
+
+enum {
+    FIELD_ANY,      /* object: whatever yajl.loads() would build */
+    FIELD_STR,
+    FIELD_INT,
+    FIELD_FLOAT,
+    FIELD_BOOL,
+    FIELD_RECORD,   /* a nested Schema */
+    FIELD_LIST      /* [type] */
+};
+
+typedef struct _py_yajl_field_type {
+    int kind;
+    PyObject *record;                       /* the Schema of a FIELD_RECORD */
+    struct _py_yajl_field_type *item;       /* the item type of a FIELD_LIST */
+} FieldType;
+
+typedef struct {
+    PyObject_HEAD
+    Py_ssize_t count;       /* fields, not counting `extra` */
+    PyObject **names;
+    FieldType *types;
+    PyObject **defaults;    /* NULL where the field is required */
+    PyObject *factory;
+    int fast_tuple;         /* factory is a namedtuple class */
+    PyObject *extra;        /* the name of the slot for unknown keys */
+    int busy;               /* `decoder` is in use further up the stack */
+    _YajlDecoder decoder;   /* kept between calls for its string cache */
+} SchemaObject;
+
+static PyTypeObject SchemaType;
+
+#define SCHEMA(o) ((SchemaObject *)(o))
+
+/* What a record frame expects next, when it isn't a field's value */
+enum {
+    SLOT_KEY = -1,          /* a key */
+    SLOT_SKIP = -2,         /* the value of an unknown key, to be skipped */
+    SLOT_EXTRA = -3         /* the value of an unknown key, for `extra` */
+};
+
+typedef struct {
+    SchemaObject *schema;   /* NULL for a list frame */
+    PyObject **values;      /* the record's slots so far */
+    Py_ssize_t capacity;    /* of `values`, kept when the frame is popped */
+    Py_ssize_t slot;        /* the field whose value comes next, or SLOT_* */
+    Py_ssize_t next;        /* where the next key is looked for first */
+    PyObject *extra;        /* the record's unknown keys, if kept */
+    PyObject *key;          /* the unknown key whose value comes next */
+    const FieldType *item;  /* the item type of a list frame */
+    PyObject *list;
+} SchemaFrame;
+
+typedef struct {
+    SchemaObject *root;
+    SchemaFrame *frames;
+    unsigned int depth;
+    unsigned int size;
+    unsigned int skip;      /* nesting inside a skipped value */
+    int capturing;          /* the decoder is building an `object` value */
+    FieldType record;       /* the items of a top-level array */
+    PyObject *result;
+} SchemaParse;
+
+static const char *kind_names[] = {
+    "object", "string", "int", "float", "bool", "object", "array"
+};
+
+static void FreeType(FieldType *type)
+{
+    if (type->kind == FIELD_RECORD) {
+        Py_DECREF(type->record);
+    } else if (type->kind == FIELD_LIST) {
+        FreeType(type->item);
+        free(type->item);
+    }
+}
+
+/*
+ * Fills in `type` from a field's type spec: str, int, long, float, bool,
+ * object, a Schema or a one-item list of any of these
+ */
+static int ParseType(PyObject *spec, FieldType *type)
+{
+    memset(type, 0, sizeof(FieldType));
+
+    if (spec == (PyObject *)(&PyString_Type)) {
+        type->kind = FIELD_STR;
+    } else if ((spec == (PyObject *)(&PyInt_Type)) || (spec == (PyObject *)(&PyLong_Type))) {
+        type->kind = FIELD_INT;
+    } else if (spec == (PyObject *)(&PyFloat_Type)) {
+        type->kind = FIELD_FLOAT;
+    } else if (spec == (PyObject *)(&PyBool_Type)) {
+        type->kind = FIELD_BOOL;
+    } else if (spec == (PyObject *)(&PyBaseObject_Type)) {
+        type->kind = FIELD_ANY;
+    } else if (PyObject_TypeCheck(spec, &SchemaType)) {
+        type->kind = FIELD_RECORD;
+        Py_INCREF(spec);
+        type->record = spec;
+    } else if (PyList_Check(spec) && (PyList_GET_SIZE(spec) == 1)) {
+        type->item = (FieldType *)(malloc(sizeof(FieldType)));
+        if (!type->item) {
+            PyErr_NoMemory();
+            return failure;
+        }
+        if (ParseType(PyList_GET_ITEM(spec, 0), type->item) != success) {
+            free(type->item);
+            type->item = NULL;
+            return failure;
+        }
+        type->kind = FIELD_LIST;
+    } else {
+        PyObject *repr = PyObject_Repr(spec);
+
+        if (repr) {
+            PyErr_Format(PyExc_TypeError, "unsupported field type %.200s",
+                         PyString_AS_STRING(repr));
+            Py_DECREF(repr);
+        }
+        return failure;
+    }
+    return success;
+}
+
+static void Schema_dealloc(SchemaObject *self)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->count; i++) {
+        Py_XDECREF(self->names[i]);
+        Py_XDECREF(self->defaults[i]);
+        FreeType(&self->types[i]);
+    }
+    free(self->names);
+    free(self->types);
+    free(self->defaults);
+    Py_XDECREF(self->factory);
+    Py_XDECREF(self->extra);
+    _internal_decode_free(&self->decoder);
+    PyObject_Del(self);
+}
+
+/* Adds the field described by `spec` (see compile_schema's docstring) */
+static int AddField(SchemaObject *self, PyObject *spec)
+{
+    Py_ssize_t i, index = self->count;
+    PyObject *name = spec;
+    PyObject *type = (PyObject *)(&PyBaseObject_Type);
+    PyObject *value = NULL;
+
+    if (PyTuple_Check(spec)) {
+        if (!PyArg_ParseTuple(spec, "SO|O;field must be name, (name, type) or "
+                              "(name, type, default)", &name, &type, &value))
+            return failure;
+    } else if (!PyString_Check(spec)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "field must be name, (name, type) or (name, type, default)");
+        return failure;
+    }
+
+    for (i = 0; i < index; i++) {
+        if (_PyString_Eq(self->names[i], name)) {
+            PyErr_Format(PyExc_ValueError, "duplicate field '%.200s'", PyString_AS_STRING(name));
+            return failure;
+        }
+    }
+
+    if (ParseType(type, &self->types[index]) != success)
+        return failure;
+    Py_INCREF(name);
+    self->names[index] = name;
+    Py_XINCREF(value);
+    self->defaults[index] = value;
+    self->count++;
+    return success;
+}
+
+/*
+ * Returns a new Schema for the field specs in the sequence `fields`, whose
+ * records are built by `factory` (tuples when it's None).  With `extra`,
+ * one more slot named by it gets a dict of the unknown keys.
+ */
+PyObject *_internal_compile_schema(PyObject *fields, PyObject *factory, PyObject *extra)
+{
+    SchemaObject *self;
+    PyObject *sequence;
+    Py_ssize_t i, count;
+
+    if ((extra) && (extra != Py_None) && !PyString_Check(extra)) {
+        PyErr_SetString(PyExc_TypeError, "extra must be a field name");
+        return NULL;
+    }
+    if ((factory) && (factory != Py_None) && !PyCallable_Check(factory)) {
+        PyErr_SetString(PyExc_TypeError, "factory must be callable");
+        return NULL;
+    }
+
+    sequence = PySequence_Fast(fields, "fields must be a sequence");
+    if (!sequence)
+        return NULL;
+    count = PySequence_Fast_GET_SIZE(sequence);
+
+    self = PyObject_New(SchemaObject, &SchemaType);
+    if (!self) {
+        Py_DECREF(sequence);
+        return NULL;
+    }
+    self->count = 0;
+    self->names = (PyObject **)(calloc(count + 1, sizeof(PyObject *)));
+    self->types = (FieldType *)(calloc(count + 1, sizeof(FieldType)));
+    self->defaults = (PyObject **)(calloc(count + 1, sizeof(PyObject *)));
+    self->factory = NULL;
+    self->fast_tuple = 0;
+    self->extra = NULL;
+    self->busy = 0;
+    _internal_decode_init(&self->decoder);
+
+    if (!self->names || !self->types || !self->defaults) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (AddField(self, PySequence_Fast_GET_ITEM(sequence, i)) != success)
+            goto error;
+    }
+    Py_CLEAR(sequence);
+
+    if ((extra) && (extra != Py_None)) {
+        for (i = 0; i < count; i++) {
+            if (_PyString_Eq(self->names[i], extra)) {
+                PyErr_Format(PyExc_ValueError, "duplicate field '%.200s'",
+                             PyString_AS_STRING(extra));
+                goto error;
+            }
+        }
+        Py_INCREF(extra);
+        self->extra = extra;
+    }
+
+    if ((factory) && (factory != Py_None)) {
+        Py_INCREF(factory);
+        self->factory = factory;
+
+        /* namedtuples are filled in directly rather than called */
+        if (PyType_Check(factory) &&
+                PyType_IsSubtype((PyTypeObject *)(factory), &PyTuple_Type) &&
+                PyObject_HasAttrString(factory, "_fields")) {
+            PyObject *names = PyObject_GetAttrString(factory, "_fields");
+            Py_ssize_t length = names ? PyObject_Length(names) : -1;
+
+            Py_XDECREF(names);
+            if (length < 0)
+                goto error;
+            if (length != self->count + (self->extra ? 1 : 0)) {
+                PyErr_Format(PyExc_ValueError, "factory has %zd fields, schema has %zd",
+                             length, self->count + (self->extra ? 1 : 0));
+                goto error;
+            }
+            self->fast_tuple = 1;
+        }
+    }
+    return (PyObject *)(self);
+
+error:
+    Py_XDECREF(sequence);
+    Py_DECREF(self);
+    return NULL;
+}
+
+/*
+ * Returns the index of the field named by the key, or -1.  Keys usually
+ * come in the same order as the fields, so the search starts just after
+ * the last match.
+ */
+static Py_ssize_t FindField(SchemaObject *schema, Py_ssize_t guess, const unsigned char *key,
+                            size_t length)
+{
+    Py_ssize_t i, j;
+
+    for (i = 0, j = guess; i < schema->count; i++, j++) {
+        PyObject *name;
+
+        if (j >= schema->count)
+            j = 0;
+        name = schema->names[j];
+        if (((size_t)(PyString_GET_SIZE(name)) == length) &&
+                (memcmp(PyString_AS_STRING(name), key, length) == 0))
+            return j;
+    }
+    return -1;
+}
+
+static void ClearFrame(SchemaFrame *frame)
+{
+    Py_ssize_t i;
+
+    if (frame->schema) {
+        for (i = 0; i < frame->capacity; i++) {
+            Py_CLEAR(frame->values[i]);
+        }
+    }
+    Py_CLEAR(frame->extra);
+    Py_CLEAR(frame->key);
+    Py_CLEAR(frame->list);
+}
+
+static void FreeParse(SchemaParse *parse)
+{
+    unsigned int i;
+
+    for (i = 0; i < parse->size; i++) {
+        if (i < parse->depth)
+            ClearFrame(&parse->frames[i]);
+        free(parse->frames[i].values);
+    }
+    free(parse->frames);
+    Py_CLEAR(parse->result);
+}
+
+static SchemaFrame *PushFrame(SchemaParse *parse)
+{
+    SchemaFrame *frame;
+
+    if (parse->depth == parse->size) {
+        unsigned int size = parse->size ? parse->size * 2 : 8;
+        SchemaFrame *frames = (SchemaFrame *)(realloc(parse->frames, size * sizeof(SchemaFrame)));
+
+        if (!frames) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        memset(frames + parse->size, 0, (size - parse->size) * sizeof(SchemaFrame));
+        parse->frames = frames;
+        parse->size = size;
+    }
+    frame = &parse->frames[parse->depth++];
+    frame->schema = NULL;
+    frame->slot = SLOT_KEY;
+    frame->next = 0;
+    frame->item = NULL;
+    return frame;
+}
+
+/* The name of the innermost field being decoded, if any */
+static PyObject *FieldName(SchemaParse *parse)
+{
+    unsigned int i = parse->depth;
+
+    while (i-- > 0) {
+        SchemaFrame *frame = &parse->frames[i];
+
+        if (frame->schema && (frame->slot >= 0))
+            return frame->schema->names[frame->slot];
+    }
+    return NULL;
+}
+
+static int Mismatch(SchemaParse *parse, const FieldType *type, const char *got)
+{
+    PyObject *name = FieldName(parse);
+
+    if (name) {
+        PyErr_Format(PyExc_ValueError, "field '%.200s': expected %s, got %s",
+                     PyString_AS_STRING(name), kind_names[type->kind], got);
+    } else {
+        PyErr_Format(PyExc_ValueError, "expected %s, got %s", kind_names[type->kind], got);
+    }
+    return failure;
+}
+
+/* Stores a finished value (stealing the reference) where it belongs */
+static int Store(SchemaParse *parse, PyObject *value)
+{
+    SchemaFrame *frame;
+    int rc;
+
+    if (!value)
+        return failure;
+    if (parse->depth == 0) {
+        parse->result = value;
+        return success;
+    }
+
+    frame = &parse->frames[parse->depth - 1];
+    if (!frame->schema) {
+        rc = PyList_Append(frame->list, value);
+        Py_DECREF(value);
+        return (rc == 0) ? success : failure;
+    }
+
+    if (frame->slot == SLOT_EXTRA) {
+        if (!frame->extra && !(frame->extra = PyDict_New())) {
+            Py_DECREF(value);
+            return failure;
+        }
+        rc = PyDict_SetItem(frame->extra, frame->key, value);
+        Py_DECREF(value);
+        Py_CLEAR(frame->key);
+        frame->slot = SLOT_KEY;
+        return (rc == 0) ? success : failure;
+    }
+
+    /* a repeated key replaces the earlier value, as it would in a dict */
+    Py_XDECREF(frame->values[frame->slot]);
+    frame->values[frame->slot] = value;
+    frame->slot = SLOT_KEY;
+    return success;
+}
+
+/*
+ * The type expected of the value that's starting, or NULL when it's an
+ * unknown key's and should be skipped.  At the top level a record is
+ * expected, or an array of them.
+ */
+static const FieldType *Expected(SchemaParse *parse, int array, FieldType *top)
+{
+    SchemaFrame *frame;
+
+    if (parse->depth == 0) {
+        parse->record.kind = FIELD_RECORD;
+        parse->record.record = (PyObject *)(parse->root);
+        if (!array)
+            return &parse->record;
+        top->kind = FIELD_LIST;
+        top->item = &parse->record;
+        return top;
+    }
+
+    frame = &parse->frames[parse->depth - 1];
+    if (!frame->schema)
+        return frame->item;
+    switch (frame->slot) {
+        case SLOT_SKIP:
+            return NULL;
+        case SLOT_EXTRA:
+            top->kind = FIELD_ANY;
+            return top;
+    }
+    return &frame->schema->types[frame->slot];
+}
+
+/*
+ * Every value starts here.  Returns 1 if the value is checked and stored
+ * by the caller, 0 if it's been handled, or -1 when the regular callbacks
+ * should build it (for an `object` field or `extra`).
+ */
+static int BeginValue(SchemaParse *parse, int start, const FieldType **type, FieldType *top)
+{
+    if (parse->capturing)
+        return -1;
+    if (parse->skip) {
+        parse->skip += start;
+        return 0;
+    }
+
+    *type = Expected(parse, 0, top);
+    if (!*type) {
+        if (start) {
+            parse->skip = 1;
+        } else {
+            parse->frames[parse->depth - 1].slot = SLOT_KEY;
+        }
+        return 0;
+    }
+    if ((*type)->kind == FIELD_ANY) {
+        parse->capturing = start;
+        return -1;
+    }
+    return 1;
+}
+
+/* Stores the value the regular callbacks finished building, if there is one */
+static int StoreBuilt(SchemaParse *parse, _YajlDecoder *decoder, int rc)
+{
+    if ((rc != success) || (!decoder->root))
+        return rc;
+
+    parse->capturing = 0;
+    return Store(parse, _internal_take_root(decoder));
+}
+
+#define DECODER(ctx) ((_YajlDecoder *)(ctx))
+#define PARSE(ctx) ((SchemaParse *)(DECODER(ctx)->callback_state))
+
+/*
+ * Scalars are built by the regular callbacks too, for their string cache
+ * and stats; ints are converted for float fields
+ */
+static int StoreScalar(SchemaParse *parse, _YajlDecoder *decoder, const FieldType *type, int rc)
+{
+    PyObject *value;
+
+    if (rc != success)
+        return rc;
+    value = _internal_take_root(decoder);
+
+    if ((type->kind == FIELD_FLOAT) && !PyFloat_CheckExact(value)) {
+        PyObject *number = PyNumber_Float(value);
+
+        Py_DECREF(value);
+        return Store(parse, number);
+    }
+    return Store(parse, value);
+}
+
+static int schema_null(void *ctx)
+{
+    SchemaParse *parse = PARSE(ctx);
+    const FieldType *type;
+    FieldType top;
+
+    switch (BeginValue(parse, 0, &type, &top)) {
+        case -1:
+            return StoreBuilt(parse, DECODER(ctx), _internal_decode_callbacks.yajl_null(ctx));
+        case 0:
+            return success;
+    }
+    if (parse->depth == 0)
+        return Mismatch(parse, type, "null");
+    /* any field may be null */
+    Py_INCREF(Py_None);
+    return Store(parse, Py_None);
+}
+
+static int schema_boolean(void *ctx, int value)
+{
+    SchemaParse *parse = PARSE(ctx);
+    const FieldType *type;
+    FieldType top;
+
+    switch (BeginValue(parse, 0, &type, &top)) {
+        case -1:
+            return StoreBuilt(parse, DECODER(ctx),
+                              _internal_decode_callbacks.yajl_boolean(ctx, value));
+        case 0:
+            return success;
+    }
+    if (type->kind != FIELD_BOOL)
+        return Mismatch(parse, type, "bool");
+    return StoreScalar(parse, DECODER(ctx), type,
+                       _internal_decode_callbacks.yajl_boolean(ctx, value));
+}
+
+static int schema_number(void *ctx, const char *value, size_t length)
+{
+    SchemaParse *parse = PARSE(ctx);
+    const FieldType *type;
+    FieldType top;
+    size_t i;
+
+    switch (BeginValue(parse, 0, &type, &top)) {
+        case -1:
+            return StoreBuilt(parse, DECODER(ctx),
+                              _internal_decode_callbacks.yajl_number(ctx, value, length));
+        case 0:
+            return success;
+    }
+    if (type->kind == FIELD_INT) {
+        for (i = 0; i < length; i++) {
+            if ((value[i] == '.') || (value[i] == 'e') || (value[i] == 'E'))
+                return Mismatch(parse, type, "float");
+        }
+    } else if (type->kind != FIELD_FLOAT) {
+        return Mismatch(parse, type, "number");
+    }
+    return StoreScalar(parse, DECODER(ctx), type,
+                       _internal_decode_callbacks.yajl_number(ctx, value, length));
+}
+
+static int schema_string(void *ctx, const unsigned char *value, size_t length)
+{
+    SchemaParse *parse = PARSE(ctx);
+    const FieldType *type;
+    FieldType top;
+
+    switch (BeginValue(parse, 0, &type, &top)) {
+        case -1:
+            return StoreBuilt(parse, DECODER(ctx),
+                              _internal_decode_callbacks.yajl_string(ctx, value, length));
+        case 0:
+            return success;
+    }
+    if (type->kind != FIELD_STR)
+        return Mismatch(parse, type, "string");
+    return StoreScalar(parse, DECODER(ctx), type,
+                       _internal_decode_callbacks.yajl_string(ctx, value, length));
+}
+
+static int schema_start_map(void *ctx)
+{
+    SchemaParse *parse = PARSE(ctx);
+    const FieldType *type;
+    FieldType top;
+    SchemaFrame *frame;
+    SchemaObject *schema;
+    Py_ssize_t slots;
+
+    switch (BeginValue(parse, 1, &type, &top)) {
+        case -1:
+            return _internal_decode_callbacks.yajl_start_map(ctx);
+        case 0:
+            return success;
+    }
+    if (type->kind != FIELD_RECORD)
+        return Mismatch(parse, type, "object");
+
+    schema = SCHEMA(type->record);
+    slots = schema->count;
+    frame = PushFrame(parse);
+    if (!frame)
+        return failure;
+    if (frame->capacity < slots) {
+        PyObject **values = (PyObject **)(realloc(frame->values, slots * sizeof(PyObject *)));
+
+        if (!values) {
+            parse->depth--;
+            PyErr_NoMemory();
+            return failure;
+        }
+        memset(values + frame->capacity, 0, (slots - frame->capacity) * sizeof(PyObject *));
+        frame->values = values;
+        frame->capacity = slots;
+    }
+    frame->schema = schema;
+    return success;
+}
+
+static int schema_map_key(void *ctx, const unsigned char *value, size_t length)
+{
+    SchemaParse *parse = PARSE(ctx);
+    SchemaFrame *frame;
+    Py_ssize_t slot;
+
+    if (parse->capturing)
+        return _internal_decode_callbacks.yajl_map_key(ctx, value, length);
+    if (parse->skip)
+        return success;
+
+    frame = &parse->frames[parse->depth - 1];
+    slot = FindField(frame->schema, frame->next, value, length);
+    if (slot >= 0) {
+        frame->slot = slot;
+        frame->next = slot + 1;
+    } else if (frame->schema->extra) {
+        frame->key = PyString_FromStringAndSize((const char *)(value), length);
+        if (!frame->key)
+            return failure;
+        frame->slot = SLOT_EXTRA;
+    } else {
+        frame->slot = SLOT_SKIP;
+    }
+    return success;
+}
+
+/* Builds the record in the top frame and pops it */
+static PyObject *BuildRecord(SchemaParse *parse)
+{
+    SchemaFrame *frame = &parse->frames[parse->depth - 1];
+    SchemaObject *schema = frame->schema;
+    Py_ssize_t i, slots = schema->count + (schema->extra ? 1 : 0);
+    PyObject *record, *tuple;
+
+    for (i = 0; i < schema->count; i++) {
+        if (frame->values[i])
+            continue;
+        if (!schema->defaults[i]) {
+            PyErr_Format(PyExc_ValueError, "missing field '%.200s'",
+                         PyString_AS_STRING(schema->names[i]));
+            return NULL;
+        }
+        Py_INCREF(schema->defaults[i]);
+        frame->values[i] = schema->defaults[i];
+    }
+
+    if (schema->fast_tuple) {
+        PyTypeObject *type = (PyTypeObject *)(schema->factory);
+
+        tuple = type->tp_alloc(type, slots);
+    } else {
+        tuple = PyTuple_New(slots);
+    }
+    if (!tuple)
+        return NULL;
+
+    for (i = 0; i < schema->count; i++) {
+        PyTuple_SET_ITEM(tuple, i, frame->values[i]);
+        frame->values[i] = NULL;
+    }
+    if (schema->extra) {
+        if (!frame->extra) {
+            Py_INCREF(Py_None);
+            frame->extra = Py_None;
+        }
+        PyTuple_SET_ITEM(tuple, i, frame->extra);
+        frame->extra = NULL;
+    }
+    parse->depth--;
+
+    if (!schema->factory || schema->fast_tuple)
+        return tuple;
+    record = PyObject_Call(schema->factory, tuple, NULL);
+    Py_DECREF(tuple);
+    return record;
+}
+
+static int schema_end_map(void *ctx)
+{
+    SchemaParse *parse = PARSE(ctx);
+
+    if (parse->capturing)
+        return StoreBuilt(parse, DECODER(ctx), _internal_decode_callbacks.yajl_end_map(ctx));
+    if (parse->skip) {
+        if (--parse->skip == 0)
+            parse->frames[parse->depth - 1].slot = SLOT_KEY;
+        return success;
+    }
+    return Store(parse, BuildRecord(parse));
+}
+
+static int schema_start_array(void *ctx)
+{
+    SchemaParse *parse = PARSE(ctx);
+    const FieldType *type;
+    FieldType top;
+    SchemaFrame *frame;
+    PyObject *list;
+
+    if (!parse->capturing && !parse->skip && (parse->depth == 0)) {
+        type = Expected(parse, 1, &top);
+    } else {
+        switch (BeginValue(parse, 1, &type, &top)) {
+            case -1:
+                return _internal_decode_callbacks.yajl_start_array(ctx);
+            case 0:
+                return success;
+        }
+    }
+    if (type->kind != FIELD_LIST)
+        return Mismatch(parse, type, "array");
+
+    list = PyList_New(0);
+    if (!list)
+        return failure;
+    frame = PushFrame(parse);
+    if (!frame) {
+        Py_DECREF(list);
+        return failure;
+    }
+    frame->item = type->item;
+    frame->list = list;
+    return success;
+}
+
+static int schema_end_array(void *ctx)
+{
+    SchemaParse *parse = PARSE(ctx);
+    PyObject *list;
+
+    if (parse->capturing)
+        return StoreBuilt(parse, DECODER(ctx), _internal_decode_callbacks.yajl_end_array(ctx));
+    if (parse->skip) {
+        if (--parse->skip == 0)
+            parse->frames[parse->depth - 1].slot = SLOT_KEY;
+        return success;
+    }
+
+    list = parse->frames[parse->depth - 1].list;
+    parse->frames[parse->depth - 1].list = NULL;
+    parse->depth--;
+    return Store(parse, list);
+}
+
+static yajl_callbacks schema_callbacks = {
+    schema_null,
+    schema_boolean,
+    NULL,
+    NULL,
+    schema_number,
+    schema_string,
+    schema_start_map,
+    schema_map_key,
+    schema_end_map,
+    schema_start_array,
+    schema_end_array
+};
+
+static PyObject *Decode(SchemaObject *self, _YajlDecoder *decoder, char *buffer,
+                        unsigned int buflen)
+{
+    SchemaParse parse;
+    PyObject *result = NULL;
+    yajl_status yrc;
+
+    memset(&parse, 0, sizeof(parse));
+    parse.root = self;
+
+    _internal_decode_reset(decoder);
+    decoder->_parser = yajl_alloc(&schema_callbacks, &decoder->arena.funcs, (void *)(decoder));
+    if (!decoder->_parser) {
+        PyErr_NoMemory();
+        goto exit;
+    }
+    decoder->callback_state = &parse;
+
+    yrc = _internal_parse((yajl_handle)(decoder->_parser), (const unsigned char *)(buffer),
+                          buflen, 0);
+    if (yrc != yajl_status_ok) {
+        _internal_decode_error(decoder, yrc, buffer, buflen);
+        goto exit;
+    }
+    yrc = _internal_parse((yajl_handle)(decoder->_parser), NULL, 0, 1);
+    if (yrc != yajl_status_ok) {
+        _internal_decode_error(decoder, yrc, NULL, 0);
+        goto exit;
+    }
+
+    if (_internal_stats_enabled)
+        _internal_stats.documents++;
+    result = parse.result;
+    parse.result = NULL;
+
+exit:
+    decoder->callback_state = NULL;
+    _internal_decode_reset(decoder);
+    FreeParse(&parse);
+    return result;
+}
+
+static PyObject *Schema_loads(SchemaObject *self, PyObject *args)
+{
+    PyObject *pybuffer = NULL;
+    PyObject *result;
+    Py_buffer view;
+
+    if (!PyArg_ParseTuple(args, "O", &pybuffer))
+        return NULL;
+    if (_internal_get_input(pybuffer, &view) != success)
+        return NULL;
+
+    /* a factory that calls back into loads() gets a decoder of its own */
+    if (self->busy) {
+        _YajlDecoder decoder;
+
+        _internal_decode_init(&decoder);
+        result = Decode(self, &decoder, (char *)(view.buf), (unsigned int)(view.len));
+        _internal_decode_free(&decoder);
+    } else {
+        self->busy = 1;
+        result = Decode(self, &self->decoder, (char *)(view.buf), (unsigned int)(view.len));
+        self->busy = 0;
+    }
+
+    PyBuffer_Release(&view);
+    return result;
+}
+
+static PyObject *Schema_get_fields(SchemaObject *self, void *closure)
+{
+    Py_ssize_t i, slots = self->count + (self->extra ? 1 : 0);
+    PyObject *fields = PyTuple_New(slots);
+
+    if (!fields)
+        return NULL;
+    for (i = 0; i < self->count; i++) {
+        Py_INCREF(self->names[i]);
+        PyTuple_SET_ITEM(fields, i, self->names[i]);
+    }
+    if (self->extra) {
+        Py_INCREF(self->extra);
+        PyTuple_SET_ITEM(fields, i, self->extra);
+    }
+    return fields;
+}
+
+static PyMethodDef schema_methods[] = {
+    {"loads", (PyCFunction)(Schema_loads), METH_VARARGS,
+"loads(string)\n\n\
+Decodes the JSON object in `string` into a record, or the JSON array of\n\
+objects into a list of records."},
+    {NULL}
+};
+
+static PyGetSetDef schema_getset[] = {
+    {"fields", (getter)(Schema_get_fields), NULL, "the names of the record's slots", NULL},
+    {NULL}
+};
+
+static PyTypeObject SchemaType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "yajl.Schema",                              /* tp_name */
+    sizeof(SchemaObject),                       /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)(Schema_dealloc),               /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    "A compiled record schema; see yajl.compile_schema()", /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    schema_methods,                             /* tp_methods */
+    0,                                          /* tp_members */
+    schema_getset,                              /* tp_getset */
+};
+
+int _internal_schema_init(PyObject *module)
+{
+    if (PyType_Ready(&SchemaType) < 0)
+        return failure;
+    Py_INCREF(&SchemaType);
+    PyModule_AddObject(module, "Schema", (PyObject *)(&SchemaType));
+    return success;
+}
@@ -27,6 +27,11 @@ base_modules = [
                 'yajl.c',
                 'encoder.c',
                 'decoder.c',
+                'arena.c',
+                'lazy.c',
+                'events.c',
+                'batch.c',
+                'schema.c',
                 'yajl/src/yajl_alloc.c',
                 'yajl/src/yajl_buf.c',
                 'yajl/src/yajl.c',
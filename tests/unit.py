@@ -2,8 +2,10 @@
 # -*- coding: utf-8 -*-
 from __future__ import print_function
 
+import mmap
 import os
 import sys
+import tempfile
 import unittest
 
 from cStringIO import StringIO
@@ -36,6 +38,24 @@ class BasicJSONDecodeTests(DecoderBase):
     def test_ListOfFloats(self):
         self.assertDecodesTo('[3.14, 2.718]', [3.14, 2.718])
 
+    def test_Numbers(self):
+        self.assertDecodesTo('[0, -0, 42, -42, 9223372036854775807]',
+                [0, 0, 42, -42, 9223372036854775807])
+        self.assertDecodesTo('[1e2, 1E-2, -0.5, 2.5e+3, 0e999]',
+                [100.0, 0.01, -0.5, 2500.0, 0.0])
+
+    def test_LongNumbers(self):
+        self.assertDecodesTo('[-9223372036854775809, 123456789012345678901234567890]',
+                [-9223372036854775809, 123456789012345678901234567890])
+        rc = self.decode('[18446744073709551615]')
+        self.assertEquals(type(rc[0]), long)
+
+    def test_FloatRounding(self):
+        for s in ('0.1', '2.2250738585072014e-308', '1.7976931348623157e308',
+                  '9007199254740993.0', '4.9e-324', '1e23'):
+            self.assertEquals(repr(self.decode(s)), repr(float(s)))
+        self.assertEquals(self.decode('1e400'), float('inf'))
+
     def test_Dict(self):
         self.assertDecodesTo('{"key" : "pair"}', {'key' : 'pair'})
 
@@ -54,6 +74,148 @@ class BasicJSONDecodeTests(DecoderBase):
             {"key" : {"subkey" : [1, 2, 3]}}''',
                 {'key' : {'subkey' : [1,2,3]}})
 
+    def test_DuplicateKeys(self):
+        self.assertDecodesTo('{"a" : 1, "b" : 2, "a" : 3}', {'a' : 3, 'b' : 2})
+
+    def test_LargeContainers(self):
+        items = [{'k%d' % j : [j] * j for j in range(i % 12)} for i in range(500)]
+        self.assertDecodesTo(yajl.dumps(items), items)
+
+    def test_DeepNesting(self):
+        self.assertDecodesTo('[' * 300 + '{"a" : []}' + ']' * 300,
+                reduce(lambda value, i: [value], range(300), {'a' : []}))
+
+
+class KeyCacheTests(DecoderBase):
+    def test_RepeatedKeysShared(self):
+        rc = self.decode('[{"name" : 1}, {"name" : 2}]')
+        self.assertEquals(rc, [{'name' : 1}, {'name' : 2}])
+        self.assert_(rc[0].keys()[0] is rc[1].keys()[0])
+
+    def test_ShortValuesShared(self):
+        rc = self.decode('["abc", "abc", "abd"]')
+        self.assertEquals(rc, ['abc', 'abc', 'abd'])
+        self.assert_(rc[0] is rc[1])
+
+    def test_LongKeys(self):
+        key = 'k' * 200
+        self.assertDecodesTo('{"%s" : [{"%s" : 1}]}' % (key, key),
+                {key : [{key : 1}]})
+
+
+class ReleaseGilDecodeTests(BasicJSONDecodeTests, KeyCacheTests):
+    def decode(self, json):
+        return yajl.loads(json, release_gil=True)
+
+    def test_Escapes(self):
+        self.assertDecodesTo('{"a\\"b" : ["\\u00e9\\n", {"c\\/" : 1}]}',
+                {'a"b' : ['\xc3\xa9\n', {'c/' : 1}]})
+
+    def test_Errors(self):
+        for json in ('', '  ', '[1, 2', '[1] 2', '{"a" 1}'):
+            self.failUnlessRaises(ValueError, self.decode, json)
+
+    def test_Threads(self):
+        import threading
+        json = yajl.dumps([{'key%d' % i : ['value', i, None]} for i in range(5000)])
+        expected = yajl.loads(json)
+        results = []
+        def worker():
+            results.append(self.decode(json) == expected)
+        threads = [threading.Thread(target=worker) for i in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEquals(results, [True] * 4)
+
+
+class NDJSONParallelTests(unittest.TestCase):
+    records = [{'n' : i, 'pad' : 'x' * (i * 37 % 300)} for i in range(500)]
+
+    def setUp(self):
+        fd, self.path = tempfile.mkstemp()
+        lines = [yajl.dumps(r) for r in self.records]
+        lines.insert(10, '')
+        os.write(fd, '\n'.join(lines))
+        os.close(fd)
+
+    def tearDown(self):
+        os.unlink(self.path)
+
+    def test_records(self):
+        for threads, window in ((0, 0), (1, 1), (3, 1000)):
+            rc = list(yajl.load_ndjson_parallel(self.path, threads=threads, window=window))
+            self.assertEquals(rc, self.records)
+
+    def test_pipe(self):
+        import threading
+        fifo = self.path + '.fifo'
+        os.mkfifo(fifo)
+        try:
+            def writer():
+                with open(fifo, 'w') as fp:
+                    fp.write(open(self.path).read())
+            t = threading.Thread(target=writer)
+            t.start()
+            rc = list(yajl.load_ndjson_parallel(fifo, window=1000))
+            t.join()
+            self.assertEquals(rc, self.records)
+        finally:
+            os.unlink(fifo)
+
+    def test_errors(self):
+        with open(self.path, 'w') as fp:
+            fp.write('[1]\n[2\n[3]\n')
+        rc = yajl.load_ndjson_parallel(self.path)
+        self.assertEquals(next(rc), [1])
+        self.failUnlessRaises(ValueError, next, rc)
+        self.failUnlessRaises(StopIteration, next, rc)
+        self.failUnlessRaises(IOError, yajl.load_ndjson_parallel, '/nonexistent/file')
+
+
+class LoadsManyTests(unittest.TestCase):
+    def test_order(self):
+        docs = [yajl.dumps({'n' : i, 'pad' : 'x' * (i * 37 % 500)}) for i in range(200)]
+        for threads in (0, 1, 3):
+            self.assertEquals(yajl.loads_many(docs, threads=threads),
+                              [yajl.loads(d) for d in docs])
+
+    def test_errors(self):
+        rc = yajl.loads_many(['[1]', '[1, 2', '', bytearray('{"a" : null}')])
+        self.assertEquals(rc[0], [1])
+        self.assert_(isinstance(rc[1], ValueError))
+        self.assert_(isinstance(rc[2], ValueError))
+        self.assertEquals(rc[3], {'a' : None})
+
+    def test_empty(self):
+        self.assertEquals(yajl.loads_many([]), [])
+
+    def test_bad_input(self):
+        self.failUnlessRaises(TypeError, yajl.loads_many, ['[1]', None])
+        self.failUnlessRaises(TypeError, yajl.loads_many, 5)
+
+
+class NumericArrayTests(unittest.TestCase):
+    doc = '{"i" : [1, -2, 3], "f" : [0.5, 1e3], "mixed" : [1, 2.5], "s" : [1, "x"], ' \
+          '"big" : [1, 99999999999999999999], "empty" : [], "nested" : [[1], [2.5]]}'
+
+    def test_arrays(self):
+        import array
+        for release_gil in (False, True):
+            rc = yajl.loads(self.doc, numeric_arrays=True, release_gil=release_gil)
+            self.assertEquals(rc['i'], array.array('l', [1, -2, 3]))
+            self.assertEquals(rc['f'], array.array('d', [0.5, 1000.0]))
+            self.assertEquals(rc['nested'], [array.array('l', [1]), array.array('d', [2.5])])
+            for key in ('mixed', 's', 'big', 'empty'):
+                self.assertEquals(rc[key], yajl.loads(self.doc)[key])
+                self.assert_(type(rc[key]) is list)
+
+    def test_scalars(self):
+        self.assertEquals(yajl.loads('[1, [2, 3]]', numeric_arrays=True)[0], 1)
+        self.assertEquals(yajl.loads('7', numeric_arrays=True), 7)
+        self.failUnlessRaises(ValueError, yajl.loads, '[1, 2', numeric_arrays=True)
+
 
 class EncoderBase(unittest.TestCase):
     def encode(self, value):
@@ -111,6 +273,39 @@ class BasicJSONEncodeTests(EncoderBase):
             '{"key":{"subkey":[1,2,3]}}')
     def test_Tuple(self):
         self.assertEncodesTo((1,2), '[1,2]')
+    def test_StringEscapes(self):
+        self.assertEncodesTo('a"b\\c/\b\f\n\r\t\x00\x1f\x7f',
+            '"a\\"b\\\\c/\\b\\f\\n\\r\\t\\u0000\\u001F\x7f"')
+        self.assertEncodesTo({'k"' : 'v\n'}, '{"k\\"":"v\\n"}')
+
+    def test_LongStrings(self):
+        # Escapes at every offset within and across scanner blocks
+        for n in (15, 16, 17, 31, 32, 33, 100):
+            for i in range(n):
+                s = 'x' * i + '"' + 'y' * (n - i)
+                self.assertEquals(yajl.dumps(s), '"%s\\"%s"' % ('x' * i, 'y' * (n - i)))
+                self.assertEquals(yajl.loads(yajl.dumps([s, s])), [s, s])
+
+    def test_Integers(self):
+        self.assertEncodesTo([0, 7, -7, 10, 99, -100, 2**31, -2**63, 2**63 - 1],
+            '[0,7,-7,10,99,-100,2147483648,-9223372036854775808,9223372036854775807]')
+
+    def test_LongIntegers(self):
+        self.assertEncodesTo([2**64, -2**100, 10**40],
+            '[18446744073709551616,-1267650600228229401496703205376,%d]' % 10**40)
+
+    def test_Floats(self):
+        self.assertEncodesTo([0.0, -0.0, 1.0, 0.1, 1500.0, 1e16, 1e17, 1e-4, 1e-5],
+            '[0.0,-0.0,1.0,0.1,1500.0,1e+16,1e+17,0.0001,1e-05]')
+        for f in (0.1 + 0.2, 1 / 3.0, 5e-324, 1.7976931348623157e308,
+                  123456789.123, -2.5e-100):
+            self.assertEquals(yajl.dumps(f), repr(f))
+            self.assertEquals(yajl.loads(yajl.dumps(f)), f)
+
+    def test_NonFiniteFloats(self):
+        for f in (float('nan'), float('inf'), float('-inf')):
+            self.assertRaises(ValueError, yajl.dumps, [f])
+
     def test_generator(self):
         def f():
             for i in range(10):
@@ -122,6 +317,94 @@ class BasicJSONEncodeTests(EncoderBase):
             pass
         self.assertRaises(TypeError, yajl.dumps, Bad)
 
+    def test_StopsAtFirstError(self):
+        seen = []
+        def f():
+            for i in range(3):
+                seen.append(i)
+                yield i
+        class Bad(object):
+            pass
+        self.assertRaises(TypeError, yajl.dumps, [[Bad()], f()])
+        self.assertRaises(TypeError, yajl.dumps, (x for x in [1, Bad(), f()]))
+        self.assertEquals(seen, [])
+
+    def test_GeneratorRaises(self):
+        def f():
+            yield 1
+            raise KeyError('boom')
+        self.assertRaises(KeyError, yajl.dumps, [f()])
+
+    def test_MaxDepth(self):
+        value = reduce(lambda value, i: [value], range(127), 1)
+        self.assertEquals(yajl.dumps(value), '[' * 127 + '1' + ']' * 127)
+        self.assertRaises(ValueError, yajl.dumps, [value])
+        self.assertRaises(ValueError, yajl.dumps, {'a' : {'b' : [1]}}, max_depth=2)
+        self.assertEquals(yajl.dumps({'a' : {'b' : 1}}, max_depth=2), '{"a":{"b":1}}')
+        self.assertEquals(yajl.dumps(1, max_depth=0), '1')
+        self.assertRaises(ValueError, yajl.dumps, 1, max_depth=1000)
+        cycle = []
+        cycle.append(cycle)
+        self.assertRaises(ValueError, yajl.dumps, cycle)
+        self.assertRaises(ValueError, yajl.Encoder(max_depth=1).encode, [[]])
+
+    def test_subclasses(self):
+        class MyList(list): pass
+        class MyTuple(tuple): pass
+        class MyDict(dict): pass
+        class MyStr(str): pass
+        class MyInt(int): pass
+        class MyFloat(float): pass
+        self.assertEncodesTo(MyList([MyTuple((1, 2)), MyDict(key=MyStr('x'))]),
+                '[[1,2],{"key":"x"}]')
+        self.assertEncodesTo([MyInt(3), MyFloat(0.5)], '[3,0.5]')
+
+    def test_nested_generators(self):
+        def f(n):
+            for i in range(n):
+                yield {'n' : i, 'items' : (x for x in range(i))}
+        self.assertEncodesTo(f(3),
+            '[{"items":[],"n":0},{"items":[0],"n":1},{"items":[0,1],"n":2}]')
+
+
+class KeyCacheEncodeTests(EncoderBase):
+    keys = ['id', 'q"uote', 'back\\slash', 'ctl\x01', '\xc3\xa9']
+
+    def records(self, count):
+        values = [1, 'x"\n', 2.5, None, True, False, 2 ** 70]
+        return [dict((key, values[(i + j) % len(values)])
+                     for j, key in enumerate(self.keys)) for i in range(count)]
+
+    def test_RepeatedShapes(self):
+        records = self.records(200)
+        expected = '[%s]' % ','.join(self.encode(r) for r in records)
+        self.assertEncodesTo(records, expected)
+        self.assertEquals(yajl.loads(expected), records)
+
+    def test_ChangingShapes(self):
+        records = self.records(100)
+        records += [dict(r, extra=[1]) for r in records] + [{'id' : 1}] * 100
+        records += [{'k' * 100 : 1, 'id' : 2}] * 100
+        expected = '[%s]' % ','.join(self.encode(r) for r in records)
+        self.assertEncodesTo(records, expected)
+
+    def test_Errors(self):
+        records = self.records(200)
+        self.failUnlessRaises(ValueError, self.encode,
+                records + [dict(records[0], id=float('nan'))])
+        self.failUnlessRaises(TypeError, self.encode,
+                records + [{1 : 2, 'id' : 3}])
+
+    def test_Indented(self):
+        records = self.records(100)
+        self.assertEquals(yajl.loads(yajl.dumps(records, indent=2)), records)
+
+    def test_ReusedEncoder(self):
+        encoder = yajl.Encoder()
+        for i in range(3):
+            records = [{'key%d' % i : j, 'id' : 'v'} for j in range(100)]
+            self.assertEquals(encoder.encode(records), self.encode(records))
+
 
 class ErrorCasesTests(unittest.TestCase):
 
@@ -146,6 +429,382 @@ class StreamBlockingDecodingTests(unittest.TestCase):
         obj = yajl.load(self.stream)
         self.assertEquals(obj, {'foo' : ['one', 'two', ['three', 'four']]})
 
+    def test_large_decode(self):
+        # Spans several of load()'s read chunks
+        value = [{'key%d' % i : 'value' * 10} for i in range(20000)]
+        obj = yajl.load(StringIO(yajl.dumps(value)))
+        self.assertEquals(obj, value)
+
+
+class BufferInputTests(unittest.TestCase):
+    json = '{"foo":["one","two", ["three", 1.5e3, true, null]]}'
+    expected = {'foo' : ['one', 'two', ['three', 1500.0, True, None]]}
+
+    def test_buffer_types(self):
+        for source in (bytearray(self.json), memoryview(self.json),
+                       buffer(self.json)):
+            self.assertEquals(yajl.loads(source), self.expected)
+            self.assertEquals(yajl.Decoder().decode(source), self.expected)
+            self.assertEquals(yajl.loads(source, release_gil=True), self.expected)
+            self.assertEquals(yajl.loads_many([source]), [self.expected])
+
+    def test_mmap(self):
+        with tempfile.TemporaryFile() as fp:
+            fp.write(self.json)
+            fp.flush()
+            mapping = mmap.mmap(fp.fileno(), 0, access=mmap.ACCESS_READ)
+            try:
+                self.assertEquals(yajl.loads(mapping), self.expected)
+                self.assertEquals(yajl.loads(mapping, release_gil=True), self.expected)
+            finally:
+                mapping.close()
+
+    def test_unicode(self):
+        self.failUnlessRaises(TypeError, yajl.loads, u'[1]')
+
+    def test_load_file(self):
+        value = [{'key%d' % i : 'value' * 10} for i in range(20000)]
+        fd, path = tempfile.mkstemp()
+        try:
+            os.write(fd, yajl.dumps(value))
+            os.close(fd)
+            self.assertEquals(yajl.load_file(path), value)
+            with open(path, 'w') as fp:
+                fp.write('')
+            self.failUnlessRaises(ValueError, yajl.load_file, path)
+        finally:
+            os.unlink(path)
+
+    def test_load_file_pipe(self):
+        import threading
+        fifo = tempfile.mktemp()
+        os.mkfifo(fifo)
+        try:
+            def writer():
+                with open(fifo, 'w') as fp:
+                    fp.write('[1, 2]')
+            t = threading.Thread(target=writer)
+            t.start()
+            rc = yajl.load_file(fifo)
+            t.join()
+            self.assertEquals(rc, [1, 2])
+        finally:
+            os.unlink(fifo)
+
+    def test_load_file_missing(self):
+        self.failUnlessRaises(IOError, yajl.load_file, '/nonexistent/file.json')
+
+
+class IncrementalDecoderTests(unittest.TestCase):
+    def test_chunks(self):
+        json = '{"foo":["one","two", ["three", 1.5e3, true, null]]}'
+        decoder = yajl.IncrementalDecoder()
+        for c in json:
+            decoder.feed(c)
+        self.assertEquals(decoder.close(),
+                {'foo' : ['one', 'two', ['three', 1500.0, True, None]]})
+
+    def test_reuse(self):
+        decoder = yajl.IncrementalDecoder()
+        decoder.feed('[1, 2')
+        decoder.feed(']')
+        self.assertEquals(decoder.close(), [1, 2])
+        decoder.feed('12')
+        decoder.feed('34')
+        self.assertEquals(decoder.close(), 1234)
+
+    def test_errors(self):
+        decoder = yajl.IncrementalDecoder()
+        decoder.feed('{"foo" : [1, ')
+        self.failUnlessRaises(ValueError, decoder.close)
+        self.failUnlessRaises(ValueError, decoder.feed, '}')
+        self.failUnlessRaises(TypeError, decoder.feed, None)
+        decoder.feed('"ok"')
+        self.assertEquals(decoder.close(), 'ok')
+
+    def test_reset(self):
+        decoder = yajl.IncrementalDecoder()
+        decoder.feed('[[{"a" : ')
+        decoder.reset()
+        decoder.feed('{}')
+        self.assertEquals(decoder.close(), {})
+
+
+class MultipleValuesTests(unittest.TestCase):
+    def test_loads_multi(self):
+        rc = list(yajl.loads_multi('1 "two"\n[3]{"four" : 4}\n\nnull'))
+        self.assertEquals(rc, [1, 'two', [3], {'four' : 4}, None])
+
+    def test_empty(self):
+        self.assertEquals(list(yajl.loads_multi('')), [])
+        self.assertEquals(list(yajl.loads_multi(' \n\n ')), [])
+        self.assertEquals(list(yajl.load_lines(StringIO(''))), [])
+
+    def test_errors(self):
+        values = yajl.loads_multi('[1]\n[2\n')
+        self.assertEquals(values.next(), [1])
+        self.failUnlessRaises(ValueError, values.next)
+        self.failUnlessRaises(StopIteration, values.next)
+        self.failUnlessRaises(TypeError, yajl.loads_multi, None)
+        self.failUnlessRaises(TypeError, yajl.load_lines, 'not a stream')
+
+    def test_values_before_error(self):
+        for values in (yajl.load_lines(StringIO('[1]\n[2]\n{x}\n[3]\n')),
+                       yajl.loads_multi('[1]\n[2]\n{x}\n[3]\n')):
+            self.assertEquals(values.next(), [1])
+            self.assertEquals(values.next(), [2])
+            self.failUnlessRaises(ValueError, values.next)
+            self.failUnlessRaises(StopIteration, values.next)
+
+    def test_load_lines(self):
+        records = [{'id' : i, 'name' : 'record %d' % i} for i in range(10000)]
+        stream = StringIO('\n'.join(yajl.dumps(r) for r in records) + '\n')
+        self.assertEquals(list(yajl.load_lines(stream)), records)
+
+    def test_load_lines_file(self):
+        # the per-line loop of tests/issue_6.py, against load_lines() on a real file
+        with tempfile.TemporaryFile() as fp:
+            for i in range(3000):
+                fp.write(yajl.dumps({'i' : i, 'text' : 'x' * (i % 100)}) + '\n')
+            fp.seek(0)
+            expected = [yajl.loads(line.rstrip('\n')) for line in fp]
+            fp.seek(0)
+            self.assertEquals(list(yajl.load_lines(fp)), expected)
+
+
+class ReusableObjectsTests(unittest.TestCase):
+    def test_decoder(self):
+        decoder = yajl.Decoder()
+        for i in range(3):
+            self.assertEquals(decoder.decode('{"key" : [%d, 2.5]}' % i),
+                    {'key' : [i, 2.5]})
+        self.assertEquals(decoder.decode('12'), 12)
+        self.assertEquals(decoder.decode(' "str" \n'), 'str')
+
+    def test_decoder_errors(self):
+        decoder = yajl.Decoder()
+        for bad in ('', '  ', '[1, 2', '1 2', '[1] [2]', '{} "abc', '"abc', '[1]]'):
+            self.failUnlessRaises(ValueError, decoder.decode, bad)
+            self.assertEquals(decoder.decode('[%r]' % len(bad)), [len(bad)])
+        self.failUnlessRaises(TypeError, decoder.decode, None)
+
+    def test_encoder(self):
+        encoder = yajl.Encoder()
+        self.assertEquals(encoder.encode({'key' : [1, 2]}), '{"key":[1,2]}')
+        self.assertEquals(encoder.encode('str'), '"str"')
+        self.failUnlessRaises(TypeError, encoder.encode, [1, set()])
+        self.assertEquals(encoder.encode([None]), '[null]')
+
+    def test_encoder_indent(self):
+        encoder = yajl.Encoder(indent=2)
+        for i in range(2):
+            self.assertEquals(encoder.encode({'foo' : 'bar'}),
+                    '{\n  "foo": "bar"\n}\n')
+
+
+class PathProjectionTests(unittest.TestCase):
+    doc = '{"items" : [{"id" : 1, "tags" : ["x", "y"]}, {"id" : 2.5}], "a/b" : {"~c" : true}, "n" : null}'
+
+    def test_dotted(self):
+        self.assertEquals(yajl.loads(self.doc, paths=['items.1.id', 'n', 'items.0.tags']),
+                {'items.1.id' : 2.5, 'n' : None, 'items.0.tags' : ['x', 'y']})
+
+    def test_pointer(self):
+        self.assertEquals(yajl.loads(self.doc, paths=['/items/0/tags/1', '/a~1b/~0c']),
+                {'/items/0/tags/1' : 'y', '/a~1b/~0c' : True})
+
+    def test_nested_and_whole(self):
+        rc = yajl.loads(self.doc, paths=['items.0', 'items.0.id', ''])
+        self.assertEquals(rc['items.0'], {'id' : 1, 'tags' : ['x', 'y']})
+        self.assertEquals(rc['items.0.id'], 1)
+        self.assertEquals(rc[''], yajl.loads(self.doc))
+
+    def test_missing(self):
+        self.assertEquals(yajl.loads(self.doc, paths=['items.5', 'n.x', 'nope', 'items.id']), {})
+
+    def test_errors(self):
+        for bad in ('', '[1, 2', '[1] [2]', '{"a" 1}'):
+            self.failUnlessRaises(ValueError, yajl.loads, bad, paths=['a'])
+        self.failUnlessRaises(TypeError, yajl.loads, self.doc, paths=[1])
+        self.failUnlessRaises(TypeError, yajl.loads, self.doc, paths='ab')
+        self.failUnlessRaises(TypeError, yajl.loads, self.doc, paths=u'ab')
+
+
+class IterParseTests(unittest.TestCase):
+    doc = '{"a" : [1, {"b" : null}], "c" : "x"}'
+
+    def test_events(self):
+        self.assertEquals(list(yajl.iterparse(StringIO(self.doc))), [
+            ('', 'start_map', None),
+            ('', 'map_key', 'a'),
+            ('a', 'start_array', None),
+            ('a.item', 'number', 1),
+            ('a.item', 'start_map', None),
+            ('a.item', 'map_key', 'b'),
+            ('a.item.b', 'null', None),
+            ('a.item', 'end_map', None),
+            ('a', 'end_array', None),
+            ('', 'map_key', 'c'),
+            ('c', 'string', 'x'),
+            ('', 'end_map', None)])
+
+    def test_items(self):
+        self.assertEquals(list(yajl.items(StringIO(self.doc), 'a.item')),
+                [1, {'b' : None}])
+        self.assertEquals(list(yajl.items(StringIO(self.doc), '')),
+                [yajl.loads(self.doc)])
+        self.assertEquals(list(yajl.items(StringIO(self.doc), 'nope')), [])
+
+    def test_large_array(self):
+        doc = StringIO(yajl.dumps([{'i' : i} for i in range(20000)]))
+        self.assertEquals(sum(item['i'] for item in yajl.items(doc, 'item')),
+                sum(range(20000)))
+
+    def test_errors(self):
+        self.failUnlessRaises(ValueError, list, yajl.iterparse(StringIO('[1, 2')))
+        self.failUnlessRaises(ValueError, list, yajl.items(StringIO('[1] 2'), 'item'))
+        self.failUnlessRaises(TypeError, yajl.iterparse, 'not a stream')
+
+        # what came before the error is still handed out
+        items = yajl.items(StringIO('[1, 2, 3, x]'), 'item')
+        self.assertEquals([items.next() for i in range(3)], [1, 2, 3])
+        self.failUnlessRaises(ValueError, items.next)
+        self.failUnlessRaises(StopIteration, items.next)
+        events = yajl.iterparse(StringIO('{"a" : [1, 2], "b" : x}'))
+        self.assertEquals([events.next()[1] for i in range(6)], ['start_map', 'map_key',
+                'start_array', 'number', 'number', 'end_array'])
+        self.assertEquals(events.next(), ('', 'map_key', 'b'))
+        self.failUnlessRaises(ValueError, events.next)
+
+
+class LazyDecodeTests(unittest.TestCase):
+    doc = '{"items" : [{"id" : 1, "name" : "a\\"b"}, {"id" : 2.5, "tags" : []}], "n" : null}'
+
+    def test_access(self):
+        rc = yajl.loads_lazy(self.doc)
+        self.assert_(isinstance(rc, yajl.LazyDict))
+        self.assertEquals(len(rc), 2)
+        self.assert_('items' in rc)
+        self.assertEquals(rc['n'], None)
+        items = rc['items']
+        self.assert_(isinstance(items, yajl.LazyList))
+        self.assertEquals(len(items), 2)
+        self.assertEquals(items[0]['name'], 'a"b')
+        self.assertEquals(items[-1]['id'], 2.5)
+        self.assertEquals(items[-1].get('missing', 7), 7)
+        self.assertEquals([item['id'] for item in items], [1, 2.5])
+        self.assertEquals(sorted(items[0].keys()), ['id', 'name'])
+        self.assert_(rc['items'] is items)
+        self.failUnlessRaises(KeyError, lambda: rc['missing'])
+        self.failUnlessRaises(IndexError, lambda: items[2])
+
+    def test_materialize(self):
+        rc = yajl.loads_lazy(self.doc)
+        self.assertEquals(rc.materialize(), yajl.loads(self.doc))
+        self.assertEquals([item.materialize() for item in rc['items'][1:]],
+                [yajl.loads(self.doc)['items'][1]])
+
+    def test_duplicate_keys(self):
+        doc = '{"a" : 1, "b" : 2, "a" : 3}'
+        rc = yajl.loads_lazy(doc)
+        self.assertEquals(len(rc), len(yajl.loads(doc)))
+        self.assertEquals(len(rc), len(rc.keys()))
+        self.assertEquals(rc['a'], 3)
+
+    def test_scalars(self):
+        self.assertEquals(yajl.loads_lazy(' 12 '), 12)
+        self.assertEquals(yajl.loads_lazy('"str"'), 'str')
+
+    def test_errors(self):
+        for bad in ('', '[1, 2', '[1] [2]', '{"a" 1}'):
+            self.failUnlessRaises(ValueError, yajl.loads_lazy, bad)
+        self.failUnlessRaises(TypeError, yajl.loads_lazy, None)
+
+
+class SchemaTests(unittest.TestCase):
+    point = yajl.compile_schema([('x', int), ('y', float, 0.0)])
+
+    def test_tuples(self):
+        self.assertEquals(self.point.loads('{"y" : 2, "x" : 1}'), (1, 2.0))
+        self.assertEquals(self.point.loads('[{"x" : 1}, {"x" : null, "y" : 1.5}]'),
+                [(1, 0.0), (None, 1.5)])
+        self.assertEquals(self.point.fields, ('x', 'y'))
+
+    def test_factory(self):
+        import collections
+        Point = collections.namedtuple('Point', 'x y')
+        rc = yajl.compile_schema([('x', int), ('y', int)], factory=Point).loads('{"x" : 1, "y" : 2}')
+        self.assert_(type(rc) is Point)
+        self.assertEquals(rc.y, 2)
+        rc = yajl.compile_schema(['a'], factory=lambda a: {'a' : a}).loads('{"a" : [1]}')
+        self.assertEquals(rc, {'a' : [1]})
+
+    def test_nested(self):
+        line = yajl.compile_schema([('name', str), ('points', [self.point]), ('tags', [str], ())])
+        rc = line.loads('{"skip" : {"a" : [1, {}]}, "points" : [{"x" : 3}], "name" : "l"}')
+        self.assertEquals(rc, ('l', [(3, 0.0)], ()))
+
+    def test_extra(self):
+        schema = yajl.compile_schema([('id', int), ('ok', bool)], extra='rest')
+        self.assertEquals(schema.fields, ('id', 'ok', 'rest'))
+        self.assertEquals(schema.loads('{"id" : 1, "ok" : true}'), (1, True, None))
+        self.assertEquals(schema.loads('{"a" : [1, {"b" : null}], "id" : 1, "ok" : false}'),
+                (1, False, {'a' : [1, {'b' : None}]}))
+
+    def test_errors(self):
+        for bad in ('{"x" : 1.5}', '{"x" : "1"}', '{"y" : 1}', '[1]', '"x"', '{"x" : 1'):
+            self.failUnlessRaises(ValueError, self.point.loads, bad)
+        self.failUnlessRaises(TypeError, yajl.compile_schema, [('x', dict)])
+        self.failUnlessRaises(ValueError, yajl.compile_schema, ['x', 'x'])
+
+
+class StatsTests(unittest.TestCase):
+    def setUp(self):
+        yajl.stats(reset=True)
+        yajl.enable_stats()
+
+    def tearDown(self):
+        yajl.enable_stats(False)
+        yajl.stats(reset=True)
+
+    def test_decode(self):
+        doc = '{"a" : [1, 2.5, null, true, "x", {"b" : []}]}'
+        yajl.loads(doc)
+        yajl.loads(doc, release_gil=True)
+        rc = yajl.stats()['decode']
+        self.assertEquals(rc['documents'], 2)
+        self.assertEquals(rc['bytes'], 2 * len(doc))
+        self.assertEquals(rc['values'], {'null' : 2, 'boolean' : 2, 'integer' : 2,
+                'float' : 2, 'string' : 2, 'key' : 4, 'list' : 4, 'dict' : 4})
+        self.assertEquals(rc['max_depth'], 4)
+        self.assertEquals(rc['keys_high_water'], 2)
+        self.assert_(rc['parse_seconds'] >= 0 and rc['build_seconds'] > 0)
+
+    def test_partial_decodes(self):
+        doc = '[{"a" : 1}, {"a" : 2}, {"a" : 3}]'
+        yajl.loads(doc, paths=['/0', '/1/a', '/2'])
+        list(yajl.items(StringIO(doc), 'item'))
+        yajl.compile_schema([('a', object)]).loads(doc)
+        self.assertEquals(yajl.stats()['decode']['documents'], 3)
+
+    def test_encode(self):
+        yajl.dumps([[{'a' : 'x' * 10000}]])
+        rc = yajl.stats(reset=True)['encode']
+        self.assertEquals(rc['documents'], 1)
+        self.assertEquals(rc['bytes'], 10012)
+        self.assertEquals(rc['max_depth'], 3)
+        self.assert_(rc['buffer_grows'] >= 1)
+        self.assertEquals(yajl.stats()['encode']['documents'], 0)
+
+    def test_disabled(self):
+        yajl.enable_stats(False)
+        yajl.loads('[1]')
+        yajl.dumps([1])
+        rc = yajl.stats()
+        self.assertFalse(rc['enabled'])
+        self.assertEquals(rc['decode']['documents'], 0)
+        self.assertEquals(rc['encode']['documents'], 0)
+
 
 class DumpsOptionsTests(unittest.TestCase):
     def test_indent_four(self):
@@ -158,6 +817,9 @@ class DumpsOptionsTests(unittest.TestCase):
         expected = '{\n"foo": "bar"\n}\n'
         self.assertEquals(rc, expected)
 
+    def test_indent_string_value(self):
+        self.assertEquals(yajl.dumps('a"b', indent=2), '"a\\"b"\n')
+
     def test_indent_str(self):
         self.failUnlessRaises(TypeError, yajl.dumps, {'foo' : 'bar'}, indent='4')
 
@@ -167,6 +829,50 @@ class DumpsOptionsTests(unittest.TestCase):
         self.assertEquals(rc, '{"foo":"bar"}')
 
 
+class StreamEncodingTests(unittest.TestCase):
+    def test_dump(self):
+        value = {'foo' : ['one', 'two', ['three', 4, 5.5, None]]}
+        stream = StringIO()
+        self.assertEquals(yajl.dump(value, stream), None)
+        self.assertEquals(stream.getvalue(), yajl.dumps(value))
+
+        stream = StringIO()
+        yajl.dump(value, stream, indent=4)
+        self.assertEquals(stream.getvalue(), yajl.dumps(value, indent=4))
+
+    def test_chunks(self):
+        class Writer(object):
+            def __init__(self):
+                self.chunks = []
+            def write(self, data):
+                self.chunks.append(data)
+
+        value = [{'id' : i, 'name' : 'x' * 50} for i in range(1000)]
+        writer = Writer()
+        yajl.dump(value, writer, chunk_size=1024)
+        self.assertEquals(''.join(writer.chunks), yajl.dumps(value))
+        self.assert_(len(writer.chunks) > 50)
+        self.assert_(max(len(c) for c in writer.chunks) < 2048)
+
+    def test_lazy_generator(self):
+        stream = StringIO()
+        def rows():
+            for i in range(100):
+                yield ['row', i]
+            # Earlier rows have already reached the stream
+            self.assert_(stream.tell() > 0)
+        yajl.dump(rows(), stream, chunk_size=64)
+        self.assertEquals(stream.getvalue(), yajl.dumps([['row', i] for i in range(100)]))
+
+    def test_errors(self):
+        class BadWriter(object):
+            def write(self, data):
+                raise IOError('disk full')
+        self.failUnlessRaises(IOError, yajl.dump, range(100000), BadWriter())
+        self.failUnlessRaises(TypeError, yajl.dump, [1], 'not a stream')
+        self.failUnlessRaises(TypeError, yajl.dump, [set()], StringIO())
+
+
 class IssueSevenTest(unittest.TestCase):
 
     def test_DecodeLatin1(self):
@@ -276,9 +982,6 @@ class StressTest(unittest.TestCase):
             if not case.endswith('.json'):
                 continue
             print(case)
-            # TODO: This causes SystemError!
-            if case == 'deep_arrays.json':
-                continue
             path = os.path.join(rel_path, case)
             with open(path) as f:
                 try:
@@ -288,7 +991,7 @@ class StressTest(unittest.TestCase):
                 else:
                     try:
                         j = yajl.dumps(obj)
-                    except OverflowError as e:
+                    except (OverflowError, ValueError) as e:
                         print('\tDUMP ERROR %s: %s' % (case, e))
                     else:
                         print('\t%d bytes (%d bytes on disk)' %
@@ -31,56 +31,143 @@
  */
 #include <Python.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "py_yajl.h"
 
 #define PYARGS PyObject *self, PyObject *args, PyObject *kwargs
 
-static void InitDecoder(_YajlDecoder* decoder) {
-    py_yajl_ps_init(decoder->elements);
-    py_yajl_ps_init(decoder->keys);
-    decoder->root = NULL;
+static void InitEncoder(_YajlEncoder* encoder) {
+    encoder->_generator = NULL;
+    encoder->buffer = NULL;
+    encoder->used = 0;
+    encoder->size = 0;
+    encoder->nomem = 0;
+    encoder->stream = NULL;
+    encoder->chunk_size = 0;
+    encoder->frames = NULL;
+    encoder->depth = 0;
+    encoder->frames_size = 0;
+    encoder->max_depth = PY_YAJL_MAX_DEPTH;
+    encoder->beautify = 0;
+    encoder->keycache = NULL;
+    encoder->uncached_keys = 0;
+    encoder->shapes = NULL;
+    py_yajl_arena_init(&encoder->arena);
+}
+
+static int SetMaxDepth(_YajlEncoder *encoder, int max_depth)
+{
+    if ((max_depth < 0) || (max_depth > PY_YAJL_MAX_DEPTH)) {
+        PyErr_Format(PyExc_ValueError, "max_depth must be between 0 and %d",
+                     PY_YAJL_MAX_DEPTH);
+        return failure;
+    }
+    encoder->max_depth = (unsigned int)(max_depth);
+    return success;
+}
+
+static void FreeEncoder(_YajlEncoder* encoder) {
+    _internal_encode_free(encoder);
+    py_yajl_arena_free(&encoder->arena);
 }
 
-static void FreeDecoder(_YajlDecoder* decoder) {
-    py_yajl_ps_free(decoder->elements);
-    py_yajl_ps_init(decoder->elements);
-    py_yajl_ps_free(decoder->keys);
-    py_yajl_ps_init(decoder->keys);
-    if (decoder->root) {
-        Py_XDECREF(decoder->root);
+/*
+ * Borrows the bytes of `object` for the duration of a parse. Anything with a
+ * read buffer is accepted without copying: str, bytearray, memoryview, mmap
+ * and buffer(). Unicode is refused, its buffer is the internal UCS encoding.
+ * The view must be released with PyBuffer_Release()
+ */
+int _internal_get_input(PyObject *object, Py_buffer *view)
+{
+    const void *buffer = NULL;
+    Py_ssize_t buflen = 0;
+
+    if (PyUnicode_Check(object))
+        goto bad_type;
+
+    if (PyObject_CheckBuffer(object))
+        return PyObject_GetBuffer(object, view, PyBUF_SIMPLE) ? failure : success;
+
+    /* mmap and buffer() only implement the old-style protocol */
+    if (PyObject_AsReadBuffer(object, &buffer, &buflen)) {
+        PyErr_Clear();
+        goto bad_type;
     }
+    return PyBuffer_FillInfo(view, object, (void *)(buffer), buflen, 1,
+                             PyBUF_SIMPLE) ? failure : success;
+
+bad_type:
+    PyErr_SetString(PyExc_TypeError, "string expected");
+    return failure;
+}
+
+/*
+ * As _internal_get_input(), for input that's parsed with the GIL released.
+ * Objects with only the old-style buffer protocol (mmap, buffer()) take no
+ * export lock, so another thread could close or resize them mid-parse;
+ * they're copied into a string first.
+ */
+int _internal_get_stable_input(PyObject *object, Py_buffer *view)
+{
+    PyObject *copy;
+    int rc;
+
+    if (PyObject_CheckBuffer(object) || (PyUnicode_Check(object)))
+        return _internal_get_input(object, view);
+
+    if (_internal_get_input(object, view) != success)
+        return failure;
+    copy = PyString_FromStringAndSize((const char *)(view->buf), view->len);
+    PyBuffer_Release(view);
+    if (!copy)
+        return failure;
+    rc = _internal_get_input(copy, view);
+    Py_DECREF(copy);
+    return rc;
 }
 
 static PyObject *py_loads(PYARGS)
 {
     PyObject *result = NULL;
     PyObject *pybuffer = NULL;
-    char *buffer = NULL;
-    Py_ssize_t buflen = 0;
+    PyObject *paths = Py_None;
+    int release_gil = 0;
+    int numeric_arrays = 0;
+    Py_buffer view;
+    static char *kwlist[] = {"string", "paths", "release_gil", "numeric_arrays", NULL};
 
-    if (!PyArg_ParseTuple(args, "O", &pybuffer))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|Oii", kwlist, &pybuffer, &paths,
+                                     &release_gil, &numeric_arrays))
         return NULL;
 
-    Py_INCREF(pybuffer);
-
-    if (!PyString_Check(pybuffer)) {
-        Py_DECREF(pybuffer);
-        PyErr_SetString(PyExc_TypeError, "string expected");
+    release_gil = release_gil && (paths == Py_None);
+    if (release_gil) {
+        if (_internal_get_stable_input(pybuffer, &view) != success)
+            return NULL;
+    } else if (_internal_get_input(pybuffer, &view) != success) {
         return NULL;
     }
 
-		if (PyString_AsStringAndSize(pybuffer, &buffer, &buflen)) {
-				Py_DECREF(pybuffer);
-				return NULL;
-		}
-
     _YajlDecoder decoder;
-    InitDecoder(&decoder);
+    _internal_decode_init(&decoder);
+    decoder.numeric_arrays = numeric_arrays;
 
-    result = _internal_decode(&decoder, buffer, (unsigned int)buflen);
+    if (release_gil) {
+        result = _internal_decode_tape(&decoder, (const char *)(view.buf), view.len);
+    } else if (paths == Py_None) {
+        result = _internal_decode(&decoder, (char *)(view.buf), (unsigned int)(view.len));
+    } else {
+        result = _internal_decode_paths(&decoder, (char *)(view.buf),
+                                        (unsigned int)(view.len), paths);
+    }
 
-    FreeDecoder(&decoder);
-    Py_DECREF(pybuffer);
+    _internal_decode_free(&decoder);
+    PyBuffer_Release(&view);
     return result;
 }
 
@@ -95,20 +182,70 @@ static PyObject *py_dumps(PYARGS)
 {
     PyObject *obj = NULL;
     PyObject *result = NULL;
-    static char *kwlist[] = {"object", "indent", NULL};
+    static char *kwlist[] = {"object", "indent", "max_depth", NULL};
 
     int indent = -1;
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i", kwlist, &obj, &indent)) {
+    int max_depth = PY_YAJL_MAX_DEPTH;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ii", kwlist, &obj, &indent,
+                                     &max_depth)) {
         return NULL;
     }
 
+    _YajlEncoder encoder;
+    InitEncoder(&encoder);
+    if (SetMaxDepth(&encoder, max_depth) != success)
+        return NULL;
+
     char* spaces = NULL;
     if (indent >= 0) {
         spaces = IndentString(indent);
     }
 
+    result = _internal_encode(&encoder, obj, spaces);
+    FreeEncoder(&encoder);
+
+    if (spaces) {
+        free(spaces);
+    }
+
+    return result;
+}
+
+
+static PyObject *py_dump(PYARGS)
+{
+    PyObject *obj = NULL;
+    PyObject *stream = NULL;
+    PyObject *result = NULL;
+    static char *kwlist[] = {"object", "fp", "indent", "chunk_size", "max_depth", NULL};
+    int indent = -1;
+    int chunk_size = PY_YAJL_CHUNK_SIZE;
+    int max_depth = PY_YAJL_MAX_DEPTH;
+    char *spaces = NULL;
     _YajlEncoder encoder;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|iii", kwlist, &obj,
+                                     &stream, &indent, &chunk_size, &max_depth)) {
+        return NULL;
+    }
+
+    if (!PyObject_HasAttrString(stream, "write")) {
+        PyErr_SetString(PyExc_TypeError, "Must pass a stream object with a write() method");
+        return NULL;
+    }
+
+    InitEncoder(&encoder);
+    if (SetMaxDepth(&encoder, max_depth) != success)
+        return NULL;
+
+    if (indent >= 0) {
+        spaces = (char *)(IndentString(indent));
+    }
+
+    encoder.stream = stream;
+    encoder.chunk_size = (chunk_size > 0) ? (size_t)(chunk_size) : 1;
     result = _internal_encode(&encoder, obj, spaces);
+    FreeEncoder(&encoder);
 
     if (spaces) {
         free(spaces);
@@ -122,7 +259,9 @@ static PyObject *_internal_stream_load(PyObject *args, unsigned int blocking)
 {
     PyObject *stream = NULL;
     PyObject *buffer = NULL;
+    PyObject *chunksize = NULL;
     PyObject *result = NULL;
+    _YajlDecoder decoder;
 
     if (!PyArg_ParseTuple(args, "O", &stream)) {
         goto bad_type;
@@ -136,18 +275,36 @@ static PyObject *_internal_stream_load(PyObject *args, unsigned int blocking)
         goto bad_type;
     }
 
-    buffer = PyObject_CallMethodObjArgs(stream, __read, NULL);
-
-    if (!buffer)
+    chunksize = PyInt_FromLong(PY_YAJL_CHUNK_SIZE);
+    if (!chunksize)
         return NULL;
 
-    _YajlDecoder decoder;
-    InitDecoder(&decoder);
+    _internal_decode_init(&decoder);
+
+    for (;;) {
+        buffer = PyObject_CallMethodObjArgs(stream, __read, chunksize, NULL);
+        if (!buffer)
+            goto exit;
 
-    result = _internal_decode(&decoder, PyString_AsString(buffer),
-                              PyString_Size(buffer));
-    FreeDecoder(&decoder);
+        if (!PyString_Check(buffer)) {
+            PyErr_SetString(PyExc_TypeError, "read() did not return a string");
+            goto exit;
+        }
+        if (PyString_GET_SIZE(buffer) == 0)
+            break;
+
+        if (_internal_decode_feed(&decoder, PyString_AS_STRING(buffer),
+                                  (unsigned int)(PyString_GET_SIZE(buffer))) != success)
+            goto exit;
+        Py_DECREF(buffer);
+    }
+
+    result = _internal_decode_close(&decoder);
+
+exit:
+    _internal_decode_free(&decoder);
     Py_XDECREF(buffer);
+    Py_DECREF(chunksize);
     return result;
 
 bad_type:
@@ -160,23 +317,850 @@ static PyObject *py_load(PYARGS)
     return _internal_stream_load(args, 1);
 }
 
+/*
+ * Hands the file to the parser straight from a read-only mapping, in pieces
+ * small enough for yajl's unsigned int lengths. Files that cannot be mapped
+ * (pipes, character devices) go through the stream path instead
+ */
+#define PY_YAJL_MAP_PIECE (1U << 30)
+
+static PyObject *py_load_file(PYARGS)
+{
+    const char *path = NULL;
+    char *mapping = NULL;
+    PyObject *result = NULL;
+    struct stat st;
+    off_t offset = 0;
+    int fd;
+    _YajlDecoder decoder;
+
+    if (!PyArg_ParseTuple(args, "s", &path))
+        return NULL;
+
+    /* opening a FIFO waits for its writer, which may need the GIL */
+    Py_BEGIN_ALLOW_THREADS
+    fd = open(path, O_RDONLY);
+    Py_END_ALLOW_THREADS
+    if (fd < 0)
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)(path));
+
+    if (fstat(fd, &st) < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)(path));
+        close(fd);
+        return NULL;
+    }
+
+    /* reopening a pipe would lose what its writer has already sent */
+    if (!S_ISREG(st.st_mode)) {
+        PyObject *fp, *fpargs;
+        FILE *file = fdopen(fd, "rb");
+
+        if (!file) {
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)(path));
+            close(fd);
+            return NULL;
+        }
+        if (!(fp = PyFile_FromFile(file, (char *)(path), "rb", fclose)))
+            return NULL;
+        fpargs = PyTuple_Pack(1, fp);
+        Py_DECREF(fp);
+        if (!fpargs)
+            return NULL;
+        result = _internal_stream_load(fpargs, 1);
+        Py_DECREF(fpargs);
+        return result;
+    }
+
+    if (st.st_size > 0) {
+        mapping = mmap(NULL, (size_t)(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)(path));
+            close(fd);
+            return NULL;
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise(mapping, (size_t)(st.st_size), MADV_SEQUENTIAL);
+#endif
+    }
+    /* the mapping outlives the descriptor */
+    close(fd);
+
+    _internal_decode_init(&decoder);
+
+    while (offset < st.st_size) {
+        off_t piece = st.st_size - offset;
+
+        if (piece > PY_YAJL_MAP_PIECE)
+            piece = PY_YAJL_MAP_PIECE;
+        if (_internal_decode_feed(&decoder, mapping + offset,
+                                  (unsigned int)(piece)) != success)
+            goto exit;
+        offset += piece;
+    }
+    result = _internal_decode_close(&decoder);
+
+exit:
+    _internal_decode_free(&decoder);
+    if (mapping)
+        munmap(mapping, (size_t)(st.st_size));
+    return result;
+}
+
+/*
+ * yajl.Decoder and yajl.IncrementalDecoder share one layout: a decoder whose
+ * parser, stacks and key cache stay alive between calls
+ */
+typedef struct {
+    PyObject_HEAD
+    _YajlDecoder decoder;
+} DecoderObject;
+
+static int Decoder_init(DecoderObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "", kwlist))
+        return -1;
+
+    _internal_decode_free(&self->decoder);
+    _internal_decode_init(&self->decoder);
+    return 0;
+}
+
+static void Decoder_dealloc(DecoderObject *self)
+{
+    _internal_decode_free(&self->decoder);
+    Py_TYPE(self)->tp_free((PyObject *)(self));
+}
+
+static PyObject *Decoder_decode(DecoderObject *self, PyObject *args)
+{
+    PyObject *pybuffer = NULL;
+    PyObject *result = NULL;
+    Py_buffer view;
+
+    if (!PyArg_ParseTuple(args, "O", &pybuffer))
+        return NULL;
+
+    if (_internal_get_input(pybuffer, &view) != success)
+        return NULL;
+
+    result = _internal_decode(&self->decoder, (char *)(view.buf),
+                              (unsigned int)(view.len));
+    PyBuffer_Release(&view);
+    return result;
+}
+
+static struct PyMethodDef decoder_methods[] = {
+    {"decode", (PyCFunction)(Decoder_decode), METH_VARARGS,
+"decode(string)\n\n\
+Returns a decoded object based on the given JSON `string`"},
+    {NULL}
+};
+
+static PyTypeObject DecoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "yajl.Decoder",                             /* tp_name */
+    sizeof(DecoderObject),                      /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)(Decoder_dealloc),              /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags */
+"yajl.Decoder()\n\n\
+A reusable decoder; the parser, its stacks and the key cache are kept\n\
+between calls to `decode()`",                   /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    decoder_methods,                            /* tp_methods */
+    0,                                          /* tp_members */
+    0,                                          /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    (initproc)(Decoder_init),                   /* tp_init */
+    0,                                          /* tp_alloc */
+    PyType_GenericNew,                          /* tp_new */
+};
+
+static PyObject *IncrementalDecoder_feed(DecoderObject *self, PyObject *args)
+{
+    PyObject *pybuffer = NULL;
+    Py_buffer view;
+    int status;
+
+    if (!PyArg_ParseTuple(args, "O", &pybuffer))
+        return NULL;
+
+    if (_internal_get_input(pybuffer, &view) != success)
+        return NULL;
+
+    status = _internal_decode_feed(&self->decoder, (char *)(view.buf),
+                                   (unsigned int)(view.len));
+    PyBuffer_Release(&view);
+    if (status != success)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *IncrementalDecoder_close(DecoderObject *self)
+{
+    return _internal_decode_close(&self->decoder);
+}
+
+static PyObject *IncrementalDecoder_reset(DecoderObject *self)
+{
+    _internal_decode_reset(&self->decoder);
+    Py_RETURN_NONE;
+}
+
+static struct PyMethodDef incremental_decoder_methods[] = {
+    {"feed", (PyCFunction)(IncrementalDecoder_feed), METH_VARARGS,
+"feed(string)\n\n\
+Parses the next chunk of the JSON document. Chunks may split the\n\
+document anywhere, including in the middle of a token."},
+    {"close", (PyCFunction)(IncrementalDecoder_close), METH_NOARGS,
+"close()\n\n\
+Finishes the document fed so far and returns the decoded object.\n\
+The decoder can then be fed the next document."},
+    {"reset", (PyCFunction)(IncrementalDecoder_reset), METH_NOARGS,
+"reset()\n\n\
+Discards any partially fed document"},
+    {NULL}
+};
+
+static PyTypeObject IncrementalDecoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "yajl.IncrementalDecoder",                  /* tp_name */
+    sizeof(DecoderObject),                      /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)(Decoder_dealloc),              /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags */
+"yajl.IncrementalDecoder()\n\n\
+Decodes a single JSON document fed to it in chunks with `feed()`;\n\
+`close()` returns the decoded object",          /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    incremental_decoder_methods,                /* tp_methods */
+    0,                                          /* tp_members */
+    0,                                          /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    (initproc)(Decoder_init),                   /* tp_init */
+    0,                                          /* tp_alloc */
+    PyType_GenericNew,                          /* tp_new */
+};
+
+/*
+ * Iterator returned by yajl.loads_multi() and yajl.load_lines(): one parser
+ * in yajl's multiple values mode is fed chunk by chunk, and the top-level
+ * values completed by each chunk are handed out before the next is parsed.
+ */
+typedef struct {
+    PyObject_HEAD
+    _YajlDecoder decoder;
+    PyObject *stream;       /* load_lines(): object with a read() method */
+    PyObject *buffer;       /* loads_multi(): the whole string */
+    Py_ssize_t offset;      /* next byte of `buffer` to feed */
+    Py_ssize_t index;       /* next value of decoder.values to return */
+    int seen_data;
+    int finished;
+    PyObject *error_type;   /* raised once the values before it are out */
+    PyObject *error_value;
+    PyObject *error_traceback;
+} ValueIteratorObject;
+
+static PyTypeObject ValueIteratorType;
+
+static PyObject *NewValueIterator(PyObject *stream, PyObject *buffer)
+{
+    ValueIteratorObject *iter;
+
+    iter = PyObject_New(ValueIteratorObject, &ValueIteratorType);
+    if (!iter)
+        return NULL;
+
+    _internal_decode_init(&iter->decoder);
+    Py_XINCREF(stream);
+    iter->stream = stream;
+    Py_XINCREF(buffer);
+    iter->buffer = buffer;
+    iter->offset = 0;
+    iter->index = 0;
+    iter->seen_data = 0;
+    iter->finished = 0;
+    iter->error_type = iter->error_value = iter->error_traceback = NULL;
+
+    iter->decoder.values = PyList_New(0);
+    if (!iter->decoder.values) {
+        Py_DECREF(iter);
+        return NULL;
+    }
+    return (PyObject *)(iter);
+}
+
+static void ValueIterator_dealloc(ValueIteratorObject *self)
+{
+    _internal_decode_free(&self->decoder);
+    Py_XDECREF(self->stream);
+    Py_XDECREF(self->buffer);
+    Py_XDECREF(self->error_type);
+    Py_XDECREF(self->error_value);
+    Py_XDECREF(self->error_traceback);
+    PyObject_Del(self);
+}
+
+/*
+ * Feeds the next chunk to the parser; finishes the parse once the input is
+ * exhausted.  Empty or all-whitespace input yields no values.
+ */
+static int ValueIterator_fill(ValueIteratorObject *self)
+{
+    PyObject *chunk = NULL;
+    char *buffer;
+    Py_ssize_t length;
+    int rc;
+
+    if (self->stream) {
+        chunk = PyObject_CallMethod(self->stream, "read", "i", PY_YAJL_CHUNK_SIZE);
+        if (!chunk)
+            return failure;
+        if (!PyString_Check(chunk)) {
+            Py_DECREF(chunk);
+            PyErr_SetString(PyExc_TypeError, "read() did not return a string");
+            return failure;
+        }
+        buffer = PyString_AS_STRING(chunk);
+        length = PyString_GET_SIZE(chunk);
+    } else {
+        buffer = PyString_AS_STRING(self->buffer) + self->offset;
+        length = PyString_GET_SIZE(self->buffer) - self->offset;
+        if (length > PY_YAJL_CHUNK_SIZE)
+            length = PY_YAJL_CHUNK_SIZE;
+        self->offset += length;
+    }
+
+    if (length == 0) {
+        Py_XDECREF(chunk);
+        self->finished = 1;
+        if (!self->seen_data) {
+            _internal_decode_reset(&self->decoder);
+            return success;
+        }
+        return _internal_decode_complete(&self->decoder);
+    }
+
+    if (!self->seen_data)
+        self->seen_data = !_internal_is_blank(buffer, (unsigned int)(length));
+
+    rc = _internal_decode_feed(&self->decoder, buffer, (unsigned int)(length));
+    Py_XDECREF(chunk);
+    return rc;
+}
+
+static PyObject *ValueIterator_next(ValueIteratorObject *self)
+{
+    PyObject *values = self->decoder.values;
+    PyObject *value;
+
+    while (self->index >= PyList_GET_SIZE(values)) {
+        if (self->error_type) {
+            PyErr_Restore(self->error_type, self->error_value, self->error_traceback);
+            self->error_type = self->error_value = self->error_traceback = NULL;
+            self->finished = 1;
+        }
+        if (self->finished)
+            return NULL;
+
+        /* everything queued so far has been handed out */
+        if (PyList_SetSlice(values, 0, PyList_GET_SIZE(values), NULL) < 0)
+            return NULL;
+        self->index = 0;
+
+        /* the values the chunk completed before the error still come out */
+        if (ValueIterator_fill(self) != success) {
+            PyErr_Fetch(&self->error_type, &self->error_value, &self->error_traceback);
+            self->finished = 1;
+        }
+    }
+
+    value = PyList_GET_ITEM(values, self->index);
+    self->index++;
+    Py_INCREF(value);
+    return value;
+}
+
+static PyTypeObject ValueIteratorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "yajl.ValueIterator",                       /* tp_name */
+    sizeof(ValueIteratorObject),                /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)(ValueIterator_dealloc),        /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    0,                                          /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    PyObject_SelfIter,                          /* tp_iter */
+    (iternextfunc)(ValueIterator_next),         /* tp_iternext */
+};
+
+static PyObject *py_loads_multi(PYARGS)
+{
+    PyObject *pybuffer = NULL;
+
+    if (!PyArg_ParseTuple(args, "O", &pybuffer))
+        return NULL;
+
+    if (!PyString_Check(pybuffer)) {
+        PyErr_SetString(PyExc_TypeError, "string expected");
+        return NULL;
+    }
+    return NewValueIterator(NULL, pybuffer);
+}
+
+static PyObject *py_load_lines(PYARGS)
+{
+    PyObject *stream = NULL;
+
+    if (!PyArg_ParseTuple(args, "O", &stream) ||
+            !PyObject_HasAttrString(stream, "read")) {
+        PyErr_SetString(PyExc_TypeError, "Must pass a single stream object");
+        return NULL;
+    }
+    return NewValueIterator(stream, NULL);
+}
+
+static PyObject *py_loads_lazy(PYARGS)
+{
+    PyObject *pybuffer = NULL;
+
+    if (!PyArg_ParseTuple(args, "O", &pybuffer))
+        return NULL;
+
+    if (!PyString_Check(pybuffer)) {
+        PyErr_SetString(PyExc_TypeError, "string expected");
+        return NULL;
+    }
+    return _internal_decode_lazy(pybuffer);
+}
+
+static PyObject *py_loads_many(PYARGS)
+{
+    PyObject *sequence = NULL;
+    int threads = 0;
+    static char *kwlist[] = {"strings", "threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i", kwlist, &sequence, &threads))
+        return NULL;
+    return _internal_loads_many(sequence, threads);
+}
+
+static PyObject *py_load_ndjson_parallel(PYARGS)
+{
+    const char *path = NULL;
+    int threads = 0;
+    Py_ssize_t window = 0;
+    static char *kwlist[] = {"path", "threads", "window", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|in", kwlist, &path, &threads, &window))
+        return NULL;
+    return _internal_load_ndjson(path, threads, window);
+}
+
+static PyObject *py_compile_schema(PYARGS)
+{
+    PyObject *fields = NULL;
+    PyObject *factory = NULL;
+    PyObject *extra = NULL;
+    static char *kwlist[] = {"fields", "factory", "extra", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OO", kwlist, &fields, &factory, &extra))
+        return NULL;
+    return _internal_compile_schema(fields, factory, extra);
+}
+
+static PyObject *py_iterparse(PYARGS)
+{
+    PyObject *stream = NULL;
+
+    if (!PyArg_ParseTuple(args, "O", &stream) ||
+            !PyObject_HasAttrString(stream, "read")) {
+        PyErr_SetString(PyExc_TypeError, "Must pass a single stream object");
+        return NULL;
+    }
+    return _internal_iterparse(stream, NULL);
+}
+
+static PyObject *py_items(PYARGS)
+{
+    PyObject *stream = NULL;
+    PyObject *prefix = NULL;
+
+    if (!PyArg_ParseTuple(args, "OS", &stream, &prefix))
+        return NULL;
+    if (!PyObject_HasAttrString(stream, "read")) {
+        PyErr_SetString(PyExc_TypeError, "Must pass a single stream object");
+        return NULL;
+    }
+    return _internal_iterparse(stream, prefix);
+}
+
+/*
+ * yajl.stats(): process-wide counters, off until yajl.enable_stats()
+ */
+int _internal_stats_enabled = 0;
+py_yajl_stats _internal_stats;
+
+unsigned PY_LONG_LONG _internal_stats_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned PY_LONG_LONG)(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+}
+
+static PyObject *py_enable_stats(PYARGS)
+{
+    PyObject *enabled = Py_True;
+    int truth;
+    static char *kwlist[] = {"enabled", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &enabled))
+        return NULL;
+    truth = PyObject_IsTrue(enabled);
+    if (truth < 0)
+        return NULL;
+    _internal_stats_enabled = truth;
+    Py_RETURN_NONE;
+}
+
+static PyObject *py_stats(PYARGS)
+{
+    py_yajl_stats *st = &_internal_stats;
+    PyObject *result;
+    int reset = 0;
+    static char *kwlist[] = {"reset", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i", kwlist, &reset))
+        return NULL;
+
+    result = Py_BuildValue(
+        "{s:O,s:{s:K,s:K,s:{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K},s:I,s:I,s:I,s:d,s:d},"
+        "s:{s:K,s:K,s:K,s:I,s:d}}",
+        "enabled", _internal_stats_enabled ? Py_True : Py_False,
+        "decode",
+            "documents", st->documents,
+            "bytes", st->bytes,
+            "values",
+                "null", st->nulls,
+                "boolean", st->booleans,
+                "integer", st->integers,
+                "float", st->floats,
+                "string", st->strings,
+                "key", st->keys,
+                "list", st->lists,
+                "dict", st->dicts,
+            "max_depth", st->max_depth,
+            "elements_high_water", st->elements_high_water,
+            "keys_high_water", st->keys_high_water,
+            "parse_seconds", st->parse_ns / 1e9,
+            "build_seconds", st->build_ns / 1e9,
+        "encode",
+            "documents", st->encode_documents,
+            "bytes", st->encode_bytes,
+            "buffer_grows", st->encode_buffer_grows,
+            "max_depth", st->encode_max_depth,
+            "seconds", st->encode_ns / 1e9);
+    if ((result) && (reset))
+        memset(st, 0, sizeof(*st));
+    return result;
+}
+
+/*
+ * yajl.Encoder: a reusable encoder that keeps its yajl generator, and with
+ * it the output buffer, between calls to encode()
+ */
+typedef struct {
+    PyObject_HEAD
+    _YajlEncoder encoder;
+    char *spaces;
+} EncoderObject;
+
+static int Encoder_init(EncoderObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"indent", "max_depth", NULL};
+    int indent = -1;
+    int max_depth = PY_YAJL_MAX_DEPTH;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|ii", kwlist, &indent, &max_depth))
+        return -1;
+
+    FreeEncoder(&self->encoder);
+    InitEncoder(&self->encoder);
+    if (SetMaxDepth(&self->encoder, max_depth) != success)
+        return -1;
+    if (self->spaces) {
+        free(self->spaces);
+        self->spaces = NULL;
+    }
+    if (indent >= 0) {
+        self->spaces = (char *)(IndentString(indent));
+    }
+    return 0;
+}
+
+static void Encoder_dealloc(EncoderObject *self)
+{
+    FreeEncoder(&self->encoder);
+    if (self->spaces) {
+        free(self->spaces);
+    }
+    Py_TYPE(self)->tp_free((PyObject *)(self));
+}
+
+static PyObject *Encoder_encode(EncoderObject *self, PyObject *args)
+{
+    PyObject *obj = NULL;
+
+    if (!PyArg_ParseTuple(args, "O", &obj))
+        return NULL;
+
+    return _internal_encode(&self->encoder, obj, self->spaces);
+}
+
+static struct PyMethodDef encoder_methods[] = {
+    {"encode", (PyCFunction)(Encoder_encode), METH_VARARGS,
+"encode(obj)\n\n\
+Returns an encoded JSON string of the specified `obj`"},
+    {NULL}
+};
+
+static PyTypeObject EncoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "yajl.Encoder",                             /* tp_name */
+    sizeof(EncoderObject),                      /* tp_basicsize */
+    0,                                          /* tp_itemsize */
+    (destructor)(Encoder_dealloc),              /* tp_dealloc */
+    0,                                          /* tp_print */
+    0,                                          /* tp_getattr */
+    0,                                          /* tp_setattr */
+    0,                                          /* tp_compare */
+    0,                                          /* tp_repr */
+    0,                                          /* tp_as_number */
+    0,                                          /* tp_as_sequence */
+    0,                                          /* tp_as_mapping */
+    0,                                          /* tp_hash */
+    0,                                          /* tp_call */
+    0,                                          /* tp_str */
+    0,                                          /* tp_getattro */
+    0,                                          /* tp_setattro */
+    0,                                          /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags */
+"yajl.Encoder([indent=None, max_depth=127])\n\n\
+A reusable encoder; the generator and its output buffer are kept\n\
+between calls to `encode()`. `indent` and `max_depth` are as for\n\
+`yajl.dumps()`",
+                                                /* tp_doc */
+    0,                                          /* tp_traverse */
+    0,                                          /* tp_clear */
+    0,                                          /* tp_richcompare */
+    0,                                          /* tp_weaklistoffset */
+    0,                                          /* tp_iter */
+    0,                                          /* tp_iternext */
+    encoder_methods,                            /* tp_methods */
+    0,                                          /* tp_members */
+    0,                                          /* tp_getset */
+    0,                                          /* tp_base */
+    0,                                          /* tp_dict */
+    0,                                          /* tp_descr_get */
+    0,                                          /* tp_descr_set */
+    0,                                          /* tp_dictoffset */
+    (initproc)(Encoder_init),                   /* tp_init */
+    0,                                          /* tp_alloc */
+    PyType_GenericNew,                          /* tp_new */
+};
+
 static struct PyMethodDef yajl_methods[] = {
     {"dumps", (PyCFunctionWithKeywords)(py_dumps), METH_VARARGS | METH_KEYWORDS,
-"yajl.dumps(obj [, indent=None])\n\n\
+"yajl.dumps(obj [, indent=None, max_depth=127])\n\n\
 Returns an encoded JSON string of the specified `obj`\n\
 \n\
 If `indent` is a non-negative integer, then JSON array elements \n\
 and object members will be pretty-printed with that indent level. \n\
 An indent level of 0 will only insert newlines. None (the default) \n\
 selects the most compact representation.\n\
+\n\
+Lists and dicts nested more than `max_depth` deep raise ValueError, as\n\
+do circular references; 127 is also the most yajl supports.\n\
+"},
+    {"dump", (PyCFunction)(py_dump), METH_VARARGS | METH_KEYWORDS,
+"yajl.dump(obj, fp [, indent=None, chunk_size=65536, max_depth=127])\n\n\
+Encodes `obj` as JSON and writes it to the `fp` stream-like object\n\
+\n\
+Output is passed to `fp.write()` whenever roughly `chunk_size` bytes\n\
+have been generated, so memory use doesn't grow with the document.\n\
+Generators in `obj` are consumed as the output is written. `indent`\n\
+and `max_depth` are as for `yajl.dumps()`.\n\
+"},
+    {"loads", (PyCFunction)(py_loads), METH_VARARGS | METH_KEYWORDS,
+"yajl.loads(string [, paths=None, release_gil=False, numeric_arrays=False])\n\n\
+Returns a decoded object based on the given JSON `string`; bytearray,\n\
+memoryview, mmap and buffer objects are parsed in place without a copy\n\
+\n\
+If `paths` is given, only the values at those paths are decoded and a\n\
+dict mapping each path that matched to its value is returned instead.\n\
+Paths are JSON Pointers (\"/items/0/name\") or dotted (\"items.0.name\");\n\
+the empty path is the whole document. Everything else in the document\n\
+is checked but skipped without creating any objects.\n\
+\n\
+With `release_gil`, the document is first parsed into a flat intermediate\n\
+form with the GIL released, so other threads keep running; the objects\n\
+are created from it afterwards. It has no effect together with `paths`.\n\
+mmap and buffer() objects are copied first in this case, since they\n\
+can't be locked against changes made while the GIL is released.\n\
+\n\
+With `numeric_arrays`, a non-empty array whose items are all ints (that\n\
+fit a C long) or all floats becomes an `array.array` of type 'l' or 'd'\n\
+instead of a list, without creating an object per item; any other array\n\
+is still a list.\n\
 "},
-    {"loads", (PyCFunction)(py_loads), METH_VARARGS,
-"yajl.loads(string)\n\n\
-Returns a decoded object based on the given JSON `string`"},
     {"load", (PyCFunction)(py_load), METH_VARARGS,
 "yajl.load(fp)\n\n\
 Returns a decoded object based on the JSON read from the `fp` stream-like\n\
-object; *Note:* It is expected that `fp` supports the `read()` method"},
+object; *Note:* It is expected that `fp` supports the `read(size)` method.\n\
+The stream is read and parsed in fixed-size chunks."},
+    {"load_file", (PyCFunction)(py_load_file), METH_VARARGS,
+"yajl.load_file(path)\n\n\
+Returns a decoded object based on the JSON in the file at `path`. Regular\n\
+files are mapped read-only and parsed in place rather than read into\n\
+strings first."},
+    {"loads_multi", (PyCFunction)(py_loads_multi), METH_VARARGS,
+"yajl.loads_multi(string)\n\n\
+Returns an iterator over the whitespace-separated JSON values in `string`"},
+    {"loads_many", (PyCFunction)(py_loads_many), METH_VARARGS | METH_KEYWORDS,
+"yajl.loads_many(strings [, threads=0])\n\n\
+Returns a list of the objects decoded from each JSON string in `strings`,\n\
+in order. The strings are parsed in parallel by `threads` native threads\n\
+(one per CPU if 0) with the GIL released; mmap and buffer() objects are\n\
+copied first. A string that isn't valid JSON gets the ValueError it\n\
+would have raised in its place in the list."},
+    {"load_ndjson_parallel", (PyCFunction)(py_load_ndjson_parallel),
+        METH_VARARGS | METH_KEYWORDS,
+"yajl.load_ndjson_parallel(path [, threads=0, window=1MB])\n\n\
+Returns an iterator over the records of the newline-delimited JSON file at\n\
+`path`, in file order. The file is split at newlines into windows of\n\
+about `window` bytes, and each window's records are parsed in parallel by\n\
+`threads` native threads (one per CPU if 0), so memory use is bounded by\n\
+the window rather than the file. Blank lines are skipped; an invalid\n\
+record raises ValueError and ends the iteration."},
+    {"loads_lazy", (PyCFunction)(py_loads_lazy), METH_VARARGS,
+"yajl.loads_lazy(string)\n\n\
+Parses the JSON `string` without building the object graph. Arrays and\n\
+objects come back as read-only `LazyList` and `LazyDict` proxies whose\n\
+members are decoded only when they're accessed; `materialize()` on a\n\
+proxy returns what `yajl.loads()` would have. The proxies keep `string`\n\
+alive."},
+    {"compile_schema", (PyCFunction)(py_compile_schema), METH_VARARGS | METH_KEYWORDS,
+"yajl.compile_schema(fields [, factory=None, extra=None])\n\n\
+Returns a Schema whose `loads(string)` decodes a JSON object straight\n\
+into a record, or a JSON array of objects into a list of records, without\n\
+building dicts. Each of `fields` is a name, (name, type) or (name, type,\n\
+default); a type is str, int, float, bool, object (anything), another\n\
+Schema, or [type] for an array of that type. Values are type-checked as\n\
+they're parsed: ints are accepted for float fields, null for any field,\n\
+and a missing field without a default raises ValueError. Records are\n\
+tuples in field order, unless `factory` (a namedtuple or any callable\n\
+taking the fields positionally) builds them. Unknown keys are skipped,\n\
+or with `extra` decoded into a dict in one more slot at the end (None\n\
+when there were none)."},
+    {"iterparse", (PyCFunction)(py_iterparse), METH_VARARGS,
+"yajl.iterparse(fp)\n\n\
+Returns an iterator over the parse events of the JSON document read from\n\
+the `fp` stream-like object, as (prefix, event, value) tuples in the\n\
+style of ijson. `event` is one of null, boolean, number, string,\n\
+map_key, start_map, end_map, start_array or end_array; `prefix` joins\n\
+the keys leading to the value with '.', using \"item\" for array\n\
+elements. The stream is read in large chunks, so memory use doesn't\n\
+grow with the document."},
+    {"items", (PyCFunction)(py_items), METH_VARARGS,
+"yajl.items(fp, prefix)\n\n\
+Returns an iterator over the values at `prefix` (as for\n\
+`yajl.iterparse()`) in the JSON document read from `fp`, each one\n\
+fully decoded; e.g. items(fp, \"item\") yields the elements of a\n\
+top-level array one at a time."},
+    {"load_lines", (PyCFunction)(py_load_lines), METH_VARARGS,
+"yajl.load_lines(fp)\n\n\
+Returns an iterator over the JSON values read from the `fp` stream-like\n\
+object, e.g. a JSON Lines (NDJSON) file. The stream is read in large\n\
+chunks; values may be separated by newlines or any other whitespace."},
+    {"enable_stats", (PyCFunction)(py_enable_stats), METH_VARARGS | METH_KEYWORDS,
+"yajl.enable_stats(enabled=True)\n\n\
+Turns the counters reported by `yajl.stats()` on or off. They cost next\n\
+to nothing while off; while on, each decoded value is also timed."},
+    {"stats", (PyCFunction)(py_stats), METH_VARARGS | METH_KEYWORDS,
+"yajl.stats(reset=False)\n\n\
+Returns what this process has decoded and encoded since the counters\n\
+were turned on or last reset, as a dict. `decode` holds the documents\n\
+and bytes parsed, the values built by type, the deepest nesting, the\n\
+high-water marks of the element and key stacks, and the time spent\n\
+parsing and building objects; `encode` holds the documents and bytes\n\
+written, how often the output buffer grew, the deepest nesting and the\n\
+time spent. With `reset` the counters are zeroed afterwards."},
     {NULL}
 };
 
@@ -196,5 +1180,31 @@ json.dumps():\t\t7760.6348ms\n\
 simplejson.dumps():\t930.9748ms\n\
 yajl.dumps():\t\t681.0221ms"
 );
+
+    if (!module)
+        return;
+
+    if (PyType_Ready(&DecoderType) < 0)
+        return;
+    if (PyType_Ready(&IncrementalDecoderType) < 0)
+        return;
+    if (PyType_Ready(&EncoderType) < 0)
+        return;
+    if (PyType_Ready(&ValueIteratorType) < 0)
+        return;
+    if (_internal_lazy_init(module) != success)
+        return;
+    if (_internal_events_init(module) != success)
+        return;
+    if (_internal_batch_init(module) != success)
+        return;
+    if (_internal_schema_init(module) != success)
+        return;
+    Py_INCREF(&DecoderType);
+    PyModule_AddObject(module, "Decoder", (PyObject *)(&DecoderType));
+    Py_INCREF(&IncrementalDecoderType);
+    PyModule_AddObject(module, "IncrementalDecoder", (PyObject *)(&IncrementalDecoderType));
+    Py_INCREF(&EncoderType);
+    PyModule_AddObject(module, "Encoder", (PyObject *)(&EncoderType));
 }
 